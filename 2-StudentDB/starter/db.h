@@ -29,7 +29,234 @@ static const int STUDENT_RECORD_SIZE  = sizeof(struct student);
 static const int DELETED_STUDENT_ID = 0;
 
 
+//Optional header at the front of the database file.  A file without it
+//(the original format, "version 0") keeps the slot for student id N at
+//offset N * STUDENT_RECORD_SIZE.  A version 1 file starts with a header of
+//DB_HDR_SIZE bytes holding the number of live records and an occupancy
+//bitmap with one bit per student id, the slots follow right after it at
+//DB_HDR_SIZE + N * STUDENT_RECORD_SIZE.  The magic sits in what would be
+//the slot of id 0, which is never used by a version 0 file.
+//
+//compress_db() writes a compacted version 1 file (DB_FLAG_COMPACT).  It
+//only keeps the 64 bytes of fixed fields of the header, no bitmap: right
+//after them comes a directory with the sorted ids of the stored students
+//(entries ints), then the records themselves in the same order starting
+//at DB_COMPACT_DATA_OFF(entries), the next record boundary.  The record of
+//the id found at index i of the directory lives at
+//DB_COMPACT_DATA_OFF(entries) + i * 64.
+//
+//When every stored last name is a dictionary code (see the last name
+//dictionary below) the records are packed instead (DB_FLAG_PACKED): lname shrinks
+//to its code, a db_packed_t of DB_PACKED_RECORD_SIZE bytes, and the
+//record of index i lives at DB_COMPACT_DATA_OFF(entries) + i * 36.
+#define DB_MAGIC        0x31424453      //"SDB1"
+#define DB_VERSION      1
+#define DB_HDR_SIZE     16384           //keeps the slots page aligned
+#define DB_BITMAP_OFF   64              //bitmap follows the fixed fields
+#define DB_BITMAP_SIZE  ((MAX_STD_ID + 8) / 8)
+
+#define DB_COMPACT_DIR_OFF  DB_BITMAP_OFF   //directory follows the fixed fields
+#define DB_COMPACT_DATA_OFF(entries) \
+    ((DB_COMPACT_DIR_OFF + (off_t)(entries) * (off_t)sizeof(int) + 63) & ~(off_t)63)
+
+//format options kept in db_header_t.flags
+#define DB_FLAG_COMPACT     0x0001  //packed records behind a sorted id directory
+#define DB_FLAG_SLOT_HDR    0x0002  //compact file made from a version 1 slot
+                                    //file, expanding it restores the header
+#define DB_FLAG_PACKED      0x0004  //compact file of db_packed_t records
+
+typedef struct db_packed{
+    int id;
+    char fname[24];
+    unsigned int lname_code;    //dictionary code of the last name, 0: empty
+    int gpa;
+} db_packed_t;
+#define DB_PACKED_RECORD_SIZE   ((int)sizeof(db_packed_t))
+
+typedef struct db_header{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int flags;         //DB_FLAG_* format options
+    int count;                  //number of live student records
+    int entries;                //compact files: ids in the directory
+    int min_id;                 //compact files: first id of the directory
+    int max_id;                 //compact files: last id of the directory
+    int base_id;                //shards: id of the first slot, see below
+    char reserved[32];          //pads the fixed fields to 64 bytes
+} db_header_t;
+
+//Sharded database: a directory holding one version 1 database per range
+//of DB_SHARD_IDS ids, each in a subdirectory of its own named after the
+//range number (DB_SHARD_NAME) together with its log and index files.  The
+//header of shard k has base_id = k * DB_SHARD_IDS, its slot i and bitmap
+//bit i belong to id base_id + i.  A shard never holds more ids than a
+//plain database, the ids of the whole database reach DB_SHARD_MAX_ID.
+#define DB_SHARD_DIR        "student.shards"
+#define DB_SHARD_NAME       "%04d"
+#define DB_SHARD_IDS        100000
+#define DB_MAX_SHARDS       1000
+#define DB_SHARD_MAX_ID     (DB_SHARD_IDS * DB_MAX_SHARDS - 1)
+
+//Secondary index on last names (see sdbsc_index.c).  The file starts with
+//an idx_header_t, followed by the fence keys (the first last name of every
+//page of IDX_PAGE_ENTRIES entries), then run_count entries sorted by last
+//name and id.  add/del append to a delta log after the sorted run; an entry
+//with a negative id in the log records a removal.  Once the log holds
+//IDX_DELTA_MAX entries the index is rebuilt.
+#define IDX_MAGIC           0x4c424453      //"SDBL"
+#define IDX_VERSION         1
+#define IDX_KEY_LEN         32              //same as student_t.lname
+#define IDX_PAGE_ENTRIES    128
+#define IDX_DELTA_MAX       4096
+
+typedef struct idx_header{
+    unsigned int magic;
+    unsigned int version;
+    int run_count;              //entries in the sorted run
+    int fence_count;            //one fence key per page of the run
+    char reserved[48];
+} idx_header_t;
+
+typedef struct idx_entry{
+    char lname[IDX_KEY_LEN];
+    int id;
+} idx_entry_t;
+
+#define IDX_RUN_OFF(fences)  ((off_t)sizeof(idx_header_t) + (off_t)(fences) * IDX_KEY_LEN)
+
+//Write-ahead log (see sdbsc_wal.c).  A plain sequence of wal_rec_t, each
+//holding the full new contents of one slot (all zeros for a delete) and a
+//checksum over everything after the sum field, so a record torn by a crash
+//is recognized and ends the replay.  Checkpoints truncate the file.
+#define WAL_MAGIC           0x57424453      //"SDBW"
+
+typedef struct wal_rec{
+    unsigned int magic;
+    unsigned int sum;           //FNV-1a of lsn, id and rec
+    unsigned long long lsn;     //log sequence number, from 1
+    int id;                     //slot the record belongs to
+    int reserved;
+    student_t rec;
+} wal_rec_t;
+
+//Hot column (see sdbsc_column.c): a shadow of the id and gpa of every slot,
+//8 bytes each, so scans that only look at numbers read an eighth of the
+//database.  A col_header_t, then the col_slot_t of slot i at COL_DATA_OFF
+//+ i * sizeof(col_slot_t), slot i belonging to id base_id + i as in the
+//database.  The names stay in the database file.  The file may end before
+//the last slot, missing slots are empty.
+#define COL_MAGIC           0x43424453      //"SDBC"
+#define COL_VERSION         1
+#define COL_DATA_OFF        4096
+
+typedef struct col_header{
+    unsigned int magic;
+    unsigned int version;
+    int base_id;                //same as the database it shadows
+    char reserved[52];
+} col_header_t;
+
+typedef struct col_slot{
+    int id;                     //0 for an empty slot
+    int gpa;
+} col_slot_t;
+
+#define COL_PENDING_ID      -1              //slot changing, read the database
+
+//Overflow heap for long names (see sdbsc_names.c).  With SDBSC_LONG_NAMES=1
+//a name longer than its field is appended to the heap and the field keeps
+//a prefix of it, a 0 byte at NAME_REF_OFF(size) and the heap offset of the
+//name_entry_t in the last NAME_REF_LEN bytes.  A name that fits is stored
+//as always, its field ends in zeros, so a field holding a 0 at
+//NAME_REF_OFF(size) and a nonzero offset after it can only be a reference.
+//The heap is append-only: a name_heap_header_t, then the entries.
+#define NAME_HEAP_MAGIC     0x4e424453      //"SDBN"
+#define NAME_HEAP_MAX_LEN   255             //longer names are cut there
+#define NAME_REF_LEN        4
+#define NAME_REF_OFF(size)  ((size) - NAME_REF_LEN - 1)
+
+typedef struct name_heap_header{
+    unsigned int magic;
+    char reserved[60];
+} name_heap_header_t;
+
+typedef struct name_entry{
+    unsigned short len;         //bytes of the name that follow, no 0 byte
+    char name[];
+} name_entry_t;
+
+//Last name dictionary (see sdbsc_names.c).  With SDBSC_LNAME_DICT=1 lname
+//holds a 0 byte and then, in the next NAME_CODE_LEN bytes, the code of the
+//name in the dictionary, the rest of the field stays zero.  Plain names
+//never start with a 0 byte (an empty field is all zeros, code 0), and a
+//heap reference keeps a prefix there.  The file is append-only: a
+//name_dict_header_t, then one NAME_DICT_KEY_LEN entry per name, the entry
+//of code c at sizeof(name_dict_header_t) + (c - 1) * NAME_DICT_KEY_LEN.
+#define NAME_DICT_MAGIC     0x44424453      //"SDBD"
+#define NAME_DICT_KEY_LEN   32              //same as student_t.lname
+#define NAME_CODE_LEN       4
+
+typedef struct name_dict_header{
+    unsigned int magic;
+    char reserved[60];
+} name_dict_header_t;
+
+//Block generation map of backups (see sdbsc_backup.c).  Once -B has run,
+//every write to the database stamps the GEN_BLOCK bytes blocks it touched
+//with the current generation of the map: a gen_header_t, then one unsigned
+//int per block, the one of block b at GEN_DATA_OFF + b * 4.  A backup keeps
+//the generation it copied in its backup_info_t and starts the next one, an
+//incremental backup copies the blocks stamped after that.  The map belongs
+//to one database file (dev, ino) and one history of backups (map_id), a
+//map that does not match the file is replaced and the next backup is full.
+#define GEN_MAGIC           0x47424453      //"SDBG"
+#define GEN_VERSION         1
+#define GEN_BLOCK           4096
+#define GEN_DATA_OFF        64
+
+typedef struct gen_header{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int gen;           //generation writes are stamped with now
+    unsigned int reserved0;
+    unsigned long long map_id;  //random, new for every map
+    unsigned long long dev;     //database file the map belongs to
+    unsigned long long ino;
+    char reserved[24];
+} gen_header_t;
+
+//Backup directory written by -B: a copy of the database keeping its holes,
+//copies of the name heap and dictionary if there are any, and BACKUP_INFO
+//describing what was copied.  The index and the hot column are left out,
+//they are rebuilt on first use after -R.
+#define BACKUP_MAGIC        0x4b424453      //"SDBK"
+#define BACKUP_VERSION      1
+
+typedef struct backup_info{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int gen;           //writes stamped up to this one are copied
+    unsigned int reserved0;
+    unsigned long long map_id;  //gen_header_t the backup was taken with
+    unsigned long long dev;
+    unsigned long long ino;
+    long long size;             //of the database file
+    char reserved[16];
+} backup_info_t;
+
 #define DB_FILE     "student.db"            //name of database file
 #define TMP_DB_FILE ".tmp_student.db"       //for extra credit
+#define LNAME_IDX_FILE      "student.db.lname"      //last name index
+#define TMP_LNAME_IDX_FILE  ".tmp_student.db.lname"
+#define WAL_FILE            "student.db.wal"        //write-ahead log
+#define COL_FILE            "student.db.col"        //hot id and gpa column
+#define TMP_COL_FILE        ".tmp_student.db.col"
+#define NAME_HEAP_FILE      "student.db.names"      //overflow heap of long names
+#define NAME_DICT_FILE      "student.db.dict"       //last name dictionary
+#define TMP_SORT_FILE       ".tmp_student.db.sortXXXXXX"    //spill file of -p --sort
+#define GEN_MAP_FILE        "student.db.gen"        //block generations for -B
+#define TMP_GEN_MAP_FILE    ".tmp_student.db.gen"
+#define BACKUP_INFO         "student.db.backup"     //in the backup directory
+#define TMP_BACKUP_INFO     ".tmp_student.db.backup"
 
 #endif
\ No newline at end of file
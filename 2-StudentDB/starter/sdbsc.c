@@ -1,438 +1,3267 @@
+#define _GNU_SOURCE // SEEK_DATA/SEEK_HOLE and friends
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h> //c library for system call file routines
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <time.h>
+#include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 
 // database include files
 #include "db.h"
 #include "sdbsc.h"
 
 /*
- *  open_db
- *      dbFile:  name of the database file
- *      should_truncate:  indicates if opening the file also empties it
- *
- *  returns:  File descriptor on success, or ERR_DB_FILE on failure
- *
- *  console:  Does not produce any console I/O on success
- *            M_ERR_DB_OPEN on error
- *
+ *  Every open database fd gets a handle describing how its records are
+ *  reached.  data_off is where the slot of id 0 lives, 0 for the original
+ *  headerless format and DB_HDR_SIZE for a version 1 file.  A compacted
+ *  file has no slot per id, data_off is where its packed records start and
+ *  ids are found through the directory (see locate_slot()), rec_len is
+ *  what each of them takes (see pack_record()).  With the mmap
+ *  backend the handle owns a MAP_SHARED view of the header and the whole
+ *  id space, so the slot for a student id is simply
+ *  map + data_off + id * STUDENT_RECORD_SIZE.  The mapping is created once
+ *  and is larger than the file; file_len tracks how much of it is backed by
+ *  the file, touching a page past the end of the file would raise SIGBUS.
+ *  A shard of a sharded database (see sdbsc_shard.c) keeps the ids from
+ *  base_id on, its slots and bitmap bits are counted from there.
  */
-int open_db(char *dbFile, bool should_truncate)
+#define DB_DIR_PROBE    1024    // directory entries read per search probe
+#define DB_MGET_GAP     4096    // bytes read through to merge two lookups
+#define DB_LOCK_SLOTS   ((off_t)1 << 40)    // record lock of id 0, see lock_slots()
+#define DB_LOCK_HDR     (DB_LOCK_SLOTS - STUDENT_RECORD_SIZE)   // header lock
+#define DB_LOCK_COL     (DB_LOCK_HDR - STUDENT_RECORD_SIZE)     // column build lock
+#define DB_LOCK_IDX     (DB_LOCK_COL - STUDENT_RECORD_SIZE)     // last name index lock
+#ifndef IOV_MAX
+#define IOV_MAX         1024
+#endif
+#define DB_MAP_LEN      ((size_t)(MAX_STD_ID + 1) * sizeof(student_t))
+
+typedef struct db_handle
 {
-    // Set permissions: rw-rw----
-    // see sys/stat.h for constants
-    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
+    bool in_use;
+    bool has_header; // version 1 file, see db.h
+    unsigned flags;  // DB_FLAG_* from the header
+    int entries;     // compact files: size of the id directory
+    int min_id;      // compact files: first and last directory id
+    int max_id;
+    off_t data_off;  // file offset of the first slot
+    int rec_len;     // bytes per record in the file
+    int base_id;     // id kept in the first slot, 0 unless a shard
+    int backend;     // DB_BACKEND_FD or DB_BACKEND_MMAP
+    char *map;       // base of the mapping, NULL with the fd backend
+    size_t map_len;
+    off_t file_len;  // bytes of the mapping backed by the file
+    bool sync;       // msync() modified records before returning
+    bool no_log;     // opened without the write-ahead log, see open_db()
+} db_handle_t;
 
-    // open the file if it exists for Read and Write,
-    // create it if it does not exist
-    int flags = O_RDWR | O_CREAT;
+static db_handle_t db_handles[DB_MAX_HANDLES];
 
-    if (should_truncate)
-        flags += O_TRUNC;
+static pthread_mutex_t hdr_lock = PTHREAD_MUTEX_INITIALIZER;
+static int scan_threads = 1;
 
-    // Now open file
-    int fd = open(dbFile, flags, mode);
+static db_handle_t *db_handle(int fd)
+{
+    if (fd < 0 || fd >= DB_MAX_HANDLES || !db_handles[fd].in_use)
+        return NULL;
+    return &db_handles[fd];
+}
 
-    if (fd == -1)
-    {
-        // Handle the error
-        printf(M_ERR_DB_OPEN);
-        return ERR_DB_FILE;
-    }
+// first id the slots of the file start at
+int db_base_id(int fd)
+{
+    db_handle_t *h = db_handle(fd);
+    return (h != NULL) ? h->base_id : 0;
+}
 
-    return fd;
+// position of id among the slots and occupancy bits of the file
+static int slot_index(int fd, int id)
+{
+    return id - db_base_id(fd);
+}
+
+// file offset of the slot for id
+static off_t slot_offset(int fd, int id)
+{
+    db_handle_t *h = db_handle(fd);
+    off_t base = (h != NULL) ? h->data_off : 0;
+    return base + (off_t)slot_index(fd, id) * STUDENT_RECORD_SIZE;
+}
+
+static bool db_has_header(int fd)
+{
+    db_handle_t *h = db_handle(fd);
+    return h != NULL && h->has_header;
+}
+
+static bool db_is_compact(int fd)
+{
+    db_handle_t *h = db_handle(fd);
+    return h != NULL && (h->flags & DB_FLAG_COMPACT);
+}
+
+static bool db_is_packed(int fd)
+{
+    db_handle_t *h = db_handle(fd);
+    return h != NULL && (h->flags & DB_FLAG_PACKED);
+}
+
+// bytes a record takes in the file
+static int db_rec_len(int fd)
+{
+    db_handle_t *h = db_handle(fd);
+    return (h != NULL && h->rec_len > 0) ? h->rec_len : STUDENT_RECORD_SIZE;
 }
 
 /*
- *  get_student
- *      fd:  linux file descriptor
- *      id:  the student id we are looking forname of the
- *      *s:  a pointer where the located (if found) student data will be
- *           copied
+ *  pack_record
+ *      s:  record to store in a packed file
+ *      p:  receives its packed form
  *
- *  returns:  NO_ERROR       student located and copied into *s
- *            ERR_DB_FILE    database file I/O issue
- *            SRCH_NOT_FOUND student was not located in the database
+ *  A packed file keeps only the dictionary code of lname, which is a 0
+ *  byte, the code and zeros in a student_t (see db.h).
  *
- *  console:  Does not produce any console I/O used by other functions
+ *  returns:  false if lname holds a name rather than a code, the record
+ *            then needs a full slot
  */
-int get_student(int fd, int id, student_t *s)
+static bool pack_record(const student_t *s, db_packed_t *p)
 {
-    off_t offset = id * STUDENT_RECORD_SIZE;
-    if (lseek(fd, offset, SEEK_SET) < 0)
+    if (s->lname[0] != '\0')
+        return false;
+    for (size_t i = 1 + NAME_CODE_LEN; i < sizeof(s->lname); i++)
     {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
+        if (s->lname[i] != '\0')
+            return false;
     }
-    ssize_t bytes = read(fd, s, STUDENT_RECORD_SIZE);
-    if (bytes == 0) {
-        /* No record written at this offset yet – treat as empty */
-        memset(s, 0, sizeof(student_t));
+    p->id = s->id;
+    memcpy(p->fname, s->fname, sizeof(p->fname));
+    memcpy(&p->lname_code, s->lname + 1, NAME_CODE_LEN);
+    p->gpa = s->gpa;
+    return true;
+}
+
+static void unpack_record(const db_packed_t *p, student_t *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->id = p->id;
+    memcpy(s->fname, p->fname, sizeof(s->fname));
+    memcpy(s->lname + 1, &p->lname_code, NAME_CODE_LEN);
+    s->gpa = p->gpa;
+}
+
+// whether the slot layout of the database (the one a compacted file
+// expands to) carries a version 1 header
+static bool db_slots_have_header(int fd)
+{
+    db_handle_t *h = db_handle(fd);
+    if (h == NULL || !h->has_header)
+        return false;
+    return !(h->flags & DB_FLAG_COMPACT) || (h->flags & DB_FLAG_SLOT_HDR);
+}
+
+/*
+ *  compact_find
+ *      fd:     linux file descriptor of a compacted database
+ *      h:      handle of fd
+ *      id:     student id to look up
+ *      index:  receives the position of id in the directory
+ *
+ *  Searches the sorted id directory.  Every probe reads a page worth of
+ *  directory entries; the page is picked by interpolating id between the
+ *  ids known at the ends of the remaining range, which lands on the right
+ *  page at once for the dense id ranges typical of a roster.  A probe that
+ *  misses is followed by a plain bisection step, so the number of reads
+ *  stays O(log n) whatever the id distribution.
+ *
+ *  When id is not in the directory *index receives the position it would
+ *  be inserted at, so ranges of ids can be located too.
+ *
+ *  returns:  NO_ERROR, SRCH_NOT_FOUND or ERR_DB_FILE
+ */
+static int compact_find(int fd, db_handle_t *h, int id, int *index)
+{
+    int dir[DB_DIR_PROBE];
+    int lo = 0, hi = h->entries - 1;
+    long lo_id = h->min_id, hi_id = h->max_id;
+    bool interpolate = true;
+
+    *index = (h->entries == 0 || id < h->min_id) ? 0 : h->entries;
+    if (h->entries == 0 || id < h->min_id || id > h->max_id)
         return SRCH_NOT_FOUND;
-    }
-    if (bytes != STUDENT_RECORD_SIZE)
-    {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
-    }
-    if (s->id == 0)
+
+    while (lo <= hi)
     {
+        long guess = lo + (hi - lo) / 2;
+        if (interpolate && hi_id > lo_id)
+            guess = lo + (long)(hi - lo) * (id - lo_id) / (hi_id - lo_id);
+
+        int wlo = guess - DB_DIR_PROBE / 2;
+        if (wlo < lo)
+            wlo = lo;
+        int whi = wlo + DB_DIR_PROBE - 1;
+        if (whi > hi)
+        {
+            whi = hi;
+            wlo = (whi - DB_DIR_PROBE + 1 > lo) ? whi - DB_DIR_PROBE + 1 : lo;
+        }
+
+        int n = whi - wlo + 1;
+        ssize_t len = (ssize_t)n * sizeof(int);
+        if (io_pread(fd, dir, len, DB_COMPACT_DIR_OFF + (off_t)wlo * sizeof(int)) != len)
+            return ERR_DB_FILE;
+
+        if (id < dir[0])
+        {
+            hi = wlo - 1;
+            hi_id = dir[0];
+            interpolate = !interpolate;
+            continue;
+        }
+        if (id > dir[n - 1])
+        {
+            lo = whi + 1;
+            lo_id = dir[n - 1];
+            interpolate = !interpolate;
+            continue;
+        }
+
+        // the id, if present, is inside this page of the directory
+        int a = 0, b = n - 1;
+        while (a <= b)
+        {
+            int mid = a + (b - a) / 2;
+            if (dir[mid] == id)
+            {
+                *index = wlo + mid;
+                return NO_ERROR;
+            }
+            if (dir[mid] < id)
+                a = mid + 1;
+            else
+                b = mid - 1;
+        }
+        *index = wlo + a;
         return SRCH_NOT_FOUND;
     }
-    return NO_ERROR;
+    *index = lo;
+    return SRCH_NOT_FOUND;
 }
 
 /*
- *  add_student
- *      fd:     linux file descriptor
- *      id:     student id (range is defined in db.h )
- *      fname:  student first name
- *      lname:  student last name
- *      gpa:    GPA as an integer (range defined in db.h)
- *
- *  Adds a new student to the database.  After calculating the index for the
- *  student, check if there is another student already at that location.  A good
- *  way is to use something like memcmp() to ensure that the location for this
- *  student contains all zero byes indicating the space is empty.
- *
- *  returns:  NO_ERROR       student added to database
- *            ERR_DB_FILE    database file I/O issue
- *            ERR_DB_OP      database operation logically failed (aka student
- *                           already exists)
+ *  locate_slot
+ *      fd:      linux file descriptor
+ *      id:      student id
+ *      offset:  receives the file offset of the record for id
  *
+ *  Slot files compute the offset from the id.  Compacted files only have
+ *  records for the ids in their directory, for any other id there is no
+ *  place to read or write.
  *
- *  console:  M_STD_ADDED       on success
- *            M_ERR_DB_ADD_DUP  student already exists
- *            M_ERR_DB_READ     error reading or seeking the database file
- *            M_ERR_DB_WRITE    error writing to db file (adding student)
+ *  returns:  NO_ERROR, SRCH_NOT_FOUND (compacted file without id) or
+ *            ERR_DB_FILE
+ */
+static int locate_slot(int fd, int id, off_t *offset)
+{
+    db_handle_t *h = db_handle(fd);
+    int index;
+
+    if (h == NULL || !(h->flags & DB_FLAG_COMPACT))
+    {
+        *offset = slot_offset(fd, id);
+        return NO_ERROR;
+    }
+
+    int rc = compact_find(fd, h, id, &index);
+    if (rc == NO_ERROR)
+        *offset = h->data_off + (off_t)index * h->rec_len;
+    return rc;
+}
+
+/*
+ *  map_db
+ *      fd:  linux file descriptor of an open database
  *
+ *  Sets up the handle for fd.  The first bytes of the file tell whether it
+ *  carries a version 1 header.  The backend is the one requested through
+ *  the SDBSC_BACKEND environment variable; if the mapping cannot be created
+ *  the fd backend is used instead, so callers never have to care.
  */
-int add_student(int fd, int id, char *fname, char *lname, int gpa)
+static void map_db(int fd)
 {
-    student_t student = {0};
-    if (get_student(fd, id, &student) == NO_ERROR)
+    const char *backend = getenv(DB_BACKEND_ENV);
+    const char *sync = getenv(DB_MSYNC_ENV);
+    db_header_t hdr;
+    struct stat st;
+
+    if (fd < 0 || fd >= DB_MAX_HANDLES)
+        return;
+
+    db_handle_t *h = &db_handles[fd];
+    memset(h, 0, sizeof(*h));
+    h->in_use = true;
+    h->backend = DB_BACKEND_FD;
+    h->rec_len = STUDENT_RECORD_SIZE;
+
+    if (io_pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && hdr.magic == DB_MAGIC)
     {
-        printf(M_ERR_DB_ADD_DUP, id);
-        return ERR_DB_OP;
+        h->has_header = true;
+        h->flags = hdr.flags;
+        h->data_off = DB_HDR_SIZE;
+        h->base_id = hdr.base_id;
+        if (hdr.flags & DB_FLAG_COMPACT)
+        {
+            h->entries = hdr.entries;
+            h->min_id = hdr.min_id;
+            h->max_id = hdr.max_id;
+            h->data_off = DB_COMPACT_DATA_OFF(hdr.entries);
+            if (hdr.flags & DB_FLAG_PACKED)
+                h->rec_len = DB_PACKED_RECORD_SIZE;
+        }
     }
 
-    student.id = id;
-    student.gpa = gpa;
-    strncpy(student.fname, fname, sizeof(student.fname));
-    strncpy(student.lname, lname, sizeof(student.lname));
+    // compacted files are not addressed by id, they always use the fd path
+    if (backend == NULL || strcmp(backend, "mmap") != 0 || (h->flags & DB_FLAG_COMPACT))
+        return;
+    if (io_fstat(fd, &st) < 0)
+        return;
+
+    size_t len = h->data_off + DB_MAP_LEN;
+    void *map = io_mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return;
+
+    h->backend = DB_BACKEND_MMAP;
+    h->map = map;
+    h->map_len = len;
+    h->file_len = st.st_size;
+    h->sync = (sync != NULL && strcmp(sync, "1") == 0);
+}
+
+/*
+ *  map_slot
+ *      h:   handle of an mmap backed database
+ *      fd:  linux file descriptor the handle belongs to
+ *      id:  student id
+ *      for_write:  grow the file if the slot is not backed yet
+ *
+ *  returns:  pointer to the slot of id inside the mapping, or NULL if the
+ *            slot lies beyond the end of the file (nothing stored there) or
+ *            the file could not be grown
+ */
+static student_t *map_slot(db_handle_t *h, int fd, int id, bool for_write)
+{
+    off_t offset = h->data_off + (off_t)(id - h->base_id) * STUDENT_RECORD_SIZE;
+    off_t end = offset + STUDENT_RECORD_SIZE;
+    struct stat st;
 
-    off_t offset = id * STUDENT_RECORD_SIZE;
-    if (lseek(fd, offset, SEEK_SET) < 0)
+    if (end > h->file_len)
     {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
+        // another process may have grown the file since we mapped it
+        if (io_fstat(fd, &st) == 0)
+            h->file_len = st.st_size;
     }
-    if (write(fd, &student, STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE)
+    if (end > h->file_len)
     {
-        printf(M_ERR_DB_WRITE);
+        if (!for_write || io_ftruncate(fd, end) < 0)
+            return NULL;
+        h->file_len = end;
+    }
+    return (student_t *)(h->map + offset);
+}
+
+/*
+ *  map_put_student
+ *      h:    handle of an mmap backed database
+ *      fd:   linux file descriptor the handle belongs to
+ *      id:   slot to overwrite
+ *      rec:  record to store in the slot
+ *
+ *  returns:  NO_ERROR on success, ERR_DB_FILE if the slot could not be
+ *            written or flushed
+ */
+static int map_put_student(db_handle_t *h, int fd, int id, const student_t *rec)
+{
+    student_t *slot = map_slot(h, fd, id, true);
+    if (slot == NULL)
         return ERR_DB_FILE;
+
+    memcpy(slot, rec, STUDENT_RECORD_SIZE);
+
+    if (h->sync)
+    {
+        // msync wants a page aligned address
+        long page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)slot & ~(uintptr_t)(page - 1);
+        size_t len = (uintptr_t)slot + STUDENT_RECORD_SIZE - start;
+        if (io_msync((void *)start, len, MS_SYNC) < 0)
+            return ERR_DB_FILE;
     }
-    printf(M_STD_ADDED, id);
     return NO_ERROR;
 }
 
 /*
- *  del_student
- *      fd:     linux file descriptor
- *      id:     student id to be deleted
- *
- *  Removes a student to the database.  Use the get_student() function to
- *  locate the student to be deleted. If there is a student at that location
- *  write an empty student record - see EMPTY_STUDENT_RECORD from db.h at
- *  that location.
+ *  write_db_header
+ *      fd:      linux file descriptor
+ *      fields:  count, flags and directory fields of the header, NULL for
+ *               the header of an empty slot file
+ *      bitmap:  DB_BITMAP_SIZE bytes of occupancy bits, NULL for all clear
  *
- *  returns:  NO_ERROR       student deleted from database
- *            ERR_DB_FILE    database file I/O issue
- *            ERR_DB_OP      database operation logically failed (aka student
- *                           not in database)
+ *  Writes a complete version 1 header at the front of the file.  The one
+ *  of a compacted file is just the fixed fields, without the bitmap.
  *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int write_db_header(int fd, const db_header_t *fields, const unsigned char *bitmap)
+{
+    static unsigned char page[DB_HDR_SIZE];
+    db_header_t hdr = {0};
+
+    if (fields != NULL)
+        hdr = *fields;
+    hdr.magic = DB_MAGIC;
+    hdr.version = DB_VERSION;
+
+    if (hdr.flags & DB_FLAG_COMPACT)
+        return (io_pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) ? NO_ERROR : ERR_DB_FILE;
+
+    memset(page, 0, sizeof(page));
+    memcpy(page, &hdr, sizeof(hdr));
+    if (bitmap != NULL)
+        memcpy(page + DB_BITMAP_OFF, bitmap, DB_BITMAP_SIZE);
+
+    if (io_pwrite(fd, page, sizeof(page), 0) != sizeof(page))
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  read_db_bitmap
+ *      fd:      linux file descriptor of a version 1 database
+ *      bitmap:  DB_BITMAP_SIZE bytes receiving the occupancy bits
  *
- *  console:  M_STD_DEL_MSG      on success
- *            M_STD_NOT_FND_MSG  student not in database, cant be deleted
- *            M_ERR_DB_READ      error reading or seeking the database file
- *            M_ERR_DB_WRITE     error writing to db file (adding student)
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int read_db_bitmap(int fd, unsigned char *bitmap)
+{
+    if (io_pread(fd, bitmap, DB_BITMAP_SIZE, DB_BITMAP_OFF) != DB_BITMAP_SIZE)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  Record locks.  Processes sharing the database serialize their changes
+ *  with open file description (OFD) locks from fcntl(), so a few sdbsc runs,
+ *  a loader and a server can all write at the same time.  The lock of id
+ *  covers the STUDENT_RECORD_SIZE bytes at DB_LOCK_SLOTS + id *
+ *  STUDENT_RECORD_SIZE.  These ranges lie past any data the file holds,
+ *  they name ids rather than file bytes and so stay the same while a
+ *  compacted file moves its records.  Changes to different ids do not
+ *  contend.  The range just below them guards the header count and
+ *  bitmap, the one below that keeps the hot column consistent (see
+ *  lock_column()), the next one the last name index (see lock_index()),
+ *  and a whole-file lock excludes every other lock.
  *
+ *  Threads of one process share the description and are not ordered by
+ *  these locks, the server keeps its own stripe locks for that.
  */
-int del_student(int fd, int id)
+
+// one F_OFD_SETLKW request, waiting out any conflicting lock
+int fcntl_lock(int fd, short type, off_t start, off_t len)
 {
-    student_t student = {0};
-    int result = get_student(fd, id, &student);
-    if (result == SRCH_NOT_FOUND)
-    {
-        printf(M_STD_NOT_FND_MSG, id);
-        return ERR_DB_OP;
-    }
-    else if (result != NO_ERROR)
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    while (io_fcntl(fd, F_OFD_SETLKW, &fl) < 0)
     {
-        return result;
+        if (errno != EINTR)
+            return ERR_DB_FILE;
     }
+    return NO_ERROR;
+}
 
-    off_t offset = id * STUDENT_RECORD_SIZE;
-    if (lseek(fd, offset, SEEK_SET) < 0)
-    {
-        printf(M_ERR_DB_READ);
+// moves new_fd onto the descriptor number fd, which then names its file
+static int adopt_db(int fd, int new_fd)
+{
+    db_handle_t *h = db_handle(fd);
+
+    if (new_fd < 0)
         return ERR_DB_FILE;
-    }
-    if (write(fd, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE)
+    bool no_log = h != NULL && h->no_log;
+    if (h != NULL && h->map != NULL)
+        io_munmap(h->map, h->map_len);
+    if (dup2(new_fd, fd) < 0)
     {
-        printf(M_ERR_DB_WRITE);
+        io_close(new_fd);
         return ERR_DB_FILE;
     }
-    printf(M_STD_DEL_MSG, id);
+    io_close(new_fd);
+    map_db(fd);
+    if ((h = db_handle(fd)) != NULL)
+        h->no_log = no_log;
     return NO_ERROR;
 }
 
 /*
- *  count_db_records
+ *  lock_db_range
  *      fd:     linux file descriptor
+ *      type:   F_WRLCK or F_RDLCK
+ *      start:  first byte of the lock
+ *      len:    bytes to lock, 0 for the whole database
  *
- *  Counts the number of records in the database.  Start by reading the
- *  database at the beginning, and continue reading individual records
- *  until you it EOF.  EOF is when the read() syscall returns 0. Check
- *  if a slot is empty or previously deleted by investigating if all of
- *  the bytes in the record read are zeros - I would suggest using memory
- *  compare memcmp() for this. Create a counter variable and initialize it
- *  to zero, every time a non-zero record is read increment the counter.
- *
- *  returns:  <number>       returns the number of records in db on success
- *            ERR_DB_FILE    database file I/O issue
- *            ERR_DB_OP      database operation logically failed (aka student
- *                           not in database)
- *
- *
- *  console:  M_DB_RECORD_CNT  on success, to report the number of students in db
- *            M_DB_EMPTY       on success if the record count in db is zero
- *            M_ERR_DB_READ    error reading or seeking the database file
- *            M_ERR_DB_WRITE   error writing to db file (adding student)
+ *  Locks the range.  compress_db() and expand_db() rename a new file
+ *  over DB_FILE while they hold the whole-file lock, so a process that
+ *  waited for them still has the old file open.  It then moves fd to the
+ *  new file and locks again there.
  *
+ *  returns:  NO_ERROR or ERR_DB_FILE
  */
-int count_db_records(int fd)
+static int lock_db_range(int fd, short type, off_t start, off_t len)
 {
-    if (lseek(fd, 0, SEEK_SET) < 0)
+    for (;;)
     {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
-    }
-    student_t student;
-    int count = 0;
+        struct stat open_st, name_st;
 
-    while (read(fd, &student, STUDENT_RECORD_SIZE) == STUDENT_RECORD_SIZE)
-    {
-        if (student.id != 0)
-        {
-            count++;
-        }
-    }
+        if (fcntl_lock(fd, type, start, len) != NO_ERROR ||
+            io_fstat(fd, &open_st) < 0)
+            return ERR_DB_FILE;
+        if (stat(DB_FILE, &name_st) < 0 ||
+            (open_st.st_dev == name_st.st_dev && open_st.st_ino == name_st.st_ino))
+            return NO_ERROR;
 
-    if (count == 0)
-    {
-        printf(M_DB_EMPTY);
-    }
-    else
-    {
-        printf(M_DB_RECORD_CNT, count);
+        // closing the old file drops the lock taken on it
+        if (adopt_db(fd, io_open(DB_FILE, O_RDWR)) != NO_ERROR)
+            return ERR_DB_FILE;
     }
-    return NO_ERROR;
 }
 
 /*
- *  print_db
- *      fd:     linux file descriptor
+ *  lock_slots
+ *      fd:  linux file descriptor
+ *      id:  first id to lock
+ *      n:   number of consecutive ids
+ *      lk:  receives the range locked, for unlock_slots()
  *
- *  Prints all records in the database.  Start by reading the
- *  database at the beginning, and continue reading individual records
- *  until you it EOF.  EOF is when the read() syscall returns 0. Check
- *  if a slot is empty or previously deleted by investigating if all of
- *  the bytes in the record read are zeros - I would suggest using memory
- *  compare memcmp() for this. Be careful as the database might be empty.
- *  on the first real row encountered print the header for the required output:
+ *  Locks the ids against other processes.  A compacted file is locked as a
+ *  whole instead, a new id in it makes put_slot() expand the file.
  *
- *     printf(STUDENT_PRINT_HDR_STRING, "ID",
- *                  "FIRST_NAME", "LAST_NAME", "GPA");
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int lock_slots(int fd, int id, int n, db_lock_t *lk)
+{
+    lk->start = DB_LOCK_SLOTS + (off_t)id * STUDENT_RECORD_SIZE;
+    lk->len = (off_t)n * STUDENT_RECORD_SIZE;
+    if (lock_db_range(fd, F_WRLCK, lk->start, lk->len) != NO_ERROR)
+        return ERR_DB_FILE;
+    if (!db_is_compact(fd))
+        return NO_ERROR;
+
+    fcntl_lock(fd, F_UNLCK, lk->start, lk->len);
+    lk->start = 0;
+    lk->len = 0;
+    return lock_db_range(fd, F_WRLCK, 0, 0);
+}
+
+// whole-file lock for the operations that rewrite the database
+static int lock_whole_db(int fd, db_lock_t *lk)
+{
+    lk->start = 0;
+    lk->len = 0;
+    return lock_db_range(fd, F_WRLCK, 0, 0);
+}
+
+void unlock_slots(int fd, const db_lock_t *lk)
+{
+    fcntl_lock(fd, F_UNLCK, lk->start, lk->len);
+}
+
+/*
+ *  lock_column
+ *      fd:    linux file descriptor
+ *      type:  F_RDLCK to update the hot column, F_WRLCK to build it
  *
- *  then for each valid record encountered print the required output:
+ *  Orders changes of the hot column against a build of it in another
+ *  process, see sdbsc_column.c.  unlock_column() releases the lock.
  *
- *     printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname,
- *                    student.lname, calculated_gpa_from_student);
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int lock_column(int fd, short type)
+{
+    return lock_db_range(fd, type, DB_LOCK_COL, STUDENT_RECORD_SIZE);
+}
+
+void unlock_column(int fd)
+{
+    fcntl_lock(fd, F_UNLCK, DB_LOCK_COL, STUDENT_RECORD_SIZE);
+}
+
+/*
+ *  lock_index
+ *      fd:  linux file descriptor
  *
- *  The code above assumes you are reading student records into a local
- *  variable named student that is of type student_t. Also dont forget that
- *  the GPA in the student structure is an int, to convert it into a real
- *  gpa divide by 100.0 and store in a float variable.
+ *  Orders appends to the delta log of the last name index against each
+ *  other and against a build or merge that replaces the file, between
+ *  processes, see sdbsc_index.c.  unlock_index() releases the lock.
  *
- *  returns:  NO_ERROR       on success
- *            ERR_DB_FILE    database file I/O issue
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int lock_index(int fd)
+{
+    return lock_db_range(fd, F_WRLCK, DB_LOCK_IDX, STUDENT_RECORD_SIZE);
+}
+
+void unlock_index(int fd)
+{
+    fcntl_lock(fd, F_UNLCK, DB_LOCK_IDX, STUDENT_RECORD_SIZE);
+}
+
+/*
+ *  lock_db
+ *      fd:    linux file descriptor
+ *      type:  F_RDLCK to keep every change out, F_WRLCK to replace the file
  *
+ *  Whole-file lock of a backup or a restore, see sdbsc_backup.c.
+ *  unlock_db() releases it.
  *
- *  console:  <see above>      on success, print table or database empty
- *            M_ERR_DB_READ    error reading or seeking the database file
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int lock_db(int fd, short type)
+{
+    return lock_db_range(fd, type, 0, 0);
+}
+
+void unlock_db(int fd)
+{
+    fcntl_lock(fd, F_UNLCK, 0, 0);
+}
+
+/*
+ *  note_db_change
+ *      fd:    linux file descriptor
+ *      id:    student id whose slot was just written
+ *      live:  true if the slot now holds a student, false if it was emptied
+ *      was_live:  whether it held one before, only used for a compacted
+ *                 file, which has no bitmap to tell
+ *
+ *  Keeps the record count and occupancy bitmap of a version 1 header in
+ *  step with the slots.  Does nothing for a headerless database.  The
+ *  read-modify-write of the header is serialized by hdr_lock so the server
+ *  threads can update different slots at the same time, and by the header
+ *  record lock against other processes.
  *
+ *  returns:  NO_ERROR or ERR_DB_FILE
  */
-int print_db(int fd)
+static int note_db_change(int fd, int id, bool live, bool was_live)
+{
+    db_header_t hdr;
+    unsigned char bits;
+    int slot = slot_index(fd, id);
+    off_t bit_off = DB_BITMAP_OFF + slot / 8;
+    unsigned char mask = 1u << (slot % 8);
+
+    if (!db_has_header(fd))
+        return NO_ERROR;
+
+    int rc = NO_ERROR;
+    pthread_mutex_lock(&hdr_lock);
+    if (fcntl_lock(fd, F_WRLCK, DB_LOCK_HDR, STUDENT_RECORD_SIZE) != NO_ERROR)
+    {
+        pthread_mutex_unlock(&hdr_lock);
+        return ERR_DB_FILE;
+    }
+    if (db_is_compact(fd))
+        bits = was_live ? mask : 0;
+    if ((!db_is_compact(fd) && io_pread(fd, &bits, 1, bit_off) != 1) ||
+        io_pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+    {
+        rc = ERR_DB_FILE;
+    }
+    else if (((bits & mask) != 0) != live)
+    {
+        bits = live ? (bits | mask) : (bits & ~mask);
+        hdr.count += live ? 1 : -1;
+        if ((!db_is_compact(fd) && io_pwrite(fd, &bits, 1, bit_off) != 1) ||
+            io_pwrite(fd, &hdr.count, sizeof(hdr.count), offsetof(db_header_t, count)) != sizeof(hdr.count))
+            rc = ERR_DB_FILE;
+    }
+    fcntl_lock(fd, F_UNLCK, DB_LOCK_HDR, STUDENT_RECORD_SIZE);
+    pthread_mutex_unlock(&hdr_lock);
+    return rc;
+}
+
+/*
+ *  merge_db_bitmap
+ *      fd:     linux file descriptor of a version 1 database
+ *      bits:   occupancy bits of the ids just added
+ *      added:  how many there are
+ *
+ *  Header update of a bulk load, under the same locks as note_db_change()
+ *  so the bits other processes set meanwhile are kept.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int merge_db_bitmap(int fd, const unsigned char *bits, int added)
 {
-    student_t student;
-    int first_record = 1;
+    unsigned char *cur = malloc(DB_BITMAP_SIZE);
+    db_header_t hdr;
+    int rc = ERR_DB_FILE;
 
-    while (read(fd, &student, STUDENT_RECORD_SIZE) == STUDENT_RECORD_SIZE)
+    if (cur == NULL)
+        return ERR_DB_FILE;
+    pthread_mutex_lock(&hdr_lock);
+    if (fcntl_lock(fd, F_WRLCK, DB_LOCK_HDR, STUDENT_RECORD_SIZE) == NO_ERROR)
     {
-        if (student.id != 0)
+        if (read_db_bitmap(fd, cur) == NO_ERROR &&
+            io_pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr))
         {
-            if (first_record)
-            {
-                printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
-                first_record = 0;
-            }
-            printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname, student.lname, student.gpa / 100.0);
+            for (size_t i = 0; i < DB_BITMAP_SIZE; i++)
+                cur[i] |= bits[i];
+            hdr.count += added;
+            rc = write_db_header(fd, &hdr, cur);
         }
+        fcntl_lock(fd, F_UNLCK, DB_LOCK_HDR, STUDENT_RECORD_SIZE);
     }
+    pthread_mutex_unlock(&hdr_lock);
+    free(cur);
+    return rc;
+}
+
+/*
+ *  next_live_run
+ *      bitmap:  occupancy bitmap of a version 1 database
+ *      from:    first id to consider
+ *      first:   receives the first live id at or after from
+ *      max:     longest run to report
+ *
+ *  Finds the next run of consecutive live ids, skipping empty bytes of the
+ *  bitmap eight ids at a time.
+ *
+ *  returns:  length of the run (at most max), 0 when no live id is left
+ */
+static int next_live_run(const unsigned char *bitmap, int from, int *first, int max)
+{
+    int id = from;
 
-    if (first_record)
+    while (id <= MAX_STD_ID)
     {
-        printf(M_DB_EMPTY);
+        if ((id % 8) == 0 && bitmap[id / 8] == 0)
+        {
+            id += 8;
+            continue;
+        }
+        if (bitmap[id / 8] & (1u << (id % 8)))
+            break;
+        id++;
+    }
+    if (id > MAX_STD_ID)
+        return 0;
+
+    int n = 0;
+    *first = id;
+    while (id <= MAX_STD_ID && n < max && (bitmap[id / 8] & (1u << (id % 8))))
+    {
+        id++;
+        n++;
+    }
+    return n;
+}
+
+/*
+ *  next_data_extent
+ *      fd:     linux file descriptor
+ *      from:   file offset to start searching at
+ *      start:  receives the first offset of the next allocated extent
+ *      end:    receives the offset just past that extent
+ *
+ *  Uses lseek(SEEK_DATA/SEEK_HOLE) so scans of a sparse database only
+ *  touch the blocks that were actually written.  Extents reported by the
+ *  filesystem are block aligned, start is additionally rounded down to a
+ *  record boundary.  On filesystems that do not report holes the rest of
+ *  the file is returned as one extent, which makes the caller do a full
+ *  scan.
+ *
+ *  returns:  true if an extent was found, false when there is no more
+ *            data past from
+ */
+bool next_data_extent(int fd, off_t from, off_t *start, off_t *end)
+{
+#ifdef SEEK_DATA
+    off_t data = io_lseek(fd, from, SEEK_DATA);
+#else
+    off_t data = -1;
+    errno = EINVAL;
+#endif
+    if (data < 0)
+    {
+        struct stat st;
+
+        // ENXIO means only a hole (or nothing) is left past from
+        if (errno == ENXIO || io_fstat(fd, &st) < 0 || st.st_size <= from)
+            return false;
+        *start = from;
+        *end = st.st_size;
+        return true;
+    }
+
+#ifdef SEEK_HOLE
+    off_t hole = io_lseek(fd, data, SEEK_HOLE);
+#else
+    off_t hole = -1;
+#endif
+    if (hole < 0)
+    {
+        struct stat st;
+        if (io_fstat(fd, &st) < 0)
+            return false;
+        hole = st.st_size;
+    }
+
+    *start = data - (data % STUDENT_RECORD_SIZE);
+    *end = hole;
+    return true;
+}
+
+/*
+ *  scan_open
+ *      sc:     scan state to set up
+ *      fd:     linux file descriptor of an open database
+ *      chunk:  bytes read per pread(), 0 for DB_SCAN_CHUNK
+ *
+ *  Starts a streaming scan over the live records of the database, in id
+ *  order, whatever its layout.  The file is read in large chunks aligned
+ *  to the chunk size: the packed records of a compacted file, the parts of
+ *  a version 1 file that the occupancy bitmap says hold students, or the
+ *  allocated extents of a headerless file.  The kernel is told the access
+ *  is sequential so it reads ahead aggressively.
+ *
+ *  The scan only uses pread(), so several scans of the same fd can run at
+ *  once.  Release it with scan_close().
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int scan_open(db_scan_t *sc, int fd, size_t chunk)
+{
+    return scan_open_range(sc, fd, chunk, 0, INT_MAX);
+}
+
+/*
+ *  scan_open_range
+ *      sc:     scan state to set up
+ *      fd:     linux file descriptor of an open database
+ *      chunk:  bytes read per pread(), 0 for DB_SCAN_CHUNK
+ *      lo:     smallest id to return
+ *      hi:     largest id to return
+ *
+ *  Like scan_open() for the students with lo <= id <= hi.  Only the part
+ *  of the file that holds those ids is read: the slots of the range, or
+ *  for a compacted file the records between the directory positions of lo
+ *  and hi.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int scan_open_range(db_scan_t *sc, int fd, size_t chunk, int lo, int hi)
+{
+    IO_PHASE(IO_PHASE_SCAN);
+    db_handle_t *h = db_handle(fd);
+    struct stat st;
+
+    memset(sc, 0, sizeof(*sc));
+    sc->fd = fd;
+    sc->lo_id = (lo < db_base_id(fd)) ? db_base_id(fd) : lo;
+    sc->hi_id = hi;
+    if (chunk == 0)
+        chunk = DB_SCAN_CHUNK;
+    sc->chunk = (chunk + DB_SCAN_ALIGN - 1) / DB_SCAN_ALIGN * DB_SCAN_ALIGN;
+
+    if (io_fstat(fd, &st) < 0)
+        return ERR_DB_FILE;
+    sc->file_len = st.st_size;
+
+    if (posix_memalign((void **)&sc->buf, DB_SCAN_ALIGN, sc->chunk) != 0)
+    {
+        sc->buf = NULL;
+        return ERR_DB_FILE;
+    }
+    sc->batch = malloc(sc->chunk / STUDENT_RECORD_SIZE * sizeof(student_t *));
+    if (sc->batch == NULL)
+        goto fail;
+
+    if (db_is_compact(fd))
+    {
+        // directory positions of the first id >= lo and past the last <= hi
+        int first, last;
+        int rc = compact_find(fd, h, sc->hi_id, &last);
+        if (rc == ERR_DB_FILE || compact_find(fd, h, sc->lo_id, &first) == ERR_DB_FILE)
+            goto fail;
+        if (rc == NO_ERROR)
+            last++;
+        sc->compact = true;
+        sc->pos = h->data_off + (off_t)first * h->rec_len;
+        sc->end = h->data_off + (off_t)last * h->rec_len;
+        sc->limit = sc->end;
+        if (db_is_packed(fd) && (sc->packed = malloc(sc->chunk)) == NULL)
+            goto fail;
+    }
+    else
+    {
+        sc->pos = slot_offset(fd, sc->lo_id);
+        sc->limit = slot_offset(fd, sc->hi_id) + STUDENT_RECORD_SIZE;
+        if (sc->limit > sc->file_len)
+            sc->limit = sc->file_len;
+        if (db_has_header(fd))
+        {
+            sc->bitmap = malloc(DB_BITMAP_SIZE);
+            if (sc->bitmap == NULL || read_db_bitmap(fd, sc->bitmap) != NO_ERROR)
+                goto fail;
+            sc->end = sc->limit;
+        }
+        else
+        {
+            sc->end = sc->pos; // first extent found by scan_next()
+        }
     }
 
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (sc->limit > sc->pos)
+        posix_fadvise(fd, sc->pos, sc->limit - sc->pos, POSIX_FADV_SEQUENTIAL);
+#endif
     return NO_ERROR;
+
+fail:
+    scan_close(sc);
+    return ERR_DB_FILE;
 }
 
 /*
- *  print_student
- *      *s:   a pointer to a student_t structure that should
- *            contain a valid student to be printed
+ *  scan_next
+ *      sc:  scan started with scan_open()
  *
- *  Start by ensuring that provided student pointer is valid.  To do this
- *  make sure it is not NULL and that s->id is not zero.  After ensuring
- *  that the student is valid, print it the exact way that is described
- *  in the print_db() function by first printing the header then the
- *  student data:
+ *  Reads the next chunk that holds at least one student.  sc->recs and
+ *  sc->nrecs describe everything that was read, empty slots included,
+ *  sc->batch points at the live records among them.  The records stay
+ *  valid until the next call.
  *
- *     printf(STUDENT_PRINT_HDR_STRING, "ID",
- *                  "FIRST NAME", "LAST_NAME", "GPA");
+ *  returns:  number of live records in sc->batch, 0 at the end of the
+ *            database or ERR_DB_FILE
+ */
+int scan_next(db_scan_t *sc)
+{
+    IO_PHASE(IO_PHASE_SCAN);
+    int base_id = db_base_id(sc->fd);
+    off_t base = slot_offset(sc->fd, base_id);
+    off_t from, len;
+    int first;
+
+    for (;;)
+    {
+        sc->nrecs = sc->count = 0;
+        if (sc->bitmap != NULL)
+        {
+            // skip to the page of the next student, empty stretches of the
+            // id space are never read
+            if (next_live_run(sc->bitmap, (sc->pos - base) / STUDENT_RECORD_SIZE, &first, 1) == 0 ||
+                base_id + first > sc->hi_id)
+                return 0;
+            from = base + (off_t)first * STUDENT_RECORD_SIZE;
+            from -= from % DB_SCAN_ALIGN;
+            if (from < sc->pos)
+                from = sc->pos;
+        }
+        else
+        {
+            if (sc->pos >= sc->end)
+            {
+                off_t start, end;
+                if (sc->compact || !next_data_extent(sc->fd, sc->pos, &start, &end) ||
+                    start >= sc->limit)
+                    return 0;
+                sc->pos = start;
+                sc->end = (end < sc->limit) ? end : sc->limit;
+            }
+            from = sc->pos;
+        }
+
+        // read up to the next chunk boundary so later reads stay aligned,
+        // packed records as many as unpack into a chunk
+        int rec_len = db_rec_len(sc->fd);
+        len = sc->chunk - (from % sc->chunk);
+        if (sc->packed != NULL)
+            len = sc->chunk / STUDENT_RECORD_SIZE * rec_len;
+        if (len > sc->end - from)
+            len = sc->end - from;
+        len -= len % rec_len;
+        if (len <= 0)
+        {
+            if (sc->bitmap != NULL || sc->compact)
+                return 0;
+            sc->pos = sc->end;
+            continue;
+        }
+
+        ssize_t got = io_pread(sc->fd, (sc->packed != NULL) ? sc->packed : sc->buf, len, from);
+        if (got < 0 || (sc->compact && got != len))
+            return ERR_DB_FILE;
+        if (got < len)
+            sc->end = from + got; // the file is shorter than it was
+        sc->pos = from + got;
+
+        sc->recs = (student_t *)sc->buf;
+        sc->nrecs = got / rec_len;
+        for (int i = 0; sc->packed != NULL && i < sc->nrecs; i++)
+            unpack_record((const db_packed_t *)sc->packed + i, &sc->recs[i]);
+        int slot = (from - base) / STUDENT_RECORD_SIZE;
+        for (int i = 0; i < sc->nrecs; i++, slot++)
+        {
+            if (sc->recs[i].id == 0 || sc->recs[i].id < sc->lo_id || sc->recs[i].id > sc->hi_id)
+                continue;
+            if (sc->bitmap != NULL && (slot > MAX_STD_ID || !(sc->bitmap[slot / 8] & (1u << (slot % 8)))))
+                continue;
+            sc->batch[sc->count++] = &sc->recs[i];
+        }
+        if (sc->count > 0)
+            return sc->count;
+        if (got == 0)
+            return 0;
+    }
+}
+
+/*
+ *  scan_close
+ *      sc:  scan started with scan_open()
  *
- *     printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname,
- *                    student.lname, calculated_gpa_from_s);
+ *  Releases the buffers of the scan.
+ */
+void scan_close(db_scan_t *sc)
+{
+    IO_PHASE(IO_PHASE_SCAN);
+    free(sc->buf);
+    free(sc->batch);
+    free(sc->bitmap);
+    free(sc->packed);
+    sc->buf = NULL;
+    sc->batch = NULL;
+    sc->bitmap = NULL;
+    sc->packed = NULL;
+}
+
+/*
+ *  set_scan_threads
+ *      n:  number of threads for full scans, see parallel_scan()
  *
- *  Dont forget that  the GPA in the student structure is an int, to convert
- *  it into a real gpa divide by 100.0 and store in a float variable.
+ *  Set from -j.  With more than one thread print_db(), the counting of
+ *  headerless files and stats_db() split the database in id ranges and
+ *  scan them side by side.
+ */
+void set_scan_threads(int n)
+{
+    scan_threads = (n < 1) ? 1 : (n > DB_MAX_SCAN_THREADS) ? DB_MAX_SCAN_THREADS : n;
+}
+
+int get_scan_threads(void)
+{
+    return scan_threads;
+}
+
+typedef struct par_scan
+{
+    int fd;
+    int lo;             // first id of the first part
+    int per_part;       // ids per part
+    int nparts;
+    int next_part;      // next part to hand out, under lock
+    int rc;
+    pthread_mutex_t lock;
+    scan_part_t task;
+    void *arg;
+} par_scan_t;
+
+static void *par_scan_worker(void *p)
+{
+    par_scan_t *ps = p;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&ps->lock);
+        int part = ps->next_part++;
+        pthread_mutex_unlock(&ps->lock);
+        if (part >= ps->nparts)
+            break;
+
+        int lo = ps->lo + part * ps->per_part;
+        int hi = (part == ps->nparts - 1) ? INT_MAX : lo + ps->per_part - 1;
+        if (ps->task(ps->fd, lo, hi, part, ps->arg) != NO_ERROR)
+        {
+            pthread_mutex_lock(&ps->lock);
+            ps->rc = ERR_DB_FILE;
+            pthread_mutex_unlock(&ps->lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  parallel_scan
+ *      fd:        linux file descriptor
+ *      nthreads:  threads to run the parts on
+ *      nparts:    number of id ranges to split the database in
+ *      task:      scans one part, see scan_part_t
+ *      arg:       passed on to task
  *
- *  returns:  nothing, this is a void function
+ *  Splits the ids the database can hold in nparts ranges of the same
+ *  size, aligned to whole pages of slots, and calls task for each of them
+ *  on nthreads threads.  The task opens its own scan_open_range(), so
+ *  every thread reads with its own pread() calls.  Parts are handed out in
+ *  order: once task runs for part k, parts 0 to k-1 have all been started,
+ *  which lets a task wait for the parts before it to write its results in
+ *  order.
  *
+ *  returns:  NO_ERROR or ERR_DB_FILE if a task failed
+ */
+int parallel_scan(int fd, int nthreads, int nparts, scan_part_t task, void *arg)
+{
+    db_handle_t *h = db_handle(fd);
+    pthread_t threads[DB_MAX_SCAN_THREADS];
+    par_scan_t ps;
+    struct stat st;
+    long lo, hi;
+
+    if (h != NULL && (h->flags & DB_FLAG_COMPACT))
+    {
+        lo = h->min_id;
+        hi = h->max_id;
+    }
+    else
+    {
+        if (io_fstat(fd, &st) < 0)
+            return ERR_DB_FILE;
+        lo = db_base_id(fd);
+        hi = lo + (st.st_size - slot_offset(fd, lo)) / STUDENT_RECORD_SIZE - 1;
+    }
+    if (hi < lo)
+        hi = lo;
+
+    // whole pages of slots per part so no two threads read the same page
+    long page_ids = DB_SCAN_ALIGN / STUDENT_RECORD_SIZE;
+    long per_part = (hi - lo + nparts) / nparts;
+    per_part = (per_part + page_ids - 1) / page_ids * page_ids;
+
+    memset(&ps, 0, sizeof(ps));
+    ps.fd = fd;
+    ps.lo = (int)lo;
+    ps.per_part = (int)per_part;
+    ps.nparts = (int)((hi - lo + per_part) / per_part);
+    ps.task = task;
+    ps.arg = arg;
+    pthread_mutex_init(&ps.lock, NULL);
+
+    if (nthreads > ps.nparts)
+        nthreads = ps.nparts;
+    if (nthreads > DB_MAX_SCAN_THREADS)
+        nthreads = DB_MAX_SCAN_THREADS;
+
+    // this thread is the first worker
+    int started = 1;
+    for (; started < nthreads; started++)
+    {
+        if (pthread_create(&threads[started], NULL, par_scan_worker, &ps) != 0)
+            break;
+    }
+    par_scan_worker(&ps);
+    for (int i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&ps.lock);
+    return ps.rc;
+}
+
+/*
+ *  collect_live
+ *      fd:   linux file descriptor
+ *      out:  receives a malloc()ed array of the live records in id order
+ *      n:    receives the number of records in *out
  *
- *  console:  <see above>      on success, print table or database empty
- *            M_ERR_STD_PRINT  if the function argument s is NULL or if
- *                             s->id is zero
+ *  Reads every student of the database whatever its layout with a scan
+ *  (see scan_open()).  Since ids are bounded by MAX_STD_ID the result is
+ *  at most (MAX_STD_ID + 1) records.
  *
+ *  returns:  NO_ERROR or ERR_DB_FILE
  */
-void print_student(student_t *s)
+int collect_live(int fd, student_t **out, int *n)
 {
-    if (s == NULL || s->id == 0)
+    student_t *recs = NULL;
+    int cnt = 0, cap = 0, got;
+    db_scan_t sc;
+
+    *out = NULL;
+    *n = 0;
+    if (scan_open(&sc, fd, 0) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    while ((got = scan_next(&sc)) > 0)
     {
-        printf(M_ERR_STD_PRINT);
-        return;
+        if (cnt + got > cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            if (cap < cnt + got)
+                cap = cnt + got;
+            student_t *grown = realloc(recs, (size_t)cap * sizeof(student_t));
+            if (grown == NULL)
+            {
+                got = ERR_DB_FILE;
+                break;
+            }
+            recs = grown;
+        }
+        for (int i = 0; i < got; i++)
+            recs[cnt++] = *sc.batch[i];
     }
+    scan_close(&sc);
 
-    printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
-    printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, s->gpa / 100.0);
+    if (got < 0)
+    {
+        free(recs);
+        return ERR_DB_FILE;
+    }
+    *out = recs;
+    *n = cnt;
+    return NO_ERROR;
 }
 
 /*
- *  NOTE IMPLEMENTING THIS FUNCTION IS EXTRA CREDIT
+ *  rename_tmp_db
+ *      tmp_fd:  descriptor of the fully written TMP_DB_FILE
  *
- *  compress_db
- *      fd:     linux file descriptor
+ *  Renames TMP_DB_FILE over DB_FILE.  The new file is flushed before the
+ *  rename and the directory after it, so a crash leaves either the old
+ *  database or the complete new one.
  *
- *  This assignment takes advantage of the way Linux handles sparse files
- *  on disk. Thus if there is a large hole between student records, Linux
- *  will not use any physical storage.  However, when a database record is
- *  deleted storage is used to write a blank - see EMPTY_STUDENT_RECORD from
- *  db.h - record.
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int rename_tmp_db(int tmp_fd)
+{
+    if (io_fsync(tmp_fd) < 0 || io_rename(TMP_DB_FILE, DB_FILE) < 0)
+        return ERR_DB_FILE;
+
+    // DB_FILE is relative to the current directory
+    int dir_fd = io_open(".", O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0)
+        return ERR_DB_FILE;
+    bool ok = io_fsync(dir_fd) == 0;
+    io_close(dir_fd);
+    return ok ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  replace_db
+ *      fd:      linux file descriptor of the database being replaced
+ *      new_fd:  descriptor of the freshly written TMP_DB_FILE
  *
- *  Since Linux provides no way to delete data in the middle of a file, and
- *  deleted records take up physical storage, this function will compress the
- *  database by rewriting a new database file that only includes valid student
- *  records. There are a number of ways to do this, but since this is extra credit
- *  you need to figure this out on your own.
+ *  Renames TMP_DB_FILE over DB_FILE and moves the new file onto the same
+ *  descriptor number with dup2(), so the caller can keep using fd.
  *
- *  At a high level create a temporary database file then copy all valid students from
- *  the active database (passed in via fd) to the temporary file. When this is done
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  M_ERR_DB_CREATE  if the temporary file cannot be renamed
+ */
+static int replace_db(int fd, int new_fd)
+{
+    // the caller's whole-file lock dies with the old file, carry it over.
+    // Blocks of the new file have no stamps, its first backup is full
+    backup_drop();
+    if (fcntl_lock(new_fd, F_WRLCK, 0, 0) != NO_ERROR ||
+        rename_tmp_db(new_fd) != NO_ERROR)
+    {
+        printf(M_ERR_DB_CREATE);
+        io_close(new_fd);
+        io_unlink(TMP_DB_FILE);
+        return ERR_DB_FILE;
+    }
+    if (adopt_db(fd, new_fd) != NO_ERROR)
+    {
+        printf(M_ERR_DB_CREATE);
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  expand_db
+ *      fd:  linux file descriptor of a compacted database
+ *
+ *  Turns a compacted database back into a slot file so that students with
+ *  new ids can be added.  The file returns to the layout it had before
+ *  compress_db(): a version 1 file if DB_FLAG_SLOT_HDR is set, headerless
+ *  otherwise.  fd keeps referring to the database afterwards.  Callers
+ *  hold the whole-file lock, see lock_slots().
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  M_ERR_DB_READ, M_ERR_DB_OPEN, M_ERR_DB_WRITE or
+ *            M_ERR_DB_CREATE on error, nothing on success
+ */
+static int expand_db(int fd)
+{
+    db_handle_t *h = db_handle(fd);
+    bool with_header = h != NULL && (h->flags & DB_FLAG_SLOT_HDR);
+    off_t base = with_header ? DB_HDR_SIZE : 0;
+    int base_id = db_base_id(fd);
+    student_t *recs;
+    int n;
+
+    if (collect_live(fd, &recs, &n) != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    int tmp_fd = io_open(TMP_DB_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (tmp_fd < 0)
+    {
+        free(recs);
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+
+    unsigned char *bitmap = calloc(1, DB_BITMAP_SIZE);
+    bool ok = bitmap != NULL;
+
+    // write runs of consecutive ids with one pwrite() each
+    for (int i = 0, j; ok && i < n; i = j)
+    {
+        for (j = i + 1; j < n && recs[j].id == recs[j - 1].id + 1; j++)
+            ;
+        ssize_t len = (ssize_t)(j - i) * STUDENT_RECORD_SIZE;
+        ok = io_pwrite(tmp_fd, &recs[i], len, base + (off_t)(recs[i].id - base_id) * STUDENT_RECORD_SIZE) == len;
+        for (int k = i; k < j; k++)
+            bitmap[(recs[k].id - base_id) / 8] |= 1u << ((recs[k].id - base_id) % 8);
+    }
+    if (ok && with_header)
+    {
+        db_header_t hdr = {0};
+        hdr.count = n;
+        hdr.base_id = base_id;
+        ok = write_db_header(tmp_fd, &hdr, bitmap) == NO_ERROR;
+    }
+    free(bitmap);
+    free(recs);
+
+    if (!ok)
+    {
+        printf(M_ERR_DB_WRITE);
+        io_close(tmp_fd);
+        io_unlink(TMP_DB_FILE);
+        return ERR_DB_FILE;
+    }
+    return replace_db(fd, tmp_fd);
+}
+
+/*
+ *  want_header
+ *      current:  whether the database currently has a version 1 header
+ *
+ *  returns:  the format requested through SDBSC_FORMAT, or current if the
+ *            variable is not set
+ */
+static bool want_header(bool current)
+{
+    const char *fmt = getenv(DB_FORMAT_ENV);
+    if (fmt == NULL)
+        return current;
+    return strcmp(fmt, "header") == 0;
+}
+
+/*
+ *  init_db_header
+ *      fd:       linux file descriptor of an empty database file
+ *      base_id:  id of the first slot, non zero only for a shard
+ *
+ *  Turns an empty file into an empty version 1 database and refreshes the
+ *  handle of fd so that later calls use the header aware addressing.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int init_db_header(int fd, int base_id)
+{
+    db_header_t hdr = {0};
+
+    hdr.base_id = base_id;
+    if (write_db_header(fd, &hdr, NULL) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    db_handle_t *h = db_handle(fd);
+    if (h != NULL && h->map != NULL)
+        io_munmap(h->map, h->map_len);
+    map_db(fd);
+    return NO_ERROR;
+}
+
+/*
+ *  open_db
+ *      dbFile:  name of the database file
+ *      should_truncate:  indicates if opening the file also empties it
+ *      with_log:  replay and use the write-ahead log as SDBSC_WAL says,
+ *                 false for a read-only scan that leaves the log alone
+ *
+ *  A new (empty) file is created headerless unless SDBSC_FORMAT=header
+ *  asks for a version 1 file, see db.h.
+ *
+ *  returns:  File descriptor on success, or ERR_DB_FILE on failure
+ *
+ *  console:  Does not produce any console I/O on success
+ *            M_ERR_DB_OPEN on error
+ *            M_ERR_DB_CREATE if the header of a new file cannot be written
+ *
+ */
+int open_db(char *dbFile, bool should_truncate, bool with_log)
+{
+    IO_PHASE(IO_PHASE_OPEN);
+    // Set permissions: rw-rw----
+    // see sys/stat.h for constants
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
+
+    // open the file if it exists for Read and Write,
+    // create it if it does not exist
+    int flags = O_RDWR | O_CREAT;
+
+    if (should_truncate)
+        flags += O_TRUNC;
+
+    // Now open file
+    int fd = io_open(dbFile, flags, mode);
+
+    if (fd == -1)
+    {
+        // Handle the error
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+
+    map_db(fd);
+    names_open(fd);
+    db_handle_t *h = db_handle(fd);
+    if (h != NULL)
+        h->no_log = !with_log;
+
+    // a brand new file gets the format asked for in SDBSC_FORMAT
+    struct stat st;
+    if (io_fstat(fd, &st) == 0 && st.st_size == 0 && want_header(false) &&
+        init_db_header(fd, 0) != NO_ERROR)
+    {
+        printf(M_ERR_DB_CREATE);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+
+    // changes a crash kept out of the file are still in the log
+    if (with_log && wal_open(fd) != NO_ERROR)
+    {
+        printf(M_ERR_DB_OPEN);
+        close_db(fd);
+        return ERR_DB_FILE;
+    }
+    return fd;
+}
+
+/*
+ *  close_db
+ *      fd:  linux file descriptor returned by open_db()
+ *
+ *  Closes the write-ahead log (if fd was opened with it), releases the
+ *  mapping of the mmap backend (if any) and closes fd.
+ *
+ *  returns:  the return value of close()
+ *
+ *  console:  Does not produce any console I/O
+ */
+int close_db(int fd)
+{
+    db_handle_t *h = db_handle(fd);
+    if (h == NULL || !h->no_log)
+        wal_close(fd);
+    names_close(fd);
+
+    h = db_handle(fd);
+    if (h != NULL)
+    {
+        if (h->map != NULL)
+            io_munmap(h->map, h->map_len);
+        memset(h, 0, sizeof(*h));
+    }
+    return io_close(fd);
+}
+
+/*
+ *  get_student
+ *      fd:  linux file descriptor
+ *      id:  the student id we are looking forname of the
+ *      *s:  a pointer where the located (if found) student data will be
+ *           copied
+ *
+ *  returns:  NO_ERROR       student located and copied into *s
+ *            ERR_DB_FILE    database file I/O issue
+ *            SRCH_NOT_FOUND student was not located in the database
+ *
+ *  console:  Does not produce any console I/O used by other functions
+ */
+int get_student(int fd, int id, student_t *s)
+{
+    IO_PHASE(IO_PHASE_GET);
+    db_handle_t *h = db_handle(fd);
+    if (h != NULL && h->backend == DB_BACKEND_MMAP && id >= 0)
+    {
+        bool in_file = id >= h->base_id && id - h->base_id <= MAX_STD_ID;
+        student_t *slot = in_file ? map_slot(h, fd, id, false) : NULL;
+        if (slot == NULL)
+        {
+            memset(s, 0, sizeof(student_t));
+            return SRCH_NOT_FOUND;
+        }
+        memcpy(s, slot, STUDENT_RECORD_SIZE);
+        return (s->id == 0) ? SRCH_NOT_FOUND : NO_ERROR;
+    }
+
+    off_t offset;
+    int rc = locate_slot(fd, id, &offset);
+    if (rc == SRCH_NOT_FOUND)
+    {
+        memset(s, 0, sizeof(student_t));
+        return SRCH_NOT_FOUND;
+    }
+    if (rc != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    // pread() leaves the file position alone, so concurrent lookups on a
+    // shared fd (see sdbsc_server.c) do not get in each other's way
+    db_packed_t packed;
+    bool is_packed = db_is_packed(fd);
+    ssize_t bytes = is_packed ? io_pread(fd, &packed, DB_PACKED_RECORD_SIZE, offset)
+                              : io_pread(fd, s, STUDENT_RECORD_SIZE, offset);
+    if (bytes == 0) {
+        /* No record written at this offset yet – treat as empty */
+        memset(s, 0, sizeof(student_t));
+        return SRCH_NOT_FOUND;
+    }
+    if (bytes != db_rec_len(fd))
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    if (is_packed)
+        unpack_record(&packed, s);
+    if (s->id == 0)
+    {
+        return SRCH_NOT_FOUND;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  share_db
+ *      fd:  linux file descriptor of an open database
+ *
+ *  Readies fd to be used by several threads at once (see sdbsc_server.c).
+ *  A compacted file is expanded up front, since expand_db() replaces the
+ *  file under fd, and the handle is switched to the fd backend because the
+ *  mapping would have to be grown while other threads use it.  After this
+ *  get_student(), put_slot() and db_count() only use pread()/pwrite().
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int share_db(int fd)
+{
+    db_lock_t lk;
+
+    if (db_is_compact(fd))
+    {
+        if (lock_whole_db(fd, &lk) != NO_ERROR)
+            return ERR_DB_FILE;
+        int rc = db_is_compact(fd) ? expand_db(fd) : NO_ERROR;
+        unlock_slots(fd, &lk);
+        if (rc != NO_ERROR)
+            return ERR_DB_FILE;
+    }
+
+    db_handle_t *h = db_handle(fd);
+    if (h != NULL && h->backend == DB_BACKEND_MMAP)
+    {
+        io_munmap(h->map, h->map_len);
+        h->map = NULL;
+        h->backend = DB_BACKEND_FD;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  sync_db
+ *      fd:  linux file descriptor
+ *
+ *  Makes every change written through fd so far durable, the mapping of
+ *  the mmap backend included.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int sync_db(int fd)
+{
+    db_handle_t *h = db_handle(fd);
+    if (h != NULL && h->map != NULL && io_msync(h->map, h->map_len, MS_SYNC) < 0)
+        return ERR_DB_FILE;
+    return (io_fdatasync(fd) < 0) ? ERR_DB_FILE : NO_ERROR;
+}
+
+/*
+ *  put_slot
+ *      fd:   linux file descriptor
+ *      id:   student id whose slot is overwritten
+ *      rec:  record to store, EMPTY_STUDENT_RECORD to delete
+ *
+ *  Single place where add_student() and del_student() modify the database:
+ *  the slot is written through the backend of fd and the header, if the
+ *  file has one, is updated to match.  Storing an id that a compacted file
+ *  has no record for first expands the file back to slots, see expand_db().
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  Safe to call from several threads for different ids as long as the
+ *  database is not compacted.
+ *
+ *  console:  only the errors of expand_db(), callers report a failure
+ */
+int put_slot(int fd, int id, const student_t *rec)
+{
+    off_t offset;
+    db_packed_t packed;
+    int rc = locate_slot(fd, id, &offset);
+
+    // a compacted file has no room for a new id, and a packed one none for
+    // a last name that is not a dictionary code: go back to slots
+    if (rc == SRCH_NOT_FOUND || (rc == NO_ERROR && db_is_packed(fd) && !pack_record(rec, &packed)))
+    {
+        if (expand_db(fd) != NO_ERROR)
+            return ERR_DB_FILE;
+        rc = locate_slot(fd, id, &offset);
+    }
+    // a compacted file has no bitmap, the record tells whether it was live
+    int old_id = 0;
+    if (rc == NO_ERROR && db_is_compact(fd) &&
+        io_pread(fd, &old_id, sizeof(old_id), offset) != sizeof(old_id))
+        rc = ERR_DB_FILE;
+    if (rc != NO_ERROR)
+        return ERR_DB_FILE;
+
+    // readers of the column take the slot from the database until the
+    // change is noted there too, even if we crash before that.  In WAL
+    // mode the change is durable in the log before the slot changes
+    if (column_note(fd, id, NULL) != NO_ERROR || wal_log(id, rec) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    db_handle_t *h = db_handle(fd);
+    int rec_len = db_rec_len(fd);
+    if (h != NULL && h->backend == DB_BACKEND_MMAP)
+        rc = map_put_student(h, fd, id, rec);
+    else if (io_pwrite(fd, db_is_packed(fd) ? (const void *)&packed : (const void *)rec, rec_len, offset) != rec_len)
+        rc = ERR_DB_FILE;
+
+    if (rc == NO_ERROR)
+        rc = note_db_change(fd, id, rec->id != 0, old_id != 0);
+    if (rc == NO_ERROR)
+        rc = column_note(fd, id, rec);
+    if (rc == NO_ERROR)
+        rc = backup_note(offset, rec_len);
+    if (wal_applied(fd) != NO_ERROR)
+        rc = ERR_DB_FILE;
+    return rc;
+}
+
+/*
+ *  insert_student
+ *      fd:     linux file descriptor
+ *      id:     student id, already checked by validate_range()
+ *      fname:  student first name
+ *      lname:  student last name
+ *      gpa:    GPA as an integer
+ *      msg:    receives the message reporting the outcome, a format that
+ *              takes the id
+ *
+ *  Core of add_student() without the console output, shared with the
+ *  server (see sdbsc_server.c) which sends msg to its client instead.
+ *
+ *  returns:  same as add_student()
+ */
+int insert_student(int fd, int id, char *fname, char *lname, int gpa, const char **msg)
+{
+    student_t student = {0};
+    db_lock_t lk;
+    int rc;
+
+    // no other process may add the id between the probe and the write
+    if (lock_slots(fd, id, 1, &lk) != NO_ERROR)
+    {
+        *msg = M_ERR_DB_WRITE;
+        return ERR_DB_FILE;
+    }
+    rc = get_student(fd, id, &student);
+    if (rc == NO_ERROR)
+    {
+        *msg = M_ERR_DB_ADD_DUP;
+        rc = ERR_DB_OP;
+    }
+    else if (rc != SRCH_NOT_FOUND)
+    {
+        *msg = M_ERR_DB_READ;
+    }
+    else
+    {
+        memset(&student, 0, sizeof(student));
+        student.id = id;
+        student.gpa = gpa;
+        *msg = M_ERR_DB_WRITE;
+        rc = ERR_DB_FILE;
+        bool named = name_store(fd, fname, student.fname, sizeof(student.fname), false) == NO_ERROR &&
+                     name_store(fd, lname, student.lname, sizeof(student.lname), true) == NO_ERROR;
+        // still under the slot lock, so the log sees changes of the id in
+        // the order they were made.  Logged before the write: a crash in
+        // between leaves a stale entry, never a missing one
+        if (named && index_note(fd, &student, true) != NO_ERROR)
+            *msg = M_ERR_IDX;
+        else if (named && put_slot(fd, id, &student) == NO_ERROR)
+        {
+            *msg = M_STD_ADDED;
+            rc = NO_ERROR;
+        }
+    }
+    unlock_slots(fd, &lk);
+    return rc;
+}
+
+/*
+ *  add_student
+ *      fd:     linux file descriptor
+ *      id:     student id (range is defined in db.h )
+ *      fname:  student first name
+ *      lname:  student last name
+ *      gpa:    GPA as an integer (range defined in db.h)
+ *
+ *  Adds a new student to the database.  After calculating the index for the
+ *  student, check if there is another student already at that location.  A good
+ *  way is to use something like memcmp() to ensure that the location for this
+ *  student contains all zero byes indicating the space is empty.
+ *
+ *  returns:  NO_ERROR       student added to database
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      database operation logically failed (aka student
+ *                           already exists)
+ *
+ *
+ *  console:  M_STD_ADDED       on success
+ *            M_ERR_DB_ADD_DUP  student already exists
+ *            M_ERR_DB_READ     error reading or seeking the database file
+ *            M_ERR_DB_WRITE    error writing to db file (adding student)
+ *            M_ERR_IDX         error updating the last name index
+ *
+ */
+int add_student(int fd, int id, char *fname, char *lname, int gpa)
+{
+    IO_PHASE(IO_PHASE_ADD);
+    const char *msg;
+
+    int rc = insert_student(fd, id, fname, lname, gpa, &msg);
+    printf(msg, id);
+    return rc;
+}
+
+/*
+ *  remove_student
+ *      fd:   linux file descriptor
+ *      id:   student id to be deleted
+ *      msg:  receives the message reporting the outcome, a format that
+ *            takes the id
+ *
+ *  Core of del_student() without the console output, shared with the
+ *  server like insert_student().
+ *
+ *  returns:  same as del_student()
+ */
+int remove_student(int fd, int id, const char **msg)
+{
+    student_t student = {0};
+    db_lock_t lk;
+
+    if (lock_slots(fd, id, 1, &lk) != NO_ERROR)
+    {
+        *msg = M_ERR_DB_WRITE;
+        return ERR_DB_FILE;
+    }
+    int result = get_student(fd, id, &student);
+    if (result == SRCH_NOT_FOUND)
+    {
+        *msg = M_STD_NOT_FND_MSG;
+        result = ERR_DB_OP;
+    }
+    else if (result != NO_ERROR)
+    {
+        *msg = M_ERR_DB_READ;
+    }
+    else if (put_slot(fd, id, &EMPTY_STUDENT_RECORD) != NO_ERROR)
+    {
+        *msg = M_ERR_DB_WRITE;
+        result = ERR_DB_FILE;
+    }
+    else if (index_note(fd, &student, false) != NO_ERROR)
+    {
+        *msg = M_ERR_IDX;
+        result = ERR_DB_FILE;
+    }
+    else
+    {
+        *msg = M_STD_DEL_MSG;
+    }
+    unlock_slots(fd, &lk);
+    return result;
+}
+
+/*
+ *  del_student
+ *      fd:     linux file descriptor
+ *      id:     student id to be deleted
+ *
+ *  Removes a student to the database.  Use the get_student() function to
+ *  locate the student to be deleted. If there is a student at that location
+ *  write an empty student record - see EMPTY_STUDENT_RECORD from db.h at
+ *  that location.
+ *
+ *  returns:  NO_ERROR       student deleted from database
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      database operation logically failed (aka student
+ *                           not in database)
+ *
+ *
+ *  console:  M_STD_DEL_MSG      on success
+ *            M_STD_NOT_FND_MSG  student not in database, cant be deleted
+ *            M_ERR_DB_READ      error reading or seeking the database file
+ *            M_ERR_DB_WRITE     error writing to db file (adding student)
+ *            M_ERR_IDX          error updating the last name index
+ *
+ */
+int del_student(int fd, int id)
+{
+    IO_PHASE(IO_PHASE_DELETE);
+    const char *msg;
+
+    int rc = remove_student(fd, id, &msg);
+    printf(msg, id);
+    return rc;
+}
+
+/*
+ *  count_db_records
+ *      fd:     linux file descriptor
+ *
+ *  Counts the number of records in the database.  Start by reading the
+ *  database at the beginning, and continue reading individual records
+ *  until you it EOF.  EOF is when the read() syscall returns 0. Check
+ *  if a slot is empty or previously deleted by investigating if all of
+ *  the bytes in the record read are zeros - I would suggest using memory
+ *  compare memcmp() for this. Create a counter variable and initialize it
+ *  to zero, every time a non-zero record is read increment the counter.
+ *  A version 1 header keeps the count, other files are read in large
+ *  chunks by a scan (see scan_open()) that skips the holes of the file.
+ *
+ *  returns:  <number>       returns the number of records in db on success
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      database operation logically failed (aka student
+ *                           not in database)
+ *
+ *
+ *  console:  M_DB_RECORD_CNT  on success, to report the number of students in db
+ *            M_DB_EMPTY       on success if the record count in db is zero
+ *            M_ERR_DB_READ    error reading or seeking the database file
+ *            M_ERR_DB_WRITE   error writing to db file (adding student)
+ *
+ */
+int count_db_records(int fd)
+{
+    int count = db_count(fd);
+
+    if (count < 0)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    if (count == 0)
+    {
+        printf(M_DB_EMPTY);
+    }
+    else
+    {
+        printf(M_DB_RECORD_CNT, count);
+    }
+    return NO_ERROR;
+}
+
+// parallel_scan() task of db_count(), counts[part] receives the count
+static int count_part(int fd, int lo, int hi, int part, void *arg)
+{
+    int *counts = arg;
+    int got;
+    db_scan_t sc;
+
+    if (scan_open_range(&sc, fd, 0, lo, hi) != NO_ERROR)
+        return ERR_DB_FILE;
+    while ((got = scan_next(&sc)) > 0)
+        counts[part] += got;
+    scan_close(&sc);
+    return (got < 0) ? ERR_DB_FILE : NO_ERROR;
+}
+
+// the counting half of count_db_records(), without any console output.
+// Only pread() is used so the server threads can share the fd.  Returns
+// the number of live records or ERR_DB_FILE.
+int db_count(int fd)
+{
+    int count = 0, got;
+    db_scan_t sc;
+
+    if (db_has_header(fd))
+    {
+        // the header keeps the count, no need to look at the slots
+        db_header_t hdr;
+        if (io_pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            return ERR_DB_FILE;
+        return hdr.count;
+    }
+
+    // the hot column holds the ids in an eighth of the bytes
+    count = column_count(fd);
+    if (count != SRCH_NOT_FOUND)
+        return count;
+    count = 0;
+
+    if (scan_threads > 1)
+    {
+        int nparts = scan_threads * DB_SCAN_PARTS;
+        int *counts = calloc(nparts, sizeof(int));
+        if (counts == NULL)
+            return ERR_DB_FILE;
+        int rc = parallel_scan(fd, scan_threads, nparts, count_part, counts);
+        for (int i = 0; i < nparts; i++)
+            count += counts[i];
+        free(counts);
+        return (rc < 0) ? rc : count;
+    }
+
+    if (scan_open(&sc, fd, 0) != NO_ERROR)
+        return ERR_DB_FILE;
+    while ((got = scan_next(&sc)) > 0)
+        count += got;
+    scan_close(&sc);
+    return (got < 0) ? ERR_DB_FILE : count;
+}
+
+// writes rows formatted by the print functions, timed as output by -v
+static void put_rows(const char *out, size_t used)
+{
+    IO_PHASE(IO_PHASE_OUTPUT);
+    fwrite(out, 1, used, stdout);
+}
+
+// prints one row of print_db(), preceded by the table header for the
+// first live record.  Empty slots are ignored.
+void print_db_row(const student_t *s, int *first_record)
+{
+    if (s->id == 0)
+        return;
+    if (*first_record)
+    {
+        printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+        *first_record = 0;
+    }
+    char row[DB_PRINT_ROW_MAX];
+    format_row(row, sizeof(row), s);
+    fputs(row, stdout);
+}
+
+// appends the print_db() row of s to out, returns its length.  Names kept
+// in the heap are read from there (see sdbsc_names.c), in full.
+size_t format_row(char *out, size_t room, const student_t *s)
+{
+    int len;
+
+    if (name_spilled(s->fname, sizeof(s->fname)) || name_spilled(s->lname, sizeof(s->lname)))
+    {
+        char fname[NAME_HEAP_MAX_LEN + 1], lname[NAME_HEAP_MAX_LEN + 1];
+        len = snprintf(out, room, STUDENT_PRINT_LONG_FMT_STRING, s->id,
+                       name_get(s->fname, sizeof(s->fname), fname),
+                       name_get(s->lname, sizeof(s->lname), lname), s->gpa / 100.0);
+    }
+    else
+    {
+        len = snprintf(out, room, STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, s->gpa / 100.0);
+    }
+    return (len < 0) ? 0 : ((size_t)len < room) ? (size_t)len : room - 1;
+}
+
+// parallel_scan() task of print_db(): formats the rows of one part into
+// memory, then waits for the parts before it and writes them out.  Also
+// used for the shards of a sharded database, one part per shard.
+int print_part(int fd, int lo, int hi, int part, void *arg)
+{
+    IO_PHASE(IO_PHASE_FORMAT);
+    par_print_t *pp = arg;
+    char *out = NULL;
+    size_t used = 0, cap = 0;
+    int rc = NO_ERROR, got, rows = 0;
+    db_scan_t sc;
+
+    // long names come from the heap of this database, whatever thread
+    names_use(fd);
+    if (scan_open_range(&sc, fd, 0, lo, hi) != NO_ERROR)
+        rc = ERR_DB_FILE;
+    else
+    {
+        while (rc == NO_ERROR && (got = scan_next(&sc)) > 0)
+        {
+            for (int i = 0; i < got; i++)
+            {
+                if (cap - used < DB_PRINT_ROW_MAX)
+                {
+                    cap = cap ? cap * 2 : DB_PRINT_BUF;
+                    char *grown = realloc(out, cap);
+                    if (grown == NULL)
+                    {
+                        rc = ERR_DB_FILE;
+                        break;
+                    }
+                    out = grown;
+                }
+                used += format_row(out + used, cap - used, sc.batch[i]);
+                rows++;
+            }
+        }
+        if (got < 0)
+            rc = ERR_DB_FILE;
+        scan_close(&sc);
+    }
+
+    // even a failed part takes its turn, the parts after it wait for it
+    pthread_mutex_lock(&pp->lock);
+    while (pp->next != part)
+        pthread_cond_wait(&pp->turn, &pp->lock);
+    if (rc == NO_ERROR && rows > 0)
+    {
+        if (pp->rows == 0)
+            printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+        put_rows(out, used);
+        pp->rows += rows;
+    }
+    pp->next++;
+    pthread_cond_broadcast(&pp->turn);
+    pthread_mutex_unlock(&pp->lock);
+
+    free(out);
+    return rc;
+}
+
+// print_db() with -j: parts scanned side by side, written in id order
+static int print_db_parallel(int fd)
+{
+    par_print_t pp = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+    int rc = parallel_scan(fd, scan_threads, scan_threads * DB_SCAN_PARTS, print_part, &pp);
+
+    pthread_mutex_destroy(&pp.lock);
+    pthread_cond_destroy(&pp.turn);
+    return (rc < 0) ? rc : pp.rows;
+}
+
+/*
+ *  print_db
+ *      fd:     linux file descriptor
+ *
+ *  Prints all records in the database.  Start by reading the
+ *  database at the beginning, and continue reading individual records
+ *  until you it EOF.  EOF is when the read() syscall returns 0. Check
+ *  if a slot is empty or previously deleted by investigating if all of
+ *  the bytes in the record read are zeros - I would suggest using memory
+ *  compare memcmp() for this. Be careful as the database might be empty.
+ *  Like count_db_records() the file is read in large chunks by a scan (see
+ *  scan_open()), and the rows are formatted into a large output buffer.
+ *  on the first real row encountered print the header for the required output:
+ *
+ *     printf(STUDENT_PRINT_HDR_STRING, "ID",
+ *                  "FIRST_NAME", "LAST_NAME", "GPA");
+ *
+ *  then for each valid record encountered print the required output:
+ *
+ *     printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname,
+ *                    student.lname, calculated_gpa_from_student);
+ *
+ *  The code above assumes you are reading student records into a local
+ *  variable named student that is of type student_t. Also dont forget that
+ *  the GPA in the student structure is an int, to convert it into a real
+ *  gpa divide by 100.0 and store in a float variable.
+ *
+ *  returns:  NO_ERROR       on success
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *
+ *  console:  <see above>      on success, print table or database empty
+ *            M_ERR_DB_READ    error reading or seeking the database file
+ *
+ */
+int print_db(int fd)
+{
+    db_scan_t sc;
+    int rows;
+
+    if (print_sorted())
+    {
+        sorter_t *st = sort_begin();
+        rows = (st == NULL) ? ERR_DB_FILE : sort_end(st, sort_scan(st, fd) == NO_ERROR);
+    }
+    else if (scan_threads > 1)
+    {
+        rows = print_db_parallel(fd);
+    }
+    else
+    {
+        if (scan_open(&sc, fd, 0) != NO_ERROR)
+        {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_FILE;
+        }
+        rows = print_scan(&sc, NULL, NULL);
+        scan_close(&sc);
+    }
+
+    if (rows < 0)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    if (rows == 0)
+    {
+        printf(M_DB_EMPTY);
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ *  print_range
+ *      fd:  linux file descriptor
+ *      lo:  first id of the range
+ *      hi:  last id of the range
+ *
+ *  Prints the students with lo <= id <= hi in the print_db() format.  Ids
+ *  map straight to offsets, so the range is one contiguous region of a
+ *  slot file (one stretch of records in a compacted file) and is read with
+ *  one pread() per scan chunk, nothing outside of it is touched.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  the rows, M_RANGE_EMPTY if there are none or M_ERR_DB_READ
+ */
+int print_range(int fd, int lo, int hi)
+{
+    db_scan_t sc;
+
+    if (scan_open_range(&sc, fd, 0, lo, hi) != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    int rows = print_scan(&sc, NULL, NULL);
+    scan_close(&sc);
+
+    if (rows < 0)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    if (rows == 0)
+    {
+        printf(M_RANGE_EMPTY, lo, hi);
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  print_scan
+ *      sc:    scan started with scan_open() or scan_open_range()
+ *      keep:  filter, records it returns false for are not printed.  NULL
+ *             prints every record of the scan
+ *      arg:   passed on to keep
+ *
+ *  Runs the scan to its end and prints the records in the print_db() table
+ *  format, the header before the first row.  Rows are formatted into one
+ *  large buffer and written out a buffer at a time instead of going
+ *  through printf() row by row.
+ *
+ *  returns:  the number of rows printed or ERR_DB_FILE
+ */
+int print_scan(db_scan_t *sc, scan_filter_t keep, const void *arg)
+{
+    IO_PHASE(IO_PHASE_FORMAT);
+    char *out = malloc(DB_PRINT_BUF);
+    size_t used = 0;
+    int got, rows = 0;
+
+    if (out == NULL)
+        return ERR_DB_FILE;
+
+    while ((got = scan_next(sc)) > 0)
+    {
+        for (int i = 0; i < got; i++)
+        {
+            const student_t *s = sc->batch[i];
+            if (keep != NULL && !keep(s, arg))
+                continue;
+            if (DB_PRINT_BUF - used < DB_PRINT_ROW_MAX)
+            {
+                put_rows(out, used);
+                used = 0;
+            }
+            if (rows++ == 0)
+                used += snprintf(out + used, DB_PRINT_BUF - used, STUDENT_PRINT_HDR_STRING,
+                                 "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+            used += format_row(out + used, DB_PRINT_BUF - used, s);
+        }
+    }
+    put_rows(out, used);
+    free(out);
+    return (got < 0) ? ERR_DB_FILE : rows;
+}
+
+/*
+ *  print_student
+ *      *s:   a pointer to a student_t structure that should
+ *            contain a valid student to be printed
+ *
+ *  Start by ensuring that provided student pointer is valid.  To do this
+ *  make sure it is not NULL and that s->id is not zero.  After ensuring
+ *  that the student is valid, print it the exact way that is described
+ *  in the print_db() function by first printing the header then the
+ *  student data:
+ *
+ *     printf(STUDENT_PRINT_HDR_STRING, "ID",
+ *                  "FIRST NAME", "LAST_NAME", "GPA");
+ *
+ *     printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname,
+ *                    student.lname, calculated_gpa_from_s);
+ *
+ *  Dont forget that  the GPA in the student structure is an int, to convert
+ *  it into a real gpa divide by 100.0 and store in a float variable.
+ *
+ *  returns:  nothing, this is a void function
+ *
+ *
+ *  console:  <see above>      on success, print table or database empty
+ *            M_ERR_STD_PRINT  if the function argument s is NULL or if
+ *                             s->id is zero
+ *
+ */
+void print_student(student_t *s)
+{
+    if (s == NULL || s->id == 0)
+    {
+        printf(M_ERR_STD_PRINT);
+        return;
+    }
+
+    printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+    char row[DB_PRINT_ROW_MAX];
+    format_row(row, sizeof(row), s);
+    fputs(row, stdout);
+}
+
+// ascending order for qsort() of ids
+static int cmp_id(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ *  find_students
+ *      fd:   linux file descriptor
+ *      ids:  ids to look up, sorted and deduplicated in place
+ *      n:    number of ids
+ *
+ *  Looks up many students at once.  The ids are sorted, which puts their
+ *  records in file order, and lookups closer than DB_MGET_GAP bytes are
+ *  merged into one span.  A span is read with a single preadv() that
+ *  scatters the wanted records straight into place and the slots between
+ *  them into a scratch buffer.  All spans are announced to the kernel with
+ *  POSIX_FADV_WILLNEED before the first one is read, so the reads of a
+ *  cold file are in flight together instead of one after the other.  A
+ *  compacted file has its whole id directory read once up front.
+ *
+ *  returns:  NO_ERROR if every student was found, SRCH_NOT_FOUND if some
+ *            were not, ERR_DB_FILE on error
+ *
+ *  console:  the students found in the print_db() format, in id order,
+ *            then M_STD_NOT_FND_MSG for every id that was not found,
+ *            M_ERR_DB_READ on error
+ */
+int find_students(int fd, int *ids, int n)
+{
+    IO_PHASE(IO_PHASE_GET);
+    db_handle_t *h = db_handle(fd);
+    bool compact = h != NULL && (h->flags & DB_FLAG_COMPACT);
+    int rec_len = db_rec_len(fd);
+    student_t *recs = NULL;
+    db_packed_t *packed = NULL;
+    off_t *offs = NULL;
+    int *dir = NULL;
+    struct iovec *iov = NULL;
+    char *gap = NULL;
+    int rc = ERR_DB_FILE;
+
+    qsort(ids, n, sizeof(int), cmp_id);
+    int m = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (m == 0 || ids[i] != ids[m - 1])
+            ids[m++] = ids[i];
+    }
+    n = m;
+
+    recs = calloc(n ? n : 1, sizeof(student_t));
+    offs = malloc((n ? n : 1) * sizeof(off_t));
+    iov = malloc(IOV_MAX * sizeof(struct iovec));
+    gap = malloc(DB_MGET_GAP);
+    if (recs == NULL || offs == NULL || iov == NULL || gap == NULL)
+        goto done;
+    // the records of a packed file are read as they are, then unpacked
+    char *dst = (char *)recs;
+    if (db_is_packed(fd))
+    {
+        packed = calloc(n ? n : 1, sizeof(db_packed_t));
+        if (packed == NULL)
+            goto done;
+        dst = (char *)packed;
+    }
+
+    if (compact && h->entries > 0)
+    {
+        ssize_t len = (ssize_t)h->entries * sizeof(int);
+        dir = malloc(len);
+        if (dir == NULL || io_pread(fd, dir, len, DB_COMPACT_DIR_OFF) != len)
+            goto done;
+    }
+
+    // file offset of every record, -1 when there is nothing to read
+    for (int i = 0; i < n; i++)
+    {
+        offs[i] = -1;
+        if (ids[i] < MIN_STD_ID || slot_index(fd, ids[i]) < 0 || slot_index(fd, ids[i]) > MAX_STD_ID)
+            continue;
+        if (compact)
+        {
+            int *hit = (dir == NULL) ? NULL : bsearch(&ids[i], dir, h->entries, sizeof(int), cmp_id);
+            if (hit != NULL)
+                offs[i] = h->data_off + (off_t)(hit - dir) * rec_len;
+        }
+        else
+        {
+            offs[i] = slot_offset(fd, ids[i]);
+        }
+    }
+
+    // two passes over the spans: announce them all, then read them
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 0, j; i < n; i = j)
+        {
+            if (offs[i] < 0)
+            {
+                j = i + 1;
+                continue;
+            }
+
+            int nv = 0;
+            off_t end = offs[i] + rec_len;
+            iov[nv].iov_base = dst + (size_t)i * rec_len;
+            iov[nv++].iov_len = rec_len;
+            for (j = i + 1; j < n && nv + 2 <= IOV_MAX; j++)
+            {
+                if (offs[j] < 0)
+                    continue;
+                off_t hole = offs[j] - end;
+                if (hole > DB_MGET_GAP)
+                    break;
+                if (hole > 0)
+                {
+                    iov[nv].iov_base = gap;
+                    iov[nv++].iov_len = hole;
+                }
+                iov[nv].iov_base = dst + (size_t)j * rec_len;
+                iov[nv++].iov_len = rec_len;
+                end = offs[j] + rec_len;
+            }
+            off_t span = end - offs[i];
+
+            if (pass == 0)
+            {
+#ifdef POSIX_FADV_WILLNEED
+                posix_fadvise(fd, offs[i], span, POSIX_FADV_WILLNEED);
+#endif
+                continue;
+            }
+
+            ssize_t got = io_preadv(fd, iov, nv, offs[i]);
+            if (got < 0)
+                goto done;
+            if (got < span)
+            {
+                // the file ends inside the span, what lies past it is empty
+                for (int k = i; k < j; k++)
+                {
+                    if (offs[k] >= 0 && offs[k] + rec_len > offs[i] + got)
+                        memset(dst + (size_t)k * rec_len, 0, rec_len);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; packed != NULL && i < n; i++)
+        unpack_record(&packed[i], &recs[i]);
+
+    int first_record = 1, missing = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (recs[i].id == ids[i])
+            print_db_row(&recs[i], &first_record);
+        else
+            missing++;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (recs[i].id != ids[i])
+            printf(M_STD_NOT_FND_MSG, ids[i]);
+    }
+    rc = (missing > 0) ? SRCH_NOT_FOUND : NO_ERROR;
+
+done:
+    if (rc == ERR_DB_FILE)
+        printf(M_ERR_DB_READ);
+    free(recs);
+    free(packed);
+    free(offs);
+    free(dir);
+    free(iov);
+    free(gap);
+    return rc;
+}
+
+// compress_db() without its success message, the shards of a sharded
+// database are compacted one by one and report once for all of them
+int compact_db(int fd)
+{
+    student_t *recs;
+    db_lock_t lk;
+    int n;
+
+    // writers of other processes wait until the new file is in place, and
+    // the log must not replay into it
+    if (lock_whole_db(fd, &lk) != NO_ERROR || wal_checkpoint(fd) != NO_ERROR)
+    {
+        unlock_slots(fd, &lk);
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    if (collect_live(fd, &recs, &n) != NO_ERROR)
+    {
+        unlock_slots(fd, &lk);
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    int temp_fd = io_open(TMP_DB_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (temp_fd < 0)
+    {
+        free(recs);
+        unlock_slots(fd, &lk);
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+
+    // remember which slot layout to return to when the file is expanded
+    db_header_t hdr = {0};
+    hdr.flags = DB_FLAG_COMPACT;
+    if (db_slots_have_header(fd))
+        hdr.flags |= DB_FLAG_SLOT_HDR;
+    hdr.count = n;
+    hdr.base_id = db_base_id(fd);
+    hdr.entries = n;
+    hdr.min_id = n > 0 ? recs[0].id : 0;
+    hdr.max_id = n > 0 ? recs[n - 1].id : 0;
+
+    int *dir = malloc((n ? n : 1) * sizeof(int));
+    bool ok = dir != NULL;
+
+    for (int i = 0; ok && i < n; i++)
+        dir[i] = recs[i].id;
+
+    // with every last name in the dictionary the records shrink to their
+    // code, packed in place over the array they came from
+    bool packed = n > 0;
+    db_packed_t p;
+    for (int i = 0; packed && i < n; i++)
+        packed = pack_record(&recs[i], &p);
+    for (int i = 0; packed && i < n; i++)
+    {
+        pack_record(&recs[i], &p);
+        memcpy((char *)recs + (size_t)i * DB_PACKED_RECORD_SIZE, &p, DB_PACKED_RECORD_SIZE);
+    }
+    if (packed)
+        hdr.flags |= DB_FLAG_PACKED;
+
+    ssize_t dir_len = (ssize_t)n * sizeof(int);
+    ssize_t rec_len = (ssize_t)n * (packed ? DB_PACKED_RECORD_SIZE : STUDENT_RECORD_SIZE);
+    ok = ok && write_db_header(temp_fd, &hdr, NULL) == NO_ERROR &&
+         io_pwrite(temp_fd, dir, dir_len, DB_COMPACT_DIR_OFF) == dir_len &&
+         io_pwrite(temp_fd, recs, rec_len, DB_COMPACT_DATA_OFF(n)) == rec_len &&
+         io_ftruncate(temp_fd, DB_COMPACT_DATA_OFF(n) + rec_len) == 0;
+    free(dir);
+    free(recs);
+
+    if (!ok)
+    {
+        printf(M_ERR_DB_WRITE);
+        io_close(temp_fd);
+        io_unlink(TMP_DB_FILE);
+        unlock_slots(fd, &lk);
+        return ERR_DB_FILE;
+    }
+
+    // rename while still holding the lock, closing fd releases it
+    backup_drop();
+    int renamed = rename_tmp_db(temp_fd);
+    io_close(temp_fd);
+    db_handle_t *h = db_handle(fd);
+    bool with_log = h == NULL || !h->no_log;
+    close_db(fd);
+    if (renamed != NO_ERROR)
+    {
+        printf(M_ERR_DB_CREATE);
+        return ERR_DB_FILE;
+    }
+
+    // like migrate_db(), the caller keeps working on a fully opened fd
+    return open_db(DB_FILE, false, with_log);
+}
+
+/*
+ *  NOTE IMPLEMENTING THIS FUNCTION IS EXTRA CREDIT
+ *
+ *  compress_db
+ *      fd:     linux file descriptor
+ *
+ *  This assignment takes advantage of the way Linux handles sparse files
+ *  on disk. Thus if there is a large hole between student records, Linux
+ *  will not use any physical storage.  However, when a database record is
+ *  deleted storage is used to write a blank - see EMPTY_STUDENT_RECORD from
+ *  db.h - record.
+ *
+ *  Since Linux provides no way to delete data in the middle of a file, and
+ *  deleted records take up physical storage, this function will compress the
+ *  database by rewriting a new database file that only includes valid student
+ *  records. There are a number of ways to do this, but since this is extra credit
+ *  you need to figure this out on your own.
+ *
+ *  At a high level create a temporary database file then copy all valid students from
+ *  the active database (passed in via fd) to the temporary file. When this is done
  *  rename the temporary database file to the name of the real database file. See
  *  the constants in db.h for required file names:
  *
- *         #define DB_FILE     "student.db"        //name of database file
- *         #define TMP_DB_FILE ".tmp_student.db"   //for extra credit
+ *         #define DB_FILE     "student.db"        //name of database file
+ *         #define TMP_DB_FILE ".tmp_student.db"   //for extra credit
+ *
+ *  Note that you are passed in the fd of the database file to be compressed,
+ *  it is very likely you will need to close it to overwrite it with the
+ *  compressed version of the file.  To ensure the caller can work with the
+ *  compressed file after you create it, it is a good design to return the fd
+ *  of the new compressed file from this function
+ *
+ *  The compressed file uses the compacted version 1 layout from db.h: the
+ *  records are packed in id order behind a sorted directory of their ids,
+ *  so get_student() and del_student() still find them (see locate_slot()).
+ *  Adding a new id later expands the file back to slots.
+ *
+ *  returns:  <number>       returns the fd of the compressed database file
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *
+ *  console:  M_DB_COMPRESSED_OK  on success, the db was successfully compressed.
+ *            M_ERR_DB_OPEN    error when opening/creating temporary database file.
+ *                             this error should also be returned after you
+ *                             compressed the database file and if you are unable
+ *                             to open it to pass the fd back to the caller
+ *            M_ERR_DB_CREATE  error creating the db file. For instance the
+ *                             inability to copy the temporary file back as
+ *                             the primary database file.
+ *            M_ERR_DB_READ    error reading or seeking the the db or tempdb file
+ *            M_ERR_DB_WRITE   error writing to db or tempdb file (adding student)
+ *
+ */
+int compress_db(int fd)
+{
+    IO_PHASE(IO_PHASE_COMPRESS);
+    fd = compact_db(fd);
+    if (fd >= 0)
+        printf(M_DB_COMPRESSED_OK);
+    return fd;
+}
+
+/*
+ *  punch_db
+ *      fd:     linux file descriptor
+ *
+ *  Online alternative to compress_db().  Deleted records are all zero
+ *  bytes, so once every record of a filesystem block has been deleted the
+ *  block holds nothing but zeros.  This pass reads the allocated extents of
+ *  the record area and hands such blocks back to the filesystem with
+ *  fallocate(FALLOC_FL_PUNCH_HOLE).  The file keeps its size and every
+ *  record keeps its offset, so nothing has to be copied or renamed and the
+ *  id addressing (or the directory of a compacted file) stays valid.
+ *  Writers of other processes wait for the pass under the whole-file lock.
+ *
+ *  returns:  NO_ERROR       on success
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      the filesystem cannot punch holes
+ *
+ *  console:  M_DB_PUNCHED     on success, blocks released and bytes freed
+ *            M_ERR_DB_PUNCH   the filesystem does not support punching
+ *            M_ERR_DB_READ    error reading the database file
+ */
+int punch_db(int fd)
+{
+    IO_PHASE(IO_PHASE_COMPRESS);
+#ifdef FALLOC_FL_PUNCH_HOLE
+    const size_t chunk_len = 1 << 20;
+    struct stat before, after;
+    off_t pos, start, end;
+    int punched = 0;
+    db_lock_t lk;
+    char *chunk = NULL;
+    int rc = NO_ERROR;
+
+    // a writer must not fill a block between its read and its punch, and
+    // the log must not replay into a punched block
+    if (lock_whole_db(fd, &lk) != NO_ERROR || wal_checkpoint(fd) != NO_ERROR)
+    {
+        unlock_slots(fd, &lk);
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    // never touch the header or the directory of a compacted file
+    db_handle_t *h = db_handle(fd);
+    off_t base = (h != NULL) ? h->data_off : 0;
+
+    if (io_fstat(fd, &before) < 0 || (chunk = malloc(chunk_len)) == NULL)
+    {
+        printf(M_ERR_DB_READ);
+        rc = ERR_DB_FILE;
+        goto done;
+    }
+    off_t blksz = before.st_blksize > 0 ? before.st_blksize : 4096;
+
+    pos = base;
+    while (rc == NO_ERROR && next_data_extent(fd, pos, &start, &end))
+    {
+        off_t extent_end = end;
+
+        // only whole blocks inside the record area can go
+        if (start < base)
+            start = base;
+        start = (start + blksz - 1) / blksz * blksz;
+        end = end / blksz * blksz;
+
+        for (pos = start; rc == NO_ERROR && pos < end;)
+        {
+            size_t want = (end - pos < (off_t)chunk_len) ? (size_t)(end - pos) : chunk_len;
+            ssize_t got = io_pread(fd, chunk, want, pos);
+            if (got <= 0)
+            {
+                printf(M_ERR_DB_READ);
+                rc = ERR_DB_FILE;
+                break;
+            }
+            got -= got % blksz;
+
+            // punch every run of zero blocks with one call
+            off_t run = -1;
+            for (off_t b = 0; rc == NO_ERROR && b <= got; b += blksz)
+            {
+                bool zero = b < got && chunk[b] == 0 &&
+                            memcmp(chunk + b, chunk + b + 1, blksz - 1) == 0;
+                if (zero && run < 0)
+                    run = b;
+                if (zero || run < 0)
+                    continue;
+
+                if (io_fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                              pos + run, b - run) < 0)
+                {
+                    bool unsupported = errno == EOPNOTSUPP || errno == ENOSYS;
+                    printf(unsupported ? M_ERR_DB_PUNCH : M_ERR_DB_WRITE);
+                    rc = unsupported ? ERR_DB_OP : ERR_DB_FILE;
+                }
+                // the holes go into the next incremental backup
+                else if (backup_note(pos + run, b - run) != NO_ERROR)
+                {
+                    printf(M_ERR_DB_WRITE);
+                    rc = ERR_DB_FILE;
+                }
+                punched += (b - run) / blksz;
+                run = -1;
+            }
+            if (got == 0)
+                break;
+            pos += got;
+        }
+        pos = extent_end;
+    }
+
+    if (rc == NO_ERROR && io_fstat(fd, &after) < 0)
+    {
+        printf(M_ERR_DB_READ);
+        rc = ERR_DB_FILE;
+    }
+    if (rc == NO_ERROR)
+    {
+        long long freed = (long long)(before.st_blocks - after.st_blocks) * 512;
+        printf(M_DB_PUNCHED, punched, freed > 0 ? freed : 0);
+    }
+
+done:
+    free(chunk);
+    unlock_slots(fd, &lk);
+    return rc;
+#else
+    (void)fd;
+    printf(M_ERR_DB_PUNCH);
+    return ERR_DB_OP;
+#endif
+}
+
+/*
+ *  Bulk loading.  Rows are collected in memory, sorted by id and then
+ *  written in runs of consecutive ids.  The existing slots covering a
+ *  window of rows are read with a single pread() to find duplicates, and
+ *  every run of consecutive new ids goes out with one pwritev().
+ */
+#define LOAD_WINDOW_RECS  16384     // 1MB of slots probed per pread()
+
+typedef struct load_row
+{
+    student_t rec;
+    int line; // input line, keeps the first of duplicate ids
+} load_row_t;
+
+static int cmp_load_row(const void *a, const void *b)
+{
+    const load_row_t *ra = a;
+    const load_row_t *rb = b;
+    if (ra->rec.id != rb->rec.id)
+        return (ra->rec.id > rb->rec.id) - (ra->rec.id < rb->rec.id);
+    return ra->line - rb->line;
+}
+
+/*
+ *  parse_load_line
+ *      fd:    linux file descriptor, long names go to its heap
+ *      line:  one row of bulk input, "id first_name last_name gpa" with the
+ *             fields separated by commas and/or whitespace
+ *      s:     student record that receives the parsed row
+ *
+ *  returns:  true if all four fields were found and id/gpa are numbers
+ */
+static bool parse_load_line(int fd, char *line, student_t *s)
+{
+    const char *sep = ", \t\r\n";
+    char *save = NULL;
+    char *id = strtok_r(line, sep, &save);
+    char *fname = strtok_r(NULL, sep, &save);
+    char *lname = strtok_r(NULL, sep, &save);
+    char *gpa = strtok_r(NULL, sep, &save);
+
+    if (gpa == NULL || !isdigit((unsigned char)*id) ||
+        !isdigit((unsigned char)*gpa))
+        return false;
+
+    memset(s, 0, sizeof(*s));
+    s->id = atoi(id);
+    s->gpa = atoi(gpa);
+    return name_store(fd, fname, s->fname, sizeof(s->fname), false) == NO_ERROR &&
+           name_store(fd, lname, s->lname, sizeof(s->lname), true) == NO_ERROR;
+}
+
+/*
+ *  write_run
+ *      fd:     linux file descriptor
+ *      run:    consecutive records (by id) to be written
+ *      n:      number of records in run
+ *
+ *  Writes the run with as few pwritev() calls as IOV_MAX allows.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int write_run(int fd, student_t **run, int n)
+{
+    struct iovec iov[IOV_MAX];
+
+    while (n > 0)
+    {
+        int cnt = (n < IOV_MAX) ? n : IOV_MAX;
+        for (int i = 0; i < cnt; i++)
+        {
+            iov[i].iov_base = run[i];
+            iov[i].iov_len = STUDENT_RECORD_SIZE;
+        }
+        off_t offset = slot_offset(fd, run[0]->id);
+        ssize_t len = (ssize_t)cnt * STUDENT_RECORD_SIZE;
+        if (io_pwritev(fd, iov, cnt, offset) != len || backup_note(offset, len) != NO_ERROR)
+            return ERR_DB_FILE;
+        run += cnt;
+        n -= cnt;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  load_students
+ *      fd:   linux file descriptor
+ *      in:   stream with one student per line (see parse_load_line)
+ *
+ *  Adds every student in the input to the database in one pass.  Rows
+ *  failing validate_range() or already present in the database (or earlier
+ *  in the input) are reported and skipped, the rest are stored.  The last
+ *  name index is dropped, the next -n lookup rebuilds it.
+ *
+ *  returns:  NO_ERROR       every row was added
+ *            ERR_DB_OP      some rows were rejected, the others were added
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  M_ERR_LOAD_LINE   for rows that cannot be parsed
+ *            M_ERR_STD_RNG     for rows with an id or gpa out of range
+ *            M_ERR_DB_ADD_DUP  for rows whose id already exists
+ *            M_DB_LOADED       summary with the load rate on success
+ *            M_ERR_LOAD_INPUT, M_ERR_DB_READ, M_ERR_DB_WRITE on I/O errors
+ */
+int load_students(int fd, FILE *in)
+{
+    IO_PHASE(IO_PHASE_ADD);
+    struct timespec t0, t1;
+    load_row_t *rows = NULL;
+    student_t **run = NULL;
+    student_t *window = NULL;
+    unsigned char *bitmap = NULL;
+    char *line = NULL;
+    size_t line_cap = 0;
+    int nrows = 0, cap = 0, lineno = 0, loaded = 0;
+    int rc = NO_ERROR;
+    db_lock_t lk;
+    bool locked = false;
+
+    // the rows bypass the log, older log records must not replay over them
+    if (wal_checkpoint(fd) != NO_ERROR)
+    {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    while (getline(&line, &line_cap, in) != -1)
+    {
+        student_t s;
+        char *p = line;
+
+        lineno++;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0' || *p == '#')
+            continue;
+        if (!parse_load_line(fd, p, &s))
+        {
+            // tolerate a csv header row
+            if (lineno > 1 || isdigit((unsigned char)*p))
+            {
+                printf(M_ERR_LOAD_LINE, lineno);
+                rc = ERR_DB_OP;
+            }
+            continue;
+        }
+        if (validate_range(s.id, s.gpa) != NO_ERROR)
+        {
+            printf(M_ERR_STD_RNG);
+            rc = ERR_DB_OP;
+            continue;
+        }
+        if (nrows == cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            load_row_t *grown = realloc(rows, cap * sizeof(load_row_t));
+            if (grown == NULL)
+            {
+                printf(M_ERR_LOAD_INPUT);
+                rc = ERR_DB_FILE;
+                goto done;
+            }
+            rows = grown;
+        }
+        rows[nrows].rec = s;
+        rows[nrows].line = lineno;
+        nrows++;
+    }
+    if (ferror(in))
+    {
+        printf(M_ERR_LOAD_INPUT);
+        rc = ERR_DB_FILE;
+        goto done;
+    }
+
+    qsort(rows, nrows, sizeof(load_row_t), cmp_load_row);
+
+    // new ids need slots, which a compacted file does not have
+    if (nrows > 0 && db_is_compact(fd))
+    {
+        if (lock_whole_db(fd, &lk) != NO_ERROR)
+        {
+            printf(M_ERR_DB_WRITE);
+            rc = ERR_DB_FILE;
+            goto done;
+        }
+        locked = true;
+        if (db_is_compact(fd) && expand_db(fd) != NO_ERROR)
+        {
+            rc = ERR_DB_FILE;
+            goto done;
+        }
+        unlock_slots(fd, &lk);
+        locked = false;
+    }
+
+    // cheaper to rebuild the last name index and the hot column on their
+    // next use than to log every row in them
+    if (nrows > 0)
+    {
+        index_drop();
+        column_drop();
+    }
+
+    run = malloc((nrows ? nrows : 1) * sizeof(student_t *));
+    window = malloc(LOAD_WINDOW_RECS * sizeof(student_t));
+    if (run == NULL || window == NULL)
+    {
+        printf(M_ERR_LOAD_INPUT);
+        rc = ERR_DB_FILE;
+        goto done;
+    }
+    if (db_has_header(fd))
+    {
+        // collect the occupancy bits of the new rows, merged into the
+        // header once at the end
+        bitmap = calloc(1, DB_BITMAP_SIZE);
+        if (bitmap == NULL)
+        {
+            printf(M_ERR_DB_READ);
+            rc = ERR_DB_FILE;
+            goto done;
+        }
+    }
+
+    for (int i = 0; i < nrows;)
+    {
+        // rows i..j-1 fall into one window of slots starting at rows[i].rec.id
+        int first = rows[i].rec.id;
+        int j = i;
+        while (j < nrows && rows[j].rec.id - first < LOAD_WINDOW_RECS)
+            j++;
+        int span = rows[j - 1].rec.id - first + 1;
+
+        // other loaders only wait for us when their windows overlap ours
+        if (lock_slots(fd, first, span, &lk) != NO_ERROR)
+        {
+            printf(M_ERR_DB_WRITE);
+            rc = ERR_DB_FILE;
+            goto done;
+        }
+        locked = true;
+        if (db_is_compact(fd) && expand_db(fd) != NO_ERROR)
+        {
+            rc = ERR_DB_FILE;
+            goto done;
+        }
+
+        ssize_t got = io_pread(fd, window, (size_t)span * STUDENT_RECORD_SIZE,
+                            slot_offset(fd, first));
+        if (got < 0)
+        {
+            printf(M_ERR_DB_READ);
+            rc = ERR_DB_FILE;
+            goto done;
+        }
+        // slots past the end of the file are empty
+        memset((char *)window + got, 0, (size_t)span * STUDENT_RECORD_SIZE - got);
+
+        int nrun = 0;
+        for (int k = i; k < j; k++)
+        {
+            bool dup = window[rows[k].rec.id - first].id != 0 ||
+                       (k > i && rows[k].rec.id == rows[k - 1].rec.id);
+            if (dup)
+            {
+                printf(M_ERR_DB_ADD_DUP, rows[k].rec.id);
+                rc = ERR_DB_OP;
+                continue;
+            }
+            // flush the current run when this id does not extend it
+            if (nrun > 0 && run[nrun - 1]->id + 1 != rows[k].rec.id)
+            {
+                if (write_run(fd, run, nrun) != NO_ERROR)
+                {
+                    printf(M_ERR_DB_WRITE);
+                    rc = ERR_DB_FILE;
+                    goto done;
+                }
+                loaded += nrun;
+                nrun = 0;
+            }
+            run[nrun++] = &rows[k].rec;
+            if (bitmap != NULL)
+            {
+                int slot = slot_index(fd, rows[k].rec.id);
+                bitmap[slot / 8] |= 1u << (slot % 8);
+            }
+        }
+        if (nrun > 0)
+        {
+            if (write_run(fd, run, nrun) != NO_ERROR)
+            {
+                printf(M_ERR_DB_WRITE);
+                rc = ERR_DB_FILE;
+                goto done;
+            }
+            loaded += nrun;
+        }
+        unlock_slots(fd, &lk);
+        locked = false;
+        i = j;
+    }
+
+    // the rows bypassed the log, with it on they must be as durable as
+    // a logged change before the load is reported
+    if ((bitmap != NULL && merge_db_bitmap(fd, bitmap, loaded) != NO_ERROR) ||
+        (wal_enabled() && sync_db(fd) != NO_ERROR))
+    {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+        goto done;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf(M_DB_LOADED, loaded, secs, secs > 0 ? loaded / secs : 0.0);
+
+done:
+    if (locked)
+        unlock_slots(fd, &lk);
+    free(line);
+    free(bitmap);
+    free(rows);
+    free(run);
+    free(window);
+    return rc;
+}
+
+/*
+ *  migrate_db
+ *      fd:     linux file descriptor
+ *
+ *  Converts a headerless database into a version 1 database (see db.h).
+ *  The slots are copied behind a new header into TMP_DB_FILE, counting the
+ *  live records and setting their occupancy bits on the way, and the result
+ *  is renamed over DB_FILE like compress_db() does.  Only allocated extents
+ *  of the old file are read and only blocks holding students are written,
+ *  so the new file stays sparse.
  *
- *  Note that you are passed in the fd of the database file to be compressed,
- *  it is very likely you will need to close it to overwrite it with the
- *  compressed version of the file.  To ensure the caller can work with the
- *  compressed file after you create it, it is a good design to return the fd
- *  of the new compressed file from this function
+ *  When the database already has a header, the count and bitmap are rebuilt
+ *  from the slots instead, which repairs a header that got out of step.
+ *  A compacted database is expanded into a version 1 slot file.
  *
- *  returns:  <number>       returns the fd of the compressed database file
+ *  returns:  <number>       returns the fd of the migrated database file
  *            ERR_DB_FILE    database file I/O issue
  *
- *
- *  console:  M_DB_COMPRESSED_OK  on success, the db was successfully compressed.
- *            M_ERR_DB_OPEN    error when opening/creating temporary database file.
- *                             this error should also be returned after you
- *                             compressed the database file and if you are unable
- *                             to open it to pass the fd back to the caller
- *            M_ERR_DB_CREATE  error creating the db file. For instance the
- *                             inability to copy the temporary file back as
- *                             the primary database file.
- *            M_ERR_DB_READ    error reading or seeking the the db or tempdb file
- *            M_ERR_DB_WRITE   error writing to db or tempdb file (adding student)
- *
+ *  console:  M_DB_MIGRATED    on success after converting the file
+ *            M_DB_REBUILT     on success after rebuilding an existing header
+ *            M_ERR_DB_OPEN    error opening the temporary or new database
+ *            M_ERR_DB_CREATE  error renaming the temporary database
+ *            M_ERR_DB_READ    error reading the database file
+ *            M_ERR_DB_WRITE   error writing the database files
  */
-int compress_db(int fd)
+int migrate_db(int fd)
 {
-    int temp_fd = open(TMP_DB_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-    if (temp_fd < 0)
+    db_lock_t lk;
+
+    if (lock_whole_db(fd, &lk) != NO_ERROR || wal_checkpoint(fd) != NO_ERROR)
     {
-        printf(M_ERR_DB_OPEN);
+        unlock_slots(fd, &lk);
+        printf(M_ERR_DB_WRITE);
         return ERR_DB_FILE;
     }
 
-    student_t student;
+    if (db_is_compact(fd))
+    {
+        // back to a version 1 slot file
+        db_handle_t *h = db_handle(fd);
+        h->flags |= DB_FLAG_SLOT_HDR;
+        int rc = expand_db(fd);
+        unlock_slots(fd, &lk);
+        if (rc != NO_ERROR)
+            return ERR_DB_FILE;
+        printf(M_DB_MIGRATED, DB_VERSION);
+        return fd;
+    }
+
+    const size_t chunk_len = LOAD_WINDOW_RECS * sizeof(student_t);
+    bool rebuild = db_has_header(fd);
+    off_t base = slot_offset(fd, 0);
+    off_t pos = base, start, end;
+    unsigned char *bitmap = calloc(1, DB_BITMAP_SIZE);
+    student_t *chunk = malloc(chunk_len);
+    int count = 0;
+    int out_fd = fd;
+    struct stat st;
+
+    if (bitmap == NULL || chunk == NULL || io_fstat(fd, &st) < 0)
+    {
+        printf(M_ERR_DB_READ);
+        goto fail;
+    }
+
+    if (!rebuild)
+    {
+        out_fd = io_open(TMP_DB_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        if (out_fd < 0)
+        {
+            printf(M_ERR_DB_OPEN);
+            goto fail;
+        }
+    }
 
-    while (read(fd, &student, STUDENT_RECORD_SIZE) == STUDENT_RECORD_SIZE)
+    while (next_data_extent(fd, pos, &start, &end))
     {
-        if (student.id != 0)
+        if (start < base)
+            start = base;
+        for (pos = start; pos < end; pos += chunk_len)
         {
-            if (write(temp_fd, &student, STUDENT_RECORD_SIZE) != STUDENT_RECORD_SIZE)
+            size_t want = (end - pos < (off_t)chunk_len) ? (size_t)(end - pos) : chunk_len;
+            ssize_t got = io_pread(fd, chunk, want, pos);
+            if (got < 0)
             {
-                printf(M_ERR_DB_WRITE);
-                close(temp_fd);
-                return ERR_DB_FILE;
+                printf(M_ERR_DB_READ);
+                goto fail;
             }
+            int n = got / STUDENT_RECORD_SIZE;
+            int live = 0;
+            for (int i = 0; i < n; i++)
+            {
+                int slot = slot_index(fd, chunk[i].id);
+                if (chunk[i].id == 0)
+                    continue;
+                if (slot < 0 || slot > MAX_STD_ID)
+                    continue; // not a valid slot, leave it out of the header
+                bitmap[slot / 8] |= 1u << (slot % 8);
+                count++;
+                live++;
+            }
+            if (!rebuild && live > 0)
+            {
+                if (io_pwrite(out_fd, chunk, got, DB_HDR_SIZE + (pos - base)) != got)
+                {
+                    printf(M_ERR_DB_WRITE);
+                    goto fail;
+                }
+            }
+            if (got < (ssize_t)want)
+                break;
         }
+        pos = end;
     }
 
-    close(fd);
-    close(temp_fd);
+    if (!rebuild && io_ftruncate(out_fd, DB_HDR_SIZE + (st.st_size - base)) < 0)
+    {
+        printf(M_ERR_DB_WRITE);
+        goto fail;
+    }
+    db_header_t hdr = {0};
+    if (rebuild && io_pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+    {
+        printf(M_ERR_DB_READ);
+        goto fail;
+    }
+    hdr.count = count;
+    if (write_db_header(out_fd, &hdr, bitmap) != NO_ERROR)
+    {
+        printf(M_ERR_DB_WRITE);
+        goto fail;
+    }
+    free(bitmap);
+    free(chunk);
 
-    if (rename(TMP_DB_FILE, DB_FILE) < 0)
+    if (rebuild)
     {
-        printf(M_ERR_DB_CREATE);
-        return ERR_DB_FILE;
+        unlock_slots(fd, &lk);
+        printf(M_DB_REBUILT, count);
+        return fd;
     }
 
-    fd = open(DB_FILE, O_RDWR);
-    if (fd < 0)
+    // like compress_db(), rename before closing fd drops the lock
+    backup_drop();
+    int renamed = rename_tmp_db(out_fd);
+    io_close(out_fd);
+    close_db(fd);
+    if (renamed != NO_ERROR)
     {
-        printf(M_ERR_DB_OPEN);
+        printf(M_ERR_DB_CREATE);
         return ERR_DB_FILE;
     }
+    fd = open_db(DB_FILE, false, true);
+    if (fd < 0)
+        return ERR_DB_FILE;
 
-    printf(M_DB_COMPRESSED_OK);
+    printf(M_DB_MIGRATED, DB_VERSION);
     return fd;
+
+fail:
+    if (out_fd >= 0 && out_fd != fd)
+    {
+        io_close(out_fd);
+        io_unlink(TMP_DB_FILE);
+    }
+    unlock_slots(fd, &lk);
+    free(bitmap);
+    free(chunk);
+    return ERR_DB_FILE;
 }
 
 /*
@@ -462,6 +3291,56 @@ int validate_range(int id, int gpa)
     return NO_ERROR;
 }
 
+/*
+ *  read_ids
+ *      argc:  argument count from main()
+ *      argv:  argument vector from main(), the ids start at argv[2]
+ *      ids:   receives a malloc()ed array of the ids
+ *
+ *  Collects the ids of -f from the command line, or from stdin when the
+ *  only one given is -.
+ *
+ *  returns:  the number of ids or ERR_DB_FILE
+ *
+ *  console:  M_ERR_LOAD_INPUT if stdin cannot be read
+ */
+int read_ids(int argc, char *argv[], int **ids)
+{
+    int n = 0, cap = (argc > 3) ? argc - 2 : 1024;
+    int id;
+
+    *ids = malloc(cap * sizeof(int));
+    bool ok = *ids != NULL;
+
+    if (ok && argc > 3)
+    {
+        for (int i = 2; i < argc; i++)
+            (*ids)[n++] = atoi(argv[i]);
+    }
+    else
+    {
+        while (ok && scanf("%d", &id) == 1)
+        {
+            if (n == cap)
+            {
+                int *grown = realloc(*ids, (cap *= 2) * sizeof(int));
+                ok = grown != NULL;
+                if (ok)
+                    *ids = grown;
+            }
+            if (ok)
+                (*ids)[n++] = id;
+        }
+        ok = ok && !ferror(stdin);
+    }
+    if (!ok)
+    {
+        printf(M_ERR_LOAD_INPUT);
+        return ERR_DB_FILE;
+    }
+    return n;
+}
+
 /*
  *  usage
  *      exename:  the name of the executable from argv[0]
@@ -475,15 +3354,118 @@ int validate_range(int id, int gpa)
  */
 void usage(char *exename)
 {
-    printf("usage: %s -[h|a|c|d|f|p|z] options.  Where:\n", exename);
+    printf("usage: %s -[h|a|b|B|c|C|d|f|i|m|n|p|q|r|R|s|S|x|z] options.  Where:\n", exename);
     printf("\t-h:  prints help\n");
+    printf("\t-j N:  with -c, -p or -s, scans the database on N threads\n");
     printf("\t-a id first_name last_name gpa(as 3 digit int):  adds a student\n");
+    printf("\t-b [file]:  bulk adds students, one \"id first_name last_name gpa\" per line\n");
+    printf("\t            read from file, or from stdin if file is omitted or -\n");
+    printf("\t-B dir [--incremental]:  backs the database up into dir, copying only\n");
+    printf("\t                         its allocated blocks, or only those changed since\n");
+    printf("\t                         the last backup into dir\n");
     printf("\t-c:  counts the records in the database\n");
+    printf("\t-C [socket]:  sends requests read from stdin to a running server\n");
     printf("\t-d id:  deletes a student\n");
-    printf("\t-f id:  finds and prints a student in the database\n");
-    printf("\t-p:  prints all records in the student database\n");
-    printf("\t-x:  compress the database file [EXTRA CREDIT]\n");
+    printf("\t-f id [id ...]:  finds and prints students in the database, -f - reads\n");
+    printf("\t                 the ids from stdin\n");
+    printf("\t-i:  reads a, f, d, c and p commands (\"a 1 john doe 345\", \"f 1\", ...)\n");
+    printf("\t     from stdin until EOF, with the database kept open\n");
+    printf("\t-m:  converts the database to the header format (or rebuilds its header)\n");
+    printf("\t-n last_name [--prefix]:  prints the students with that last name\n");
+    printf("\t                          (or starting with it) using the last name index\n");
+    printf("\t-p [--sort id|gpa|lname|fname] [--desc] [--limit K]:  prints all records\n");
+    printf("\t    in the student database, in id order or sorted (ties by id), or only\n");
+    printf("\t    the first K\n");
+    printf("\t-q query:  prints the students matching a query such as\n");
+    printf("\t           \"gpa>=350 and lname=doe and id<5000\" (fields id, gpa, fname,\n");
+    printf("\t           lname; names take = and != and may end in *)\n");
+    printf("\t-r lo hi:  prints the students with ids from lo to hi\n");
+    printf("\t-R dir:  replaces the database with the backup in dir\n");
+    printf("\t-s [percentile ...]:  prints count, mean, min, max, percentiles (default\n");
+    printf("\t                      50 90 99) and a histogram of the GPAs, from the id\n");
+    printf("\t                      and gpa column %s (built on first use)\n", COL_FILE);
+    printf("\t-S [socket]:  serves a, f, d and c requests over a unix domain socket\n");
+    printf("\t              (default %s) until a client sends stop-server\n", SDB_DEF_SOCKET);
+    printf("\t-x [--punch]:  compress the database file [EXTRA CREDIT]\n");
+    printf("\t               --punch releases empty blocks in place instead of rewriting\n");
     printf("\t-z:  zero db file (remove all records)\n");
+    printf("\t-v after any operation (or %s=1, %s=json for JSON) prints the\n",
+           IO_STATS_ENV, IO_STATS_ENV);
+    printf("\tsystem calls, bytes, time and page faults of each phase to stderr\n");
+    printf("\tSDBSC_FORMAT=sharded with -z creates a database of %d id shards in %s/,\n",
+           DB_SHARD_IDS, DB_SHARD_DIR);
+    printf("\tids up to %d, used by -a, -c, -d, -f, -p, -x and -z from then on\n",
+           DB_SHARD_MAX_ID);
+    printf("\t%s=1 with -a or -b keeps names longer than their field (up to %d\n",
+           NAME_HEAP_ENV, NAME_HEAP_MAX_LEN);
+    printf("\tcharacters) in %s instead of cutting them\n", NAME_HEAP_FILE);
+    printf("\t%s=1 with -a or -b stores each last name once in %s and a code\n",
+           NAME_DICT_ENV, NAME_DICT_FILE);
+    printf("\tfor it in the record, -q compares the codes and -x packs the records to %d bytes\n",
+           DB_PACKED_RECORD_SIZE);
+}
+
+// main() and its argument helpers are left out of the benchmark (see
+// sdbsc_bench.c)
+#ifndef SDBSC_NO_MAIN
+/*
+ *  take_flag
+ *      argc:  pointer to the argument count from main()
+ *      argv:  argument vector from main()
+ *      flag:  long option to look for, for example "--punch"
+ *
+ *  Looks for flag among the arguments that follow the operation and, if it
+ *  is there, removes it from argv so that the argument count checks of the
+ *  operations keep working unchanged.
+ *
+ *  returns:  true if flag was given
+ *
+ *  console:  This function does not produce any output
+ */
+static bool take_flag(int *argc, char *argv[], const char *flag)
+{
+    for (int i = 2; i < *argc; i++)
+    {
+        if (strcmp(argv[i], flag) == 0)
+        {
+            for (int j = i; j < *argc; j++)
+                argv[j] = argv[j + 1];
+            (*argc)--;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ *  take_value
+ *      argc:  pointer to the argument count from main()
+ *      argv:  argument vector from main()
+ *      flag:  option that takes a value, for example "-j"
+ *
+ *  Like take_flag() for an option followed by a value, both are removed
+ *  from argv.
+ *
+ *  returns:  the value, "" if flag is the last argument, or NULL if flag
+ *            was not given
+ *
+ *  console:  This function does not produce any output
+ */
+static char *take_value(int *argc, char *argv[], const char *flag)
+{
+    for (int i = 2; i < *argc; i++)
+    {
+        if (strcmp(argv[i], flag) == 0)
+        {
+            char *value = (i + 1 < *argc) ? argv[i + 1] : "";
+            int n = (i + 1 < *argc) ? 2 : 1;
+            for (int j = i; j + n <= *argc; j++)
+                argv[j] = argv[j + n];
+            *argc -= n;
+            return value;
+        }
+    }
+    return NULL;
 }
 
 // Welcome to main()
@@ -520,10 +3502,58 @@ int main(int argc, char *argv[])
         exit(EXIT_OK);
     }
 
+    // -j N runs the full scans of -c, -p and -s on N threads
+    char *jobs = take_value(&argc, argv, "-j");
+    if (jobs != NULL)
+    {
+        int n = atoi(jobs);
+        if (n < 1 || n > DB_MAX_SCAN_THREADS)
+        {
+            usage(argv[0]);
+            exit(EXIT_FAIL_ARGS);
+        }
+        set_scan_threads(n);
+    }
+
+    // -v prints what the operation cost, per phase, when it exits
+    io_stats_init(take_flag(&argc, argv, "-v"));
+
+    // -p --sort key [--desc] [--limit K] prints in another order
+    if (opt == 'p')
+    {
+        char *key = take_value(&argc, argv, "--sort");
+        bool desc = take_flag(&argc, argv, "--desc");
+        char *limit = take_value(&argc, argv, "--limit");
+        if (set_print_order(key, desc, limit) != NO_ERROR)
+        {
+            usage(argv[0]);
+            exit(EXIT_FAIL_ARGS);
+        }
+    }
+
+    // the client only talks to a server, it never opens the database
+    if (opt == 'C')
+    {
+        if (argc > 3)
+        {
+            usage(argv[0]);
+            exit(EXIT_FAIL_ARGS);
+        }
+        rc = start_client((argc == 3) ? argv[2] : SDB_DEF_SOCKET);
+        exit((rc == NO_ERROR) ? EXIT_OK : EXIT_FAIL_DB);
+    }
+
+    // a sharded database is a directory of smaller databases, the
+    // operations it supports are routed by sdbsc_shard.c
+    if (shard_db_selected(opt))
+    {
+        exit(shard_command(argc, argv, opt));
+    }
+
     // now lets open the file and continue if there is no error
     // note we are not truncating the file using the second
     // parameter
-    fd = open_db(DB_FILE, false);
+    fd = open_db(DB_FILE, false, true);
     if (fd < 0)
     {
         exit(EXIT_FAIL_DB);
@@ -566,6 +3596,58 @@ int main(int argc, char *argv[])
 
         break;
 
+    case 'b':
+        //   arv[0] arv[1]  arv[2]
+        // prog_name     -b  [file]
+        //-------------------------
+        // example:  prog_name -b students.csv
+        //           generate_rows | prog_name -b
+        if (argc > 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        {
+            FILE *in = stdin;
+            if (argc == 3 && strcmp(argv[2], "-") != 0)
+            {
+                in = fopen(argv[2], "r");
+                if (in == NULL)
+                {
+                    printf(M_ERR_LOAD_INPUT);
+                    exit_code = EXIT_FAIL_ARGS;
+                    break;
+                }
+            }
+            rc = load_students(fd, in);
+            if (in != stdin)
+                fclose(in);
+        }
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'B':
+        //    arv[0] arv[1]  arv[2]          arv[3]
+        // prog_name     -B     dir [--incremental]
+        //-----------------------------------------
+        // example:  prog_name -B /backup/students
+        //           prog_name -B /backup/students --incremental
+        {
+            bool incremental = take_flag(&argc, argv, "--incremental");
+            if (argc != 3)
+            {
+                usage(argv[0]);
+                exit_code = EXIT_FAIL_ARGS;
+                break;
+            }
+            rc = backup_db(fd, argv[2], incremental);
+            if (rc < 0)
+                exit_code = EXIT_FAIL_DB;
+        }
+        break;
+
     case 'c':
         //    arv[0] arv[1]
         // prog_name     -c
@@ -599,12 +3681,25 @@ int main(int argc, char *argv[])
         // prog_name     -f      id
         //-------------------------
         // example:  prog_name -f 100
-        if (argc != 3)
+        //           prog_name -f 100 200 300
+        //           prog_name -f - < ids.txt
+        if (argc < 3)
         {
             usage(argv[0]);
             exit_code = EXIT_FAIL_ARGS;
             break;
         }
+        if (argc > 3 || strcmp(argv[2], "-") == 0)
+        {
+            // many ids at once, from the command line or stdin
+            int *ids = NULL;
+            int n = read_ids(argc, argv, &ids);
+            rc = (n >= 0) ? find_students(fd, ids, n) : ERR_DB_FILE;
+            if (rc != NO_ERROR)
+                exit_code = EXIT_FAIL_DB;
+            free(ids);
+            break;
+        }
         id = atoi(argv[2]);
         rc = get_student(fd, id, &student);
 
@@ -624,6 +3719,54 @@ int main(int argc, char *argv[])
         }
         break;
 
+    case 'i':
+        //    arv[0] arv[1]
+        // prog_name     -i
+        //-----------------
+        // example:  generate_commands | prog_name -i
+        if (argc != 2)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = run_commands(fd, stdin);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'm':
+        //    arv[0] arv[1]
+        // prog_name     -m
+        //-----------------
+        // example:  prog_name -m
+
+        // like compress_db, migrate_db returns the fd of the new file
+        fd = migrate_db(fd);
+        if (fd < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'n':
+        //    arv[0] arv[1]     arv[2]   arv[3]
+        // prog_name     -n  last_name [--prefix]
+        //---------------------------------------
+        // example:  prog_name -n doe
+        //           prog_name -n do --prefix
+        {
+            bool prefix = take_flag(&argc, argv, "--prefix");
+            if (argc != 3)
+            {
+                usage(argv[0]);
+                exit_code = EXIT_FAIL_ARGS;
+                break;
+            }
+            rc = find_by_lname(fd, argv[2], prefix);
+            if (rc < 0)
+                exit_code = EXIT_FAIL_DB;
+        }
+        break;
+
     case 'p':
         //    arv[0] arv[1]
         // prog_name     -p
@@ -634,11 +3777,125 @@ int main(int argc, char *argv[])
             exit_code = EXIT_FAIL_DB;
         break;
 
+    case 'q':
+        //    arv[0] arv[1]   arv[2]
+        // prog_name     -q    query
+        //--------------------------
+        // example:  prog_name -q "gpa>=350 and lname=doe and id<5000"
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = query_db(fd, argv[2]);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'r':
+        //    arv[0] arv[1]  arv[2]  arv[3]
+        // prog_name     -r      lo      hi
+        //---------------------------------
+        // example:  prog_name -r 1000 1999
+        {
+            int lo = (argc == 4) ? atoi(argv[2]) : 0;
+            int hi = (argc == 4) ? atoi(argv[3]) : 0;
+            if (argc != 4 || lo > hi || validate_range(lo, MIN_STD_GPA) != NO_ERROR ||
+                validate_range(hi, MIN_STD_GPA) != NO_ERROR)
+            {
+                usage(argv[0]);
+                exit_code = EXIT_FAIL_ARGS;
+                break;
+            }
+            rc = print_range(fd, lo, hi);
+            if (rc < 0)
+                exit_code = EXIT_FAIL_DB;
+        }
+        break;
+
+    case 'R':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -R     dir
+        //-------------------------
+        // example:  prog_name -R /backup/students
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+
+        // like compress_db, restore_db returns the fd of the new file
+        fd = restore_db(fd, argv[2]);
+        if (fd < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 's':
+        //    arv[0] arv[1]        arv[2..]
+        // prog_name     -s [percentile ...]
+        //----------------------------------
+        // example:  prog_name -s
+        //           prog_name -s 25 50 75
+        {
+            int pcts[STATS_MAX_PCTS] = {50, 90, 99};
+            int npcts = (argc > 2) ? argc - 2 : 3;
+            bool ok = npcts <= STATS_MAX_PCTS;
+
+            for (int i = 2; ok && i < argc; i++)
+            {
+                char *end;
+                long pct = strtol(argv[i], &end, 10);
+                ok = *end == '\0' && end != argv[i] && pct >= 1 && pct <= 100;
+                pcts[i - 2] = (int)pct;
+            }
+            if (!ok)
+            {
+                usage(argv[0]);
+                exit_code = EXIT_FAIL_ARGS;
+                break;
+            }
+            rc = stats_db(fd, pcts, npcts);
+            if (rc < 0)
+                exit_code = EXIT_FAIL_DB;
+        }
+        break;
+
+    case 'S':
+        //    arv[0] arv[1]   arv[2]
+        // prog_name     -S [socket]
+        //--------------------------
+        // example:  prog_name -S
+        //           prog_name -S /tmp/sdbsc.sock
+        if (argc > 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = start_server(fd, (argc == 3) ? argv[2] : SDB_DEF_SOCKET);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'x':
-        //    arv[0] arv[1]
-        // prog_name     -x
-        //-----------------
+        //    arv[0] arv[1]   arv[2]
+        // prog_name     -x [--punch]
+        //--------------------------
         // example:  prog_name -x
+        //           prog_name -x --punch
+
+        // with --punch empty blocks are released in place instead
+        if (take_flag(&argc, argv, "--punch"))
+        {
+            rc = punch_db(fd);
+            if (rc < 0)
+                exit_code = EXIT_FAIL_DB;
+            break;
+        }
 
         // remember compress_db returns a fd of the compressed database.
         // we close it after this switch statement
@@ -652,21 +3909,54 @@ int main(int argc, char *argv[])
         // prog_name     -x
         //-----------------
         // example:  prog_name -x
-        // HINT:  close the db file, we already have fd
-        //       and reopen db indicating truncate=true
-        close(fd);
-        fd = open_db(DB_FILE, true);
-        if (fd < 0)
+        // the file is truncated through fd, under its whole-file lock,
+        // then reopened
+        // The database keeps its format unless SDBSC_FORMAT asks for another
+        {
+            bool with_header = want_header(db_slots_have_header(fd));
+            db_lock_t lk;
+
+            // writers of other processes wait for the truncate, and the
+            // log must not replay old changes into the empty file
+            if (lock_whole_db(fd, &lk) != NO_ERROR || wal_checkpoint(fd) != NO_ERROR ||
+                io_ftruncate(fd, 0) < 0)
+            {
+                unlock_slots(fd, &lk);
+                printf(M_ERR_DB_WRITE);
+                exit_code = EXIT_FAIL_DB;
+                break;
+            }
+            close_db(fd);
+            fd = open_db(DB_FILE, false, true);
+            if (fd < 0)
+            {
+                exit_code = EXIT_FAIL_DB;
+                break;
+            }
+            if (with_header && !db_has_header(fd) && init_db_header(fd, 0) != NO_ERROR)
+            {
+                printf(M_ERR_DB_WRITE);
+                exit_code = EXIT_FAIL_DB;
+                break;
+            }
+        }
+        // back from a sharded database to a single file
+        if (shard_drop() != NO_ERROR)
         {
+            printf(M_ERR_DB_WRITE);
             exit_code = EXIT_FAIL_DB;
             break;
         }
         // Preallocate the file size to hold 1,000,000 records.
-        if (ftruncate(fd, MAX_STD_ID * STUDENT_RECORD_SIZE) < 0) {
+        if (io_ftruncate(fd, slot_offset(fd, MAX_STD_ID)) < 0) {
             printf(M_ERR_DB_WRITE);
             exit_code = EXIT_FAIL_DB;
             break;
         }
+        index_drop();
+        column_drop();
+        names_drop();
+        backup_drop();
         printf(M_DB_ZERO_OK);
         exit_code = EXIT_OK;
         break;
@@ -677,6 +3967,7 @@ int main(int argc, char *argv[])
 
     // dont forget to close the file before exiting, and setting the
     // proper exit code - see the header file for expected values
-    close(fd);
+    close_db(fd);
     exit(exit_code);
 }
+#endif
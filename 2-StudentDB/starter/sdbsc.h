@@ -1,19 +1,263 @@
 #ifndef __SDB_H__
 
+#include <stdbool.h>
+#include <sys/types.h>
+#include <pthread.h>
 #include "db.h" //get student record type
 
 //prototypes for functions go below for this assignment
-int open_db(char *dbFile, bool should_truncate);
+int open_db(char *dbFile, bool should_truncate, bool with_log);
+int close_db(int fd);
 int add_student(int fd, int id, char *fname, char *lname, int gpa);
 int get_student(int fd, int id, student_t *s);
+int find_students(int fd, int *ids, int n);
 int del_student(int fd, int id);
 int compress_db(int fd);
+int punch_db(int fd);
+int load_students(int fd, FILE *in);
+int migrate_db(int fd);
+int find_by_lname(int fd, char *lname, bool prefix);
 void print_student(student_t *s);
 int validate_range(int id, int gpa);
 int count_db_records(int fd);
 int print_db(int fd);
+int print_range(int fd, int lo, int hi);
 void usage(char *);
 
+//shared between the sdbsc source files
+int collect_live(int fd, student_t **out, int *n);
+void print_db_row(const student_t *s, int *first_record);
+int index_note(int fd, const student_t *s, bool live);
+void index_drop(void);
+int put_slot(int fd, int id, const student_t *rec);
+int insert_student(int fd, int id, char *fname, char *lname, int gpa, const char **msg);
+int remove_student(int fd, int id, const char **msg);
+int share_db(int fd);
+int sync_db(int fd);
+int init_db_header(int fd, int base_id);
+int compact_db(int fd);
+int read_ids(int argc, char *argv[], int **ids);
+int db_count(int fd);
+int db_base_id(int fd);
+int fcntl_lock(int fd, short type, off_t start, off_t len);
+// a range held with an OFD lock, see lock_slots()
+typedef struct db_lock
+{
+    off_t start;
+    off_t len;      // 0: to the end of the file, i.e. the whole database
+} db_lock_t;
+int lock_slots(int fd, int id, int n, db_lock_t *lk);
+void unlock_slots(int fd, const db_lock_t *lk);
+size_t format_row(char *out, size_t room, const student_t *s);
+int lock_column(int fd, short type);
+void unlock_column(int fd);
+int lock_index(int fd);
+void unlock_index(int fd);
+int lock_db(int fd, short type);
+void unlock_db(int fd);
+bool next_data_extent(int fd, off_t from, off_t *start, off_t *end);
+
+//streaming scan over the live records of the database, whatever its layout.
+//Reads DB_SCAN_CHUNK bytes per pread() unless told otherwise, see scan_open()
+#define DB_SCAN_CHUNK     (1024*1024)   //1M
+#define DB_SCAN_ALIGN     4096
+#define DB_PRINT_BUF      (1024*1024)   //output buffer of print_db()
+#define DB_PRINT_ROW_MAX  (64 + 2 * NAME_HEAP_MAX_LEN)  //longest row print_db() formats
+typedef struct db_scan
+{
+    int fd;
+    size_t chunk;
+    char *buf;              //last chunk read
+    student_t *recs;        //the slots of the last chunk, empty ones included
+    int nrecs;
+    student_t **batch;      //the live records among them
+    int count;
+    unsigned char *bitmap;  //occupancy bitmap of a version 1 file
+    bool compact;
+    char *packed;           //chunk of a packed file, unpacked into buf
+    int lo_id;              //id range of the scan
+    int hi_id;
+    off_t pos;              //next offset to read
+    off_t end;              //end of the current extent or of the data
+    off_t limit;            //end of the id range in the file
+    off_t file_len;
+} db_scan_t;
+
+typedef bool (*scan_filter_t)(const student_t *s, const void *arg);
+
+int scan_open(db_scan_t *sc, int fd, size_t chunk);
+int scan_open_range(db_scan_t *sc, int fd, size_t chunk, int lo, int hi);
+int scan_next(db_scan_t *sc);
+void scan_close(db_scan_t *sc);
+int print_scan(db_scan_t *sc, scan_filter_t keep, const void *arg);
+
+//parallel scans (-j), the ids are split in DB_SCAN_PARTS ranges per thread
+//and every range is scanned by a scan_part_t task on one of the threads
+#define DB_MAX_SCAN_THREADS 64
+#define DB_SCAN_PARTS       4
+typedef int (*scan_part_t)(int fd, int lo, int hi, int part, void *arg);
+
+void set_scan_threads(int n);
+int get_scan_threads(void);
+int parallel_scan(int fd, int nthreads, int nparts, scan_part_t task, void *arg);
+
+//rows of print_db() written in part order by parallel tasks, see print_part()
+typedef struct par_print
+{
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    int next;               //part whose rows go out next
+    int rows;               //rows written so far
+} par_print_t;
+int print_part(int fd, int lo, int hi, int part, void *arg);
+
+//per process table of open databases in sdbsc.c, indexed by the fd
+#define DB_MAX_HANDLES    64
+
+//sharded database (SDBSC_FORMAT=sharded -z), see sdbsc_shard.c and db.h.
+//Whole-database operations keep up to SHARD_BATCH shards open at a time.
+//A shard may hold up to two more descriptors for its name heap and
+//dictionary, and every one of them must stay below DB_MAX_HANDLES
+#define SHARD_BATCH       16
+bool shard_db_selected(char opt);
+int shard_command(int argc, char *argv[], char opt);
+int shard_drop(void);
+
+//hot id and gpa column, see sdbsc_column.c and db.h.  Read COL_CHUNK_SLOTS
+//slots (1MB) at a time
+#define COL_CHUNK_SLOTS   (DB_SCAN_CHUNK / 8)
+int column_open(int fd);
+int column_read(int fd, int col_fd, int slot, col_slot_t *buf, int n);
+int column_note(int fd, int id, const student_t *rec);
+int column_count(int fd);
+void column_drop(void);
+
+//long names, see sdbsc_names.c and db.h.  SDBSC_LONG_NAMES=1 keeps names
+//longer than their field in the heap instead of cutting them.
+//SDBSC_LNAME_DICT=1 stores last names as codes into the dictionary
+#define NAME_HEAP_ENV     "SDBSC_LONG_NAMES"
+#define NAME_DICT_ENV     "SDBSC_LNAME_DICT"
+void names_open(int fd);
+void names_close(int fd);
+void names_use(int fd);
+bool name_spilled(const char *field, size_t size);
+int name_store(int fd, const char *name, char *field, size_t size, bool dict);
+char *name_get(const char *field, size_t size, char *buf);
+void name_copy(const char *field, size_t size, char *out, size_t n);
+int name_code(const char *field);
+unsigned char *dict_select(bool (*keep)(const char *name, const void *arg), const void *arg,
+                           int *ncodes);
+void names_drop(void);
+
+//GPA statistics (-s), see sdbsc_stats.c.  SDBSC_SIMD=scalar|sse2|avx2
+//forces the kernel instead of the best one the cpu supports
+#define DB_SIMD_ENV       "SDBSC_SIMD"
+#define STATS_HIST_BIN    50            //GPA points per histogram bin
+#define STATS_MAX_PCTS    16
+int stats_db(int fd, const int *pcts, int npcts);
+
+//write-ahead log, see sdbsc_wal.c.  SDBSC_WAL=1 logs every change before
+//it reaches its slot, one fdatasync() per group of concurrent changes
+#define WAL_ENV           "SDBSC_WAL"
+#define WAL_GROUP_MAX     256           //records per flush at most
+#define WAL_CKPT_BYTES    (1024*1024)   //checkpoint once the log is this big
+int wal_open(int db_fd);
+int wal_log(int id, const student_t *rec);
+int wal_applied(int db_fd);
+bool wal_enabled(void);
+int wal_checkpoint(int db_fd);
+void wal_close(int db_fd);
+
+//sorted print (-p --sort), see sdbsc_sort.c.  A full sort keeps at most
+//SORT_MEM_BYTES of rows in memory (SDBSC_SORT_MEM overrides it) and spills
+//the rest to sorted runs, merged SORT_MAX_RUNS at a time
+#define SORT_NONE         0
+#define SORT_ID           1
+#define SORT_GPA          2
+#define SORT_LNAME        3
+#define SORT_FNAME        4
+#define SORT_MEM_BYTES    (8*1024*1024)   //8M
+#define SORT_MEM_ENV      "SDBSC_SORT_MEM"
+#define SORT_MAX_RUNS     64
+typedef struct sorter sorter_t;
+int set_print_order(const char *key, bool desc, const char *limit);
+bool print_sorted(void);
+sorter_t *sort_begin(void);
+int sort_add(sorter_t *st, const student_t *s);
+int sort_scan(sorter_t *st, int fd);
+int sort_end(sorter_t *st, bool print);
+
+//backup and restore (-B, -R), see sdbsc_backup.c and db.h.  Extents are
+//copied with pread()/pwrite() through a BACKUP_COPY_BUF buffer where
+//copy_file_range() is not supported
+#define BACKUP_COPY_BUF   (1024*1024)   //1M
+int backup_db(int fd, const char *dir, bool incremental);
+int restore_db(int fd, const char *dir);
+int backup_note(off_t off, off_t len);
+void backup_drop(void);
+
+//query filter (-q), see sdbsc_query.c
+#define QUERY_MAX_TERMS   16
+int query_db(int fd, const char *expr);
+
+//server mode, see sdbsc_server.c and sdbsc_client.c
+int start_server(int fd, char *sock_path);
+int start_client(char *sock_path);
+
+//command mode (-i), see sdbsc_cmd.c.  Commands that cannot be run are
+//echoed back with M_ERR_SRV_CMD, cut at SDB_CMD_ECHO_MAX bytes
+#define SDB_CMD_PROMPT    "sdbsc> "
+#define SDB_CMD_ECHO_MAX  256
+int run_commands(int fd, FILE *in);
+
+//I/O statistics (-v, SDBSC_STATS=1|json), see sdbsc_iostat.c.  The sources
+//make their file system calls through the io_* wrappers, which count them
+//against the phase set with IO_PHASE() by the operation that is running.
+//Sockets and pipes of the server use the plain calls.  The summary is
+//printed to stderr at exit.
+#define IO_STATS_ENV      "SDBSC_STATS"
+#define IO_PHASE_OTHER    0
+#define IO_PHASE_OPEN     1
+#define IO_PHASE_GET      2
+#define IO_PHASE_ADD      3
+#define IO_PHASE_DELETE   4
+#define IO_PHASE_SCAN     5
+#define IO_PHASE_FORMAT   6
+#define IO_PHASE_OUTPUT   7
+#define IO_PHASE_COMPRESS 8
+#define IO_PHASE_BACKUP   9
+#define IO_PHASES         10
+#define IO_PHASE(phase) \
+    int io_prev_phase_ __attribute__((cleanup(io_leave), unused)) = io_enter(phase)
+void io_stats_init(bool verbose);
+int io_enter(int phase);
+void io_leave(int *prev);
+
+struct stat;
+struct iovec;
+int io_open(const char *path, int flags, ...);
+int io_close(int fd);
+ssize_t io_read(int fd, void *buf, size_t n);
+ssize_t io_write(int fd, const void *buf, size_t n);
+ssize_t io_pread(int fd, void *buf, size_t n, off_t off);
+ssize_t io_pwrite(int fd, const void *buf, size_t n, off_t off);
+ssize_t io_preadv(int fd, const struct iovec *iov, int cnt, off_t off);
+ssize_t io_pwritev(int fd, const struct iovec *iov, int cnt, off_t off);
+off_t io_lseek(int fd, off_t off, int whence);
+int io_fstat(int fd, struct stat *st);
+int io_fsync(int fd);
+int io_fdatasync(int fd);
+int io_ftruncate(int fd, off_t len);
+int io_fallocate(int fd, int mode, off_t off, off_t len);
+ssize_t io_copy_file_range(int in, off_t *in_off, int out, off_t *out_off, size_t n,
+                           unsigned int flags);
+int io_fcntl(int fd, int cmd, void *arg);
+int io_rename(const char *from, const char *to);
+int io_unlink(const char *path);
+void *io_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
+int io_munmap(void *addr, size_t len);
+int io_msync(void *addr, size_t len, int flags);
+
 //error codes to be returned from individual functions
 // NO_ERROR is returned if there are no errors
 // ERR_DB_FILE is returned if there is are any issues with the database file itself
@@ -25,6 +269,36 @@ void usage(char *);
 #define SRCH_NOT_FOUND  -3
 #define NOT_IMPLEMENTED_YET 0
 
+//storage backends used to move records in and out of the database file
+// DB_BACKEND_FD    lseek() + read()/write() of every record (the default)
+// DB_BACKEND_MMAP  the id space is mapped once by open_db() and records are
+//                  reached through pointer arithmetic on the mapping
+//The backend is selected with SDBSC_BACKEND=fd|mmap, when using mmap setting
+//SDBSC_MSYNC=1 flushes every modified record with msync() before returning
+#define DB_BACKEND_FD     0
+#define DB_BACKEND_MMAP   1
+#define DB_BACKEND_ENV    "SDBSC_BACKEND"
+#define DB_MSYNC_ENV      "SDBSC_MSYNC"
+
+//on-disk format used when a database file is created or zeroed (-z),
+//SDBSC_FORMAT=header creates a version 1 file with the record count and
+//occupancy bitmap header (see db.h), SDBSC_FORMAT=legacy the original
+//headerless layout.  Without the variable -z keeps the current format.
+#define DB_FORMAT_ENV     "SDBSC_FORMAT"
+
+//server mode (-S) keeps the database open and serves one request per line
+//over a unix domain socket, the client (-C) sends lines read from stdin.
+//Every reply ends with SDB_EOF_CHAR so the client knows where it stops.
+//The number of worker threads comes from SDBSC_THREADS, the default is one
+//per online cpu.  Ids are locked in stripes of SDB_STRIPE_IDS.
+#define SDB_DEF_SOCKET       "sdbsc.sock"
+#define SDB_THREADS_ENV      "SDBSC_THREADS"
+#define SDB_MAX_THREADS      64
+#define SDB_MAX_CONNS        256         //connections open at once
+#define SDB_STRIPE_IDS       1024
+#define SDB_COMM_BUFF_SZ     (1024*64)   //64K
+static const char SDB_EOF_CHAR = 0x04;
+
 
 //error codes to be returned to the shell
 // EXIT_OK          program executed without error
@@ -48,11 +322,43 @@ void usage(char *);
 #define M_STD_ADDED       "Student %d added to database.\n"
 #define M_STD_DEL_MSG     "Student %d was deleted from database.\n"
 #define M_STD_NOT_FND_MSG "Student %d was not found in database.\n"
+#define M_LNAME_NOT_FND   "No student with last name %s was found in database.\n"
+#define M_ERR_IDX         "Error updating last name index, exiting!\n"
 #define M_DB_COMPRESSED_OK "Database successfully compressed!\n"
+#define M_DB_PUNCHED      "Released %d empty block(s), %lld bytes reclaimed.\n"
+#define M_ERR_DB_PUNCH    "Filesystem cannot punch holes, use -x without --punch!\n"
 #define M_DB_ZERO_OK      "All database records removed!\n"
 #define M_DB_EMPTY        "Database contains no student records.\n"
 #define M_DB_RECORD_CNT   "Database contains %d student record(s).\n"
 #define M_NOT_IMPL        "The requested operation is not implemented yet!\n"
+#define M_ERR_LOAD_LINE   "Cant parse line %d of the input, skipping!\n"
+#define M_ERR_LOAD_INPUT  "Error reading bulk load input, exiting!\n"
+#define M_DB_MIGRATED     "Database converted to format version %d.\n"
+#define M_DB_REBUILT      "Database header rebuilt, %d student record(s).\n"
+#define M_RANGE_EMPTY     "No student with an id from %d to %d was found in database.\n"
+#define M_QUERY_NO_MATCH  "No student matched the query.\n"
+#define M_ERR_QUERY       "Cant parse query at \"%s\"!\n"
+#define M_STATS_COUNT     "Students:  %d\n"
+#define M_STATS_GPA       "GPA %-6s %.2f\n"
+#define M_STATS_PCT       "GPA p%-5d %.2f\n"
+#define M_STATS_HIST_HDR  "GPA histogram:\n"
+#define M_STATS_HIST_ROW  "  %.2f-%.2f %lld\n"
+#define M_SRV_STARTED     "Server listening on %s with %d worker thread(s).\n"
+#define M_SRV_STOPPED     "Server stopped.\n"
+#define M_SRV_STOP_REQ    "Client requested server to stop, stopping...\n"
+#define M_SRV_RUNNING     "A server is already listening on %s!\n"
+#define M_ERR_SRV_START   "Error starting server on %s, exiting!\n"
+#define M_ERR_SRV_CMD     "Unknown command: %s\n"
+#define M_ERR_SRV_BUSY    "Server busy, too many connections!\n"
+#define M_ERR_CLI_CONNECT "Cant connect to server on %s, exiting!\n"
+#define M_ERR_CLI_COMM    "Server closed the connection, exiting!\n"
+#define M_ERR_SHARD_OPT   "Option -%c is not supported on a sharded database!\n"
+#define M_DB_BACKUP_FULL  "Full backup written to %s, %lld of %lld bytes copied.\n"
+#define M_DB_BACKUP_INCR  "Incremental backup written to %s, %lld of %lld bytes copied.\n"
+#define M_DB_RESTORED     "Database restored from %s, %lld bytes copied.\n"
+#define M_ERR_BACKUP      "Error writing backup to %s!\n"
+#define M_ERR_RESTORE     "Cant restore from %s, database unchanged!\n"
+#define M_DB_LOADED       "Loaded %d student record(s) in %.3f seconds (%.0f rows/sec).\n"
 
 //useful format strings for print students
 //For example to print the header in the required output:
@@ -60,5 +366,6 @@ void usage(char *);
 //                                   "LAST_NAME", "GPA");
 #define  STUDENT_PRINT_HDR_STRING   "%-6s %-24s %-32s %-3s\n"
 #define  STUDENT_PRINT_FMT_STRING   "%-6d %-24.24s %-32.32s %-3.2f\n"
+#define  STUDENT_PRINT_LONG_FMT_STRING  "%-6d %-24s %-32s %-3.2f\n"   //names from the heap
 
 #endif
\ No newline at end of file
@@ -0,0 +1,596 @@
+#define _GNU_SOURCE // copy_file_range() and fallocate()
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Backup and restore (-B dir [--incremental], -R dir).  A backup is a
+ *  directory holding a copy of the database with the same holes, copies of
+ *  the name heap and dictionary, and BACKUP_INFO (see db.h).  Only the
+ *  allocated extents of the files are copied: next_data_extent() walks
+ *  them with SEEK_DATA/SEEK_HOLE and copy_file_range() moves each one
+ *  inside the kernel, so a sparse database costs the time and space of its
+ *  live data.  Where copy_file_range() is not supported (other file
+ *  systems on old kernels) the extents are copied with pread()/pwrite().
+ *
+ *  The first backup creates GEN_MAP_FILE, the block generation map.  From
+ *  then on put_slot(), the bulk load and -x --punch stamp every block they
+ *  write with the generation of the map (backup_note()).  A backup records
+ *  the generation it copied and moves the map on to the next one, so an
+ *  incremental backup into the same directory copies just the blocks
+ *  stamped later, punching the ones that became holes.  The header is
+ *  written without stamps and is copied every time.  The name files are
+ *  append-only, their new tail is copied.  -z, compress, expand and
+ *  migrate start a new file and drop the map, the next backup is full, as
+ *  is every backup without --incremental or whose directory was taken
+ *  from another map or file.
+ *
+ *  A backup holds a shared lock on the whole database, which waits out and
+ *  then keeps away every change, so the copy is a consistent snapshot.
+ *  Stamps are written under the record lock of the change they belong to.
+ *
+ *  A restore copies the backup into temporary files, renames them over
+ *  the database and its name files under the whole-file lock and drops the
+ *  log, the last name index, the hot column and the map, which belong to
+ *  the database it replaced.
+ */
+#define GEN_NOTE_BATCH    1024      // stamps per pwrite() of backup_note()
+
+static const char *backup_side_files[] = {NAME_HEAP_FILE, NAME_DICT_FILE};
+
+// set once copy_file_range() failed as unsupported, the rest goes by pwrite()
+static bool cfr_unsupported = false;
+
+// dir/name into path, false if it does not fit
+static bool backup_path(char *path, const char *dir, const char *name)
+{
+    int len = snprintf(path, PATH_MAX, "%s/%s", dir, name);
+    return len > 0 && len < PATH_MAX;
+}
+
+/*
+ *  copy_range
+ *      in, out:  linux file descriptors
+ *      off:      offset of the bytes in both files
+ *      len:      number of bytes
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int copy_range(int in, int out, off_t off, off_t len)
+{
+    off_t in_off = off, out_off = off, end = off + len;
+
+    while (!cfr_unsupported && in_off < end)
+    {
+        ssize_t n = io_copy_file_range(in, &in_off, out, &out_off, end - in_off, 0);
+        if (n == 0)
+            return NO_ERROR;
+        if (n > 0 || errno == EINTR)
+            continue;
+        if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL)
+            return ERR_DB_FILE;
+        cfr_unsupported = true;
+    }
+    if (in_off >= end)
+        return NO_ERROR;
+
+    char *buf = malloc(BACKUP_COPY_BUF);
+    if (buf == NULL)
+        return ERR_DB_FILE;
+    while (in_off < end)
+    {
+        size_t want = (end - in_off < BACKUP_COPY_BUF) ? (size_t)(end - in_off) : BACKUP_COPY_BUF;
+        ssize_t got = io_pread(in, buf, want, in_off);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0 || io_pwrite(out, buf, got, in_off) != got)
+            break;
+        in_off += got;
+    }
+    free(buf);
+    return (in_off >= end) ? NO_ERROR : ERR_DB_FILE;
+}
+
+// turns len bytes at off of out into a hole, or into zeros on file systems
+// that cannot punch
+static int punch_range(int out, off_t off, off_t len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (io_fallocate(out, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0)
+        return NO_ERROR;
+    if (errno != EOPNOTSUPP && errno != ENOSYS)
+        return ERR_DB_FILE;
+#endif
+    char *zeros = calloc(1, BACKUP_COPY_BUF);
+    if (zeros == NULL)
+        return ERR_DB_FILE;
+    while (len > 0)
+    {
+        size_t n = (len < BACKUP_COPY_BUF) ? (size_t)len : BACKUP_COPY_BUF;
+        if (io_pwrite(out, zeros, n, off) != (ssize_t)n)
+            break;
+        off += n;
+        len -= n;
+    }
+    free(zeros);
+    return (len > 0) ? ERR_DB_FILE : NO_ERROR;
+}
+
+/*
+ *  copy_extents
+ *      in, out:  linux file descriptors
+ *      from:     first offset to copy
+ *      to:       offset just past the last one
+ *      punch:    true to punch the holes of in into out, false if out has
+ *                holes there already
+ *      copied:   bytes copied are added here
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int copy_extents(int in, int out, off_t from, off_t to, bool punch, long long *copied)
+{
+    off_t pos = from, start, end;
+
+    while (pos < to && next_data_extent(in, pos, &start, &end) && start < to)
+    {
+        start = (start < pos) ? pos : start;
+        end = (end > to) ? to : end;
+        if (punch && start > pos && punch_range(out, pos, start - pos) != NO_ERROR)
+            return ERR_DB_FILE;
+        if (copy_range(in, out, start, end - start) != NO_ERROR)
+            return ERR_DB_FILE;
+        *copied += end - start;
+        pos = end;
+    }
+    if (punch && pos < to && punch_range(out, pos, to - pos) != NO_ERROR)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+// makes out a copy of in, out already holds the first from bytes of it
+static int copy_file(int in, int out, off_t from, long long *copied)
+{
+    struct stat st;
+
+    if (io_fstat(in, &st) < 0 || io_ftruncate(out, from) < 0 || io_ftruncate(out, st.st_size) < 0 ||
+        copy_extents(in, out, from, st.st_size, false, copied) != NO_ERROR || io_fsync(out) < 0)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  gen_open
+ *      st:   the database file
+ *      hdr:  receives the header of the map
+ *
+ *  Opens the block generation map of the database, replacing a missing
+ *  one or one of another file with a new map at generation 1.
+ *
+ *  returns:  fd of GEN_MAP_FILE or ERR_DB_FILE
+ */
+static int gen_open(const struct stat *st, gen_header_t *hdr)
+{
+    int map_fd = io_open(GEN_MAP_FILE, O_RDWR);
+    if (map_fd >= 0)
+    {
+        if (io_pread(map_fd, hdr, sizeof(*hdr), 0) == sizeof(*hdr) && hdr->magic == GEN_MAGIC &&
+            hdr->version == GEN_VERSION && hdr->dev == (unsigned long long)st->st_dev &&
+            hdr->ino == (unsigned long long)st->st_ino)
+            return map_fd;
+        io_close(map_fd);
+    }
+    else if (errno != ENOENT)
+        return ERR_DB_FILE;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = GEN_MAGIC;
+    hdr->version = GEN_VERSION;
+    hdr->gen = 1;
+    hdr->map_id = ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^
+                  ((unsigned long long)getpid() << 40);
+    hdr->dev = st->st_dev;
+    hdr->ino = st->st_ino;
+
+    map_fd = io_open(TMP_GEN_MAP_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (map_fd < 0)
+        return ERR_DB_FILE;
+    if (io_pwrite(map_fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+        io_rename(TMP_GEN_MAP_FILE, GEN_MAP_FILE) < 0)
+    {
+        io_close(map_fd);
+        io_unlink(TMP_GEN_MAP_FILE);
+        return ERR_DB_FILE;
+    }
+    return map_fd;
+}
+
+// reads BACKUP_INFO of dir, false if there is none or it is not one
+static bool read_info(const char *dir, backup_info_t *info)
+{
+    char path[PATH_MAX];
+
+    if (!backup_path(path, dir, BACKUP_INFO))
+        return false;
+    int info_fd = io_open(path, O_RDONLY);
+    if (info_fd < 0)
+        return false;
+    bool ok = io_pread(info_fd, info, sizeof(*info), 0) == sizeof(*info) &&
+              info->magic == BACKUP_MAGIC && info->version == BACKUP_VERSION;
+    io_close(info_fd);
+    return ok;
+}
+
+// replaces BACKUP_INFO of dir with info, and makes the directory durable
+static int write_info(const char *dir, const backup_info_t *info)
+{
+    char tmp[PATH_MAX], path[PATH_MAX];
+
+    if (!backup_path(tmp, dir, TMP_BACKUP_INFO) || !backup_path(path, dir, BACKUP_INFO))
+        return ERR_DB_FILE;
+    int info_fd = io_open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (info_fd < 0)
+        return ERR_DB_FILE;
+    bool ok = io_pwrite(info_fd, info, sizeof(*info), 0) == sizeof(*info) && io_fsync(info_fd) == 0;
+    io_close(info_fd);
+    if (!ok || io_rename(tmp, path) < 0)
+    {
+        io_unlink(tmp);
+        return ERR_DB_FILE;
+    }
+
+    int dir_fd = io_open(dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0)
+        return ERR_DB_FILE;
+    ok = io_fsync(dir_fd) == 0;
+    io_close(dir_fd);
+    return ok ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  backup_blocks
+ *      in, out:  the database and its copy from the last backup
+ *      map_fd:   fd of the block generation map
+ *      size:     size of the database
+ *      gen:      generation of the last backup
+ *      copied:   bytes copied are added here
+ *
+ *  Brings the copy up to date by copying every run of blocks stamped after
+ *  gen, and the header.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int backup_blocks(int in, int out, int map_fd, off_t size, unsigned int gen,
+                         long long *copied)
+{
+    off_t nblocks = (size + GEN_BLOCK - 1) / GEN_BLOCK;
+    unsigned int *gens = calloc(nblocks ? nblocks : 1, sizeof(unsigned int));
+
+    if (gens == NULL)
+        return ERR_DB_FILE;
+    // a map shorter than the file has no stamps for the rest
+    if (io_pread(map_fd, gens, nblocks * sizeof(unsigned int), GEN_DATA_OFF) < 0 ||
+        io_ftruncate(out, size) < 0)
+    {
+        free(gens);
+        return ERR_DB_FILE;
+    }
+
+    int rc = NO_ERROR;
+    for (off_t b = 0; rc == NO_ERROR && b < nblocks;)
+    {
+        off_t run = b;
+        while (run < nblocks && (run < DB_HDR_SIZE / GEN_BLOCK || gens[run] > gen))
+            run++;
+        if (run == b)
+        {
+            b++;
+            continue;
+        }
+        off_t end = (run * GEN_BLOCK < size) ? run * GEN_BLOCK : size;
+        rc = copy_extents(in, out, b * GEN_BLOCK, end, true, copied);
+        b = run;
+    }
+    free(gens);
+    if (rc == NO_ERROR && io_fsync(out) < 0)
+        rc = ERR_DB_FILE;
+    return rc;
+}
+
+/*
+ *  backup_side
+ *      dir:          backup directory
+ *      name:         name heap or dictionary
+ *      incremental:  the copy in dir is from the last backup of this file
+ *      copied:       bytes copied are added here
+ *      total:        the size of the file is added here
+ *
+ *  Copies the file into dir, or removes the copy there if the database has
+ *  none.  Both files are append-only, an incremental backup copies what
+ *  was appended since the last one.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int backup_side(const char *dir, const char *name, bool incremental, long long *copied,
+                       long long *total)
+{
+    char path[PATH_MAX];
+    struct stat in_st, out_st;
+
+    if (!backup_path(path, dir, name))
+        return ERR_DB_FILE;
+    int in = io_open(name, O_RDONLY);
+    if (in < 0)
+    {
+        if (errno != ENOENT || (io_unlink(path) < 0 && errno != ENOENT))
+            return ERR_DB_FILE;
+        return NO_ERROR;
+    }
+    int out = io_open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (out < 0 || io_fstat(in, &in_st) < 0 || io_fstat(out, &out_st) < 0)
+    {
+        if (out >= 0)
+            io_close(out);
+        io_close(in);
+        return ERR_DB_FILE;
+    }
+
+    off_t from = (incremental && out_st.st_size <= in_st.st_size) ? out_st.st_size : 0;
+    *total += in_st.st_size;
+    int rc = copy_file(in, out, from, copied);
+    io_close(out);
+    io_close(in);
+    return rc;
+}
+
+/*
+ *  backup_db
+ *      fd:           linux file descriptor of the database
+ *      dir:          backup directory, created if it does not exist
+ *      incremental:  copy only what changed since the last backup into dir
+ *
+ *  Writes a backup of the database into dir.  An incremental backup that
+ *  finds no earlier backup of this database file in dir is a full one.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  M_DB_BACKUP_FULL or M_DB_BACKUP_INCR  on success
+ *            M_ERR_BACKUP                          error writing the backup
+ */
+int backup_db(int fd, const char *dir, bool incremental)
+{
+    IO_PHASE(IO_PHASE_BACKUP);
+    char path[PATH_MAX];
+    backup_info_t info;
+    gen_header_t gen;
+    struct stat st;
+    long long copied = 0, total = 0;
+
+    if ((mkdir(dir, S_IRWXU | S_IRWXG) < 0 && errno != EEXIST) ||
+        !backup_path(path, dir, DB_FILE))
+    {
+        printf(M_ERR_BACKUP, dir);
+        return ERR_DB_FILE;
+    }
+    if (lock_db(fd, F_RDLCK) != NO_ERROR)
+    {
+        printf(M_ERR_BACKUP, dir);
+        return ERR_DB_FILE;
+    }
+
+    int map_fd = -1, out = -1;
+    int rc = ERR_DB_FILE;
+    if (io_fstat(fd, &st) < 0 || (map_fd = gen_open(&st, &gen)) < 0)
+        goto done;
+
+    incremental = incremental && read_info(dir, &info) && info.map_id == gen.map_id &&
+                  info.dev == (unsigned long long)st.st_dev &&
+                  info.ino == (unsigned long long)st.st_ino;
+    out = io_open(path, incremental ? O_RDWR : (O_RDWR | O_CREAT | O_TRUNC),
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (out < 0 && incremental && errno == ENOENT)
+    {
+        incremental = false;
+        out = io_open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    }
+    if (out < 0)
+        goto done;
+
+    total = st.st_size;
+    if (incremental)
+        rc = backup_blocks(fd, out, map_fd, st.st_size, info.gen, &copied);
+    else
+        rc = copy_file(fd, out, 0, &copied);
+    for (size_t f = 0; rc == NO_ERROR && f < sizeof(backup_side_files) / sizeof(backup_side_files[0]); f++)
+        rc = backup_side(dir, backup_side_files[f], incremental, &copied, &total);
+    if (rc != NO_ERROR)
+        goto done;
+
+    // the blocks stamped with gen.gen are in, later changes get the next one
+    memset(&info, 0, sizeof(info));
+    info.magic = BACKUP_MAGIC;
+    info.version = BACKUP_VERSION;
+    info.gen = gen.gen;
+    info.map_id = gen.map_id;
+    info.dev = st.st_dev;
+    info.ino = st.st_ino;
+    info.size = st.st_size;
+    gen.gen++;
+    if (write_info(dir, &info) != NO_ERROR ||
+        io_pwrite(map_fd, &gen.gen, sizeof(gen.gen), offsetof(gen_header_t, gen)) != sizeof(gen.gen))
+        rc = ERR_DB_FILE;
+
+done:
+    if (out >= 0)
+        io_close(out);
+    if (map_fd >= 0)
+        io_close(map_fd);
+    unlock_db(fd);
+    if (rc != NO_ERROR)
+    {
+        printf(M_ERR_BACKUP, dir);
+        return rc;
+    }
+    printf(incremental ? M_DB_BACKUP_INCR : M_DB_BACKUP_FULL, dir, copied, total);
+    return NO_ERROR;
+}
+
+// copies name of the backup in dir into tmp, true if there was nothing to
+// copy or it was copied
+static bool restore_file(const char *dir, const char *name, const char *tmp, long long *copied)
+{
+    char path[PATH_MAX];
+
+    if (!backup_path(path, dir, name))
+        return false;
+    int in = io_open(path, O_RDONLY);
+    if (in < 0)
+        return errno == ENOENT && strcmp(name, DB_FILE) != 0;
+
+    int out = io_open(tmp, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    bool ok = out >= 0 && copy_file(in, out, 0, copied) == NO_ERROR;
+    if (out >= 0)
+        io_close(out);
+    io_close(in);
+    return ok;
+}
+
+/*
+ *  restore_db
+ *      fd:   linux file descriptor of the database
+ *      dir:  backup directory written by -B
+ *
+ *  Replaces the database and its name files with the ones in dir.  On an
+ *  error before the files are renamed the database is left as it was.
+ *
+ *  returns:  fd of the restored database or ERR_DB_FILE
+ *
+ *  console:  M_DB_RESTORED  on success
+ *            M_ERR_RESTORE  dir holds no backup or it could not be copied
+ *            M_ERR_DB_OPEN  error opening the restored database
+ */
+int restore_db(int fd, const char *dir)
+{
+    IO_PHASE(IO_PHASE_BACKUP);
+    size_t nside = sizeof(backup_side_files) / sizeof(backup_side_files[0]);
+    char tmp[sizeof(backup_side_files) / sizeof(backup_side_files[0])][PATH_MAX];
+    backup_info_t info;
+    long long copied = 0;
+
+    if (!read_info(dir, &info) || lock_db(fd, F_WRLCK) != NO_ERROR)
+    {
+        printf(M_ERR_RESTORE, dir);
+        return ERR_DB_FILE;
+    }
+    // no change is in flight now, the log must not replay into the copy
+    if (wal_checkpoint(fd) != NO_ERROR)
+    {
+        unlock_db(fd);
+        printf(M_ERR_RESTORE, dir);
+        return ERR_DB_FILE;
+    }
+
+    bool ok = restore_file(dir, DB_FILE, TMP_DB_FILE, &copied);
+    for (size_t f = 0; f < nside; f++)
+    {
+        snprintf(tmp[f], PATH_MAX, ".tmp_%s", backup_side_files[f]);
+        ok = ok && restore_file(dir, backup_side_files[f], tmp[f], &copied);
+    }
+    if (!ok)
+    {
+        io_unlink(TMP_DB_FILE);
+        for (size_t f = 0; f < nside; f++)
+            io_unlink(tmp[f]);
+        unlock_db(fd);
+        printf(M_ERR_RESTORE, dir);
+        return ERR_DB_FILE;
+    }
+
+    // a side file missing from the backup was not used by its database
+    for (size_t f = 0; f < nside; f++)
+    {
+        if (access(tmp[f], F_OK) == 0)
+            io_rename(tmp[f], backup_side_files[f]);
+        else
+            io_unlink(backup_side_files[f]);
+    }
+    backup_drop();
+    int renamed = io_rename(TMP_DB_FILE, DB_FILE);
+    io_unlink(WAL_FILE);
+    index_drop();
+    column_drop();
+    close_db(fd);
+    if (renamed < 0)
+    {
+        printf(M_ERR_DB_CREATE);
+        return ERR_DB_FILE;
+    }
+
+    fd = open_db(DB_FILE, false, true);
+    if (fd < 0)
+        return ERR_DB_FILE;
+    printf(M_DB_RESTORED, dir, copied);
+    return fd;
+}
+
+/*
+ *  backup_note
+ *      off:  offset of the bytes of the database just written
+ *      len:  how many
+ *
+ *  Stamps the blocks of the bytes with the current generation of the map,
+ *  if there is one.  Called under the lock of the change.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int backup_note(off_t off, off_t len)
+{
+    unsigned int gens[GEN_NOTE_BATCH];
+    gen_header_t hdr;
+
+    if (len <= 0)
+        return NO_ERROR;
+    int map_fd = io_open(GEN_MAP_FILE, O_RDWR);
+    if (map_fd < 0)
+        return (errno == ENOENT) ? NO_ERROR : ERR_DB_FILE;
+
+    int rc = NO_ERROR;
+    if (io_pread(map_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != GEN_MAGIC)
+        rc = ERR_DB_FILE;
+
+    off_t last = (off + len - 1) / GEN_BLOCK;
+    for (off_t b = off / GEN_BLOCK; rc == NO_ERROR && b <= last; b += GEN_NOTE_BATCH)
+    {
+        int n = (last - b + 1 < GEN_NOTE_BATCH) ? (int)(last - b + 1) : GEN_NOTE_BATCH;
+        for (int i = 0; i < n; i++)
+            gens[i] = hdr.gen;
+        ssize_t want = (ssize_t)n * sizeof(unsigned int);
+        if (io_pwrite(map_fd, gens, want, GEN_DATA_OFF + b * sizeof(unsigned int)) != want)
+            rc = ERR_DB_FILE;
+    }
+    io_close(map_fd);
+    return rc;
+}
+
+/*
+ *  backup_drop
+ *
+ *  Removes the block generation map, the next backup is a full one.
+ */
+void backup_drop(void)
+{
+    io_unlink(GEN_MAP_FILE);
+}
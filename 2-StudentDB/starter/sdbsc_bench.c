@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Benchmark (make bench).  Generates N synthetic students and times the
+ *  operations of sdbsc in-process, calling the same functions main() does:
+ *
+ *      add       add_student() of every student, in shuffled id order
+ *      get       get_student() of every student, in another order
+ *      count     count_db_records(), BENCH_SCANS times
+ *      print     print_db(), BENCH_SCANS times
+ *      delete    del_student() of every other student
+ *      compress  compress_db() of what is left, once
+ *
+ *  for every backend (SDBSC_BACKEND) and format (SDBSC_FORMAT), each from
+ *  an empty database, once with a warm page cache and once cold.  A cold
+ *  run flushes the database and drops its pages with posix_fadvise()
+ *  before every operation, outside the timed region.  The mmap backend
+ *  keeps its pages mapped, the kernel does not drop those, so its cold
+ *  numbers are warmer than they look.
+ *
+ *  The ids are spread over the id space by the density: at 100% they are
+ *  1 to N, at 10% every tenth id up to 10 * N.  Every operation is timed
+ *  on its own and the report gives ops/sec over the whole phase and the
+ *  p50 and p99 latency.  Other variables (SDBSC_WAL, SDBSC_LNAME_DICT, ...)
+ *  are left alone, so they can be benchmarked by setting them for make.
+ *
+ *  The databases live in a temporary directory under the current one,
+ *  removed at the end.  The console output of the operations goes to
+ *  /dev/null, the report to the original stdout.
+ */
+#define BENCH_DEF_STUDENTS  10000
+#define BENCH_DEF_DENSITY   100     // percent of the ids in range that are used
+#define BENCH_SCANS         20
+#define BENCH_DIR           ".sdbsc_bench.XXXXXX"
+
+typedef struct bench_run
+{
+    const char *backend;
+    const char *format;
+    bool cold;
+} bench_run_t;
+
+static const char *bench_backends[] = {"fd", "mmap"};
+static const char *bench_formats[] = {"legacy", "header"};
+
+static FILE *report;
+static long long *samples;      // ns per operation of the current phase
+static int nsamples;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// pushes the database out of the page cache before a cold operation
+static void drop_cache(int fd, const bench_run_t *run)
+{
+    if (!run->cold)
+        return;
+    io_fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static int cmp_ns(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// prints the line of a phase whose nsamples operations are in samples
+static void report_phase(const bench_run_t *run, const char *op, int failed)
+{
+    long long total = 0;
+
+    if (nsamples == 0)
+        return;
+    for (int i = 0; i < nsamples; i++)
+        total += samples[i];
+    qsort(samples, nsamples, sizeof(samples[0]), cmp_ns);
+
+    double p50 = samples[(nsamples - 1) / 2] / 1000.0;
+    double p99 = samples[(int)((nsamples - 1) * 0.99)] / 1000.0;
+    double rate = (total > 0) ? nsamples * 1e9 / total : 0;
+    fprintf(report, "%-7s %-7s %-5s %-9s %7d %12.0f %10.1f %10.1f%s\n",
+            run->backend, run->format, run->cold ? "cold" : "warm", op, nsamples,
+            rate, p50, p99, failed ? "  FAILED" : "");
+    fflush(report);
+    nsamples = 0;
+}
+
+// times one call, its result goes to *failed unless it is NO_ERROR
+#define BENCH_TIME(fd, run, failed, call)       \
+    do                                          \
+    {                                           \
+        drop_cache(fd, run);                    \
+        long long t0_ = now_ns();               \
+        int rc_ = (call);                       \
+        samples[nsamples++] = now_ns() - t0_;   \
+        if (rc_ < 0)                            \
+            (failed)++;                         \
+    } while (0)
+
+// Fisher-Yates with a fixed seed, the same order for every run
+static void shuffle(int *ids, int n, unsigned seed)
+{
+    for (int i = n - 1; i > 0; i--)
+    {
+        seed = seed * 1103515245u + 12345u;
+        int j = (seed >> 8) % (i + 1);
+        int t = ids[i];
+        ids[i] = ids[j];
+        ids[j] = t;
+    }
+}
+
+// removes what a run leaves behind
+static void clear_db(void)
+{
+    io_unlink(DB_FILE);
+    io_unlink(TMP_DB_FILE);
+    io_unlink(WAL_FILE);
+    index_drop();
+    column_drop();
+    names_drop();
+}
+
+/*
+ *  bench_one
+ *      run:  backend, format and cache state
+ *      ids:  the n student ids, in add order
+ *      n:    number of students
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE if the database could not be opened
+ */
+static int bench_one(const bench_run_t *run, const int *ids, int n)
+{
+    int *order = malloc(n * sizeof(int));
+    char fname[24], lname[32];
+    student_t s;
+
+    if (order == NULL)
+        return ERR_DB_FILE;
+    clear_db();
+    setenv(DB_BACKEND_ENV, run->backend, 1);
+    setenv(DB_FORMAT_ENV, run->format, 1);
+    int fd = open_db(DB_FILE, true, true);
+    if (fd < 0)
+    {
+        free(order);
+        return ERR_DB_FILE;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < n; i++)
+    {
+        snprintf(fname, sizeof(fname), "first%d", ids[i]);
+        snprintf(lname, sizeof(lname), "last%d", ids[i] % 1000);
+        BENCH_TIME(fd, run, failed, add_student(fd, ids[i], fname, lname, ids[i] % 401));
+    }
+    report_phase(run, "add", failed);
+
+    memcpy(order, ids, n * sizeof(int));
+    shuffle(order, n, 2);
+    failed = 0;
+    for (int i = 0; i < n; i++)
+        BENCH_TIME(fd, run, failed, get_student(fd, order[i], &s));
+    report_phase(run, "get", failed);
+
+    failed = 0;
+    for (int i = 0; i < BENCH_SCANS; i++)
+        BENCH_TIME(fd, run, failed, count_db_records(fd));
+    report_phase(run, "count", failed);
+
+    failed = 0;
+    for (int i = 0; i < BENCH_SCANS; i++)
+    {
+        BENCH_TIME(fd, run, failed, print_db(fd));
+        fflush(stdout);
+    }
+    report_phase(run, "print", failed);
+
+    failed = 0;
+    for (int i = 0; i < n; i += 2)
+        BENCH_TIME(fd, run, failed, del_student(fd, order[i]));
+    report_phase(run, "delete", failed);
+
+    // compress_db() returns the descriptor to go on with
+    drop_cache(fd, run);
+    long long t0 = now_ns();
+    int new_fd = compress_db(fd);
+    samples[nsamples++] = now_ns() - t0;
+    report_phase(run, "compress", new_fd < 0);
+
+    close_db((new_fd < 0) ? fd : new_fd);
+    clear_db();
+    free(order);
+    return NO_ERROR;
+}
+
+static void bench_usage(char *exename)
+{
+    fprintf(stderr, "usage: %s [-n students] [-d density]\n", exename);
+    fprintf(stderr, "\t-n:  number of synthetic students (default %d)\n", BENCH_DEF_STUDENTS);
+    fprintf(stderr, "\t-d:  percent of the ids in their range that are used, 1 to 100\n");
+    fprintf(stderr, "\t     (default %d)\n", BENCH_DEF_DENSITY);
+}
+
+int main(int argc, char *argv[])
+{
+    int n = BENCH_DEF_STUDENTS, density = BENCH_DEF_DENSITY;
+    char dir[] = BENCH_DIR;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:")) != -1)
+    {
+        if (opt == 'n')
+            n = atoi(optarg);
+        else if (opt == 'd')
+            density = atoi(optarg);
+        else
+        {
+            bench_usage(argv[0]);
+            exit(EXIT_FAIL_ARGS);
+        }
+    }
+    long span = (long)(n - 1) * 100 / (density > 0 ? density : 1) + 1;
+    if (n < 1 || density < 1 || density > 100 || span > MAX_STD_ID)
+    {
+        fprintf(stderr, "%d students at %d%% density do not fit ids %d to %d\n",
+                n, density, MIN_STD_ID, MAX_STD_ID);
+        bench_usage(argv[0]);
+        exit(EXIT_FAIL_ARGS);
+    }
+
+    int *ids = malloc(n * sizeof(int));
+    samples = malloc((n > BENCH_SCANS ? n : BENCH_SCANS) * sizeof(long long));
+    if (ids == NULL || samples == NULL || mkdtemp(dir) == NULL || chdir(dir) < 0)
+    {
+        perror("sdbsc_bench");
+        exit(EXIT_FAIL_DB);
+    }
+    for (int i = 0; i < n; i++)
+        ids[i] = MIN_STD_ID + (int)((long)i * 100 / density);
+    shuffle(ids, n, 1);
+
+    // the operations print what sdbsc would, keep that out of the report
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    int null_fd = io_open("/dev/null", O_WRONLY);
+    if (report == NULL || null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0)
+    {
+        perror("sdbsc_bench");
+        exit(EXIT_FAIL_DB);
+    }
+    io_close(null_fd);
+
+    fprintf(report, "sdbsc benchmark: %d students, ids %d to %ld (%d%% density)\n",
+            n, MIN_STD_ID, span, density);
+    fprintf(report, "%-7s %-7s %-5s %-9s %7s %12s %10s %10s\n", "backend", "format",
+            "cache", "op", "ops", "ops/sec", "p50 us", "p99 us");
+
+    int exit_code = EXIT_OK;
+    for (size_t b = 0; b < sizeof(bench_backends) / sizeof(bench_backends[0]); b++)
+        for (size_t f = 0; f < sizeof(bench_formats) / sizeof(bench_formats[0]); f++)
+            for (int cold = 0; cold <= 1; cold++)
+            {
+                bench_run_t run = {bench_backends[b], bench_formats[f], cold};
+                if (bench_one(&run, ids, n) != NO_ERROR)
+                {
+                    fprintf(stderr, "sdbsc_bench: cannot open %s/%s\n", dir, DB_FILE);
+                    exit_code = EXIT_FAIL_DB;
+                }
+            }
+
+    if (chdir("..") == 0)
+        rmdir(dir);
+    free(ids);
+    free(samples);
+    fclose(report);
+    return exit_code;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  start_client
+ *      sock_path:  path of the unix domain socket the server listens on
+ *
+ *  Client side of server mode (see sdbsc_server.c).  Every line read from
+ *  stdin is sent to the server as one request and the reply, everything up
+ *  to SDB_EOF_CHAR, is printed before the next line is read.  Stops at the
+ *  end of stdin or after an exit or stop-server request.
+ *
+ *  returns:  NO_ERROR, or ERR_DB_OP if the server cannot be reached
+ *
+ *  console:  the replies of the server, M_ERR_CLI_CONNECT or
+ *            M_ERR_CLI_COMM on error
+ */
+int start_client(char *sock_path)
+{
+    struct sockaddr_un addr;
+    char *cmd_buff = malloc(SDB_COMM_BUFF_SZ);
+    char *rsp_buff = malloc(SDB_COMM_BUFF_SZ);
+    int rc = NO_ERROR;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+
+    int cli_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (cmd_buff == NULL || rsp_buff == NULL || cli_socket < 0 ||
+        connect(cli_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        printf(M_ERR_CLI_CONNECT, sock_path);
+        if (cli_socket >= 0)
+            close(cli_socket);
+        free(cmd_buff);
+        free(rsp_buff);
+        return ERR_DB_OP;
+    }
+
+    while (rc == NO_ERROR && fgets(cmd_buff, SDB_COMM_BUFF_SZ - 1, stdin) != NULL)
+    {
+        size_t len = strlen(cmd_buff);
+        if (len == 0 || cmd_buff[len - 1] != '\n')
+            cmd_buff[len++] = '\n';
+
+        char cmd[16] = "";
+        sscanf(cmd_buff, "%15s", cmd);
+        if (cmd[0] == '\0')
+            continue;
+
+        if (send(cli_socket, cmd_buff, len, MSG_NOSIGNAL) != (ssize_t)len)
+        {
+            // a busy server says why before it closes the connection
+            ssize_t n = recv(cli_socket, rsp_buff, SDB_COMM_BUFF_SZ, MSG_DONTWAIT);
+            if (n > 0 && rsp_buff[n - 1] == SDB_EOF_CHAR)
+                printf("%.*s", (int)n - 1, rsp_buff);
+            else
+                printf(M_ERR_CLI_COMM);
+            rc = ERR_DB_OP;
+            break;
+        }
+        if (strcmp(cmd, "exit") == 0)
+            break;
+
+        // print the reply as it comes in, the last byte of the last chunk
+        // is SDB_EOF_CHAR
+        bool done = false;
+        while (!done)
+        {
+            ssize_t n = recv(cli_socket, rsp_buff, SDB_COMM_BUFF_SZ, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                printf(M_ERR_CLI_COMM);
+                rc = ERR_DB_OP;
+                break;
+            }
+            if (rsp_buff[n - 1] == SDB_EOF_CHAR)
+            {
+                done = true;
+                n--;
+            }
+            printf("%.*s", (int)n, rsp_buff);
+        }
+        fflush(stdout);
+
+        if (strcmp(cmd, "stop-server") == 0)
+            break;
+    }
+
+    close(cli_socket);
+    free(cmd_buff);
+    free(rsp_buff);
+    return rc;
+}
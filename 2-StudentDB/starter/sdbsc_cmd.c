@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Command mode (-i).  Reads one command per line from stdin until EOF and
+ *  runs it against the database opened once by main():
+ *
+ *      a id first_name last_name gpa    like -a
+ *      f id [id ...]                    like -f
+ *      d id                             like -d
+ *      c                                like -c
+ *      p                                like -p
+ *
+ *  Empty lines and lines starting with # are skipped.  The output of a
+ *  command is what its option prints, M_* messages included, so a script
+ *  that ran sdbsc once per line can pipe the same lines into one sdbsc -i
+ *  and skip a process start and open_db() per command.  The fd, the name
+ *  files and the mapping of the mmap backend stay open across commands.
+ *
+ *  The commands are turned into the argv their option would get.  On a
+ *  sharded database they go to shard_command() as they are.
+ */
+
+// builds argv of the option of the command in line, returns argc or 0 if
+// the line is not a command with the right number of arguments
+static int command_argv(char *line, char ***argv, int *cap)
+{
+    static char opt[3] = "-?";
+    char *save = NULL;
+    int argc = 1;
+
+    for (char *tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+         tok = strtok_r(NULL, " \t\r\n", &save))
+    {
+        if (argc + 1 >= *cap)
+        {
+            int grown_cap = *cap ? *cap * 2 : 16;
+            char **grown = realloc(*argv, grown_cap * sizeof(char *));
+            if (grown == NULL)
+                return 0;
+            *argv = grown;
+            *cap = grown_cap;
+        }
+        (*argv)[argc++] = tok;
+    }
+    if (argc < 2 || strlen((*argv)[1]) != 1)
+        return 0;
+
+    opt[1] = (*argv)[1][0];
+    (*argv)[0] = "sdbsc";
+    (*argv)[1] = opt;
+    (*argv)[argc] = NULL;
+
+    switch (opt[1])
+    {
+    case 'a':
+        return (argc == 6) ? argc : 0;
+    case 'd':
+        return (argc == 3) ? argc : 0;
+    case 'f':
+        // - would read the ids from stdin, where the commands come from
+        return (argc >= 3 && strcmp((*argv)[2], "-") != 0) ? argc : 0;
+    case 'c':
+    case 'p':
+        return (argc == 2) ? argc : 0;
+    default:
+        return 0;
+    }
+}
+
+// runs one command on the single file database fd, returns NO_ERROR or
+// the error of the operation
+static int exec_command(int fd, int argc, char *argv[])
+{
+    student_t student;
+    int id, rc;
+
+    switch (argv[1][1])
+    {
+    case 'a':
+        id = atoi(argv[2]);
+        if (validate_range(id, atoi(argv[5])) != NO_ERROR)
+        {
+            printf(M_ERR_STD_RNG);
+            return ERR_DB_OP;
+        }
+        return add_student(fd, id, argv[3], argv[4], atoi(argv[5]));
+
+    case 'd':
+        return del_student(fd, atoi(argv[2]));
+
+    case 'f':
+        if (argc > 3)
+        {
+            int *ids = NULL;
+            int n = read_ids(argc, argv, &ids);
+            rc = (n >= 0) ? find_students(fd, ids, n) : ERR_DB_FILE;
+            free(ids);
+            return rc;
+        }
+        id = atoi(argv[2]);
+        rc = get_student(fd, id, &student);
+        if (rc == NO_ERROR)
+            print_student(&student);
+        else if (rc == SRCH_NOT_FOUND)
+            printf(M_STD_NOT_FND_MSG, id);
+        else
+            printf(M_ERR_DB_READ);
+        return rc;
+
+    case 'c':
+        return count_db_records(fd);
+
+    default:
+        return print_db(fd);
+    }
+}
+
+/*
+ *  run_commands
+ *      fd:  linux file descriptor of the database, or -1 for the sharded
+ *           database
+ *      in:  stream with one command per line
+ *
+ *  Runs the commands of in until EOF.  A failing command does not stop
+ *  the ones after it.  On a terminal every command is prompted for.
+ *
+ *  returns:  NO_ERROR, or ERR_DB_OP if any command failed
+ *
+ *  console:  the output of every command, M_ERR_SRV_CMD for a line that
+ *            is not one
+ */
+int run_commands(int fd, FILE *in)
+{
+    bool tty = isatty(fileno(in));
+    char *line = NULL, **argv = NULL;
+    size_t room = 0;
+    int cap = 0, failed = 0;
+
+    for (;;)
+    {
+        if (tty)
+        {
+            printf(SDB_CMD_PROMPT);
+            fflush(stdout);
+        }
+        ssize_t n = getline(&line, &room, in);
+        if (n < 0)
+            break;
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+            line[--n] = '\0';
+
+        const char *p = line + strspn(line, " \t");
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        char copy[SDB_CMD_ECHO_MAX];
+        snprintf(copy, sizeof(copy), "%s", p);
+        int argc = command_argv(line, &argv, &cap);
+        if (argc == 0)
+        {
+            printf(M_ERR_SRV_CMD, copy);
+            failed++;
+            continue;
+        }
+
+        if (fd < 0)
+            failed += shard_command(argc, argv, argv[1][1]) != EXIT_OK;
+        else
+            failed += exec_command(fd, argc, argv) < 0;
+    }
+    if (tty)
+        printf("\n");
+
+    free(line);
+    free(argv);
+    return failed ? ERR_DB_OP : NO_ERROR;
+}
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Hot column.  The records keep id and gpa at both ends of 64 bytes, so a
+ *  scan that only needs the numbers (-s, -c of a headerless file) drags
+ *  the 56 bytes of names through the cache with every record.  COL_FILE
+ *  holds just the id and gpa of every slot, 8 bytes each (see db.h), and
+ *  those scans read it instead of the database.  The database stays the
+ *  place of the full records, student_t and everything built on it are
+ *  unchanged.
+ *
+ *  Like the last name index the column is optional: -s builds it on first
+ *  use and from then on put_slot() writes every change to both files.  A
+ *  bulk load or -z drops it, the next -s builds it again.
+ *
+ *  A build scans the database into a temporary file and renames it over
+ *  COL_FILE.  A change made during the scan could be missed by it and,
+ *  with no COL_FILE to write to yet, by column_note() too.  The build
+ *  therefore holds the column lock exclusively from before the temporary
+ *  file exists until after the rename, and column_note() takes it shared:
+ *  lock_column() between processes, col_lock between threads.
+ *
+ *  put_slot() marks the column slot COL_PENDING_ID before it writes the
+ *  database and stores the new id and gpa after, under the slot lock.
+ *  column_read() takes a marked slot from the database, so a crash between
+ *  the two writes, or a change still in flight, never shows a stale slot.
+ */
+
+static pthread_rwlock_t col_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ *  column_build
+ *      fd:  linux file descriptor of the database
+ *
+ *  Writes COL_FILE from the live records of the database, unless another
+ *  process built it while we waited for the lock.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int column_build(int fd)
+{
+    col_slot_t *slots = calloc(MAX_STD_ID + 1, sizeof(col_slot_t));
+    col_header_t hdr = {0};
+    int base = db_base_id(fd);
+    int used = 0, got = 0;
+    db_scan_t sc;
+
+    if (slots == NULL)
+        return ERR_DB_FILE;
+    if (lock_column(fd, F_WRLCK) != NO_ERROR)
+    {
+        free(slots);
+        return ERR_DB_FILE;
+    }
+    pthread_rwlock_wrlock(&col_lock);
+
+    int rc = NO_ERROR;
+    if (access(COL_FILE, F_OK) == 0)
+        goto done;
+
+    int col_fd = io_open(TMP_COL_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (col_fd < 0 || scan_open(&sc, fd, 0) != NO_ERROR)
+    {
+        if (col_fd >= 0)
+            io_close(col_fd);
+        rc = ERR_DB_FILE;
+        goto failed;
+    }
+    while ((got = scan_next(&sc)) > 0)
+    {
+        for (int i = 0; i < got; i++)
+        {
+            int slot = sc.batch[i]->id - base;
+            if (slot < 0 || slot > MAX_STD_ID)
+                continue;
+            slots[slot].id = sc.batch[i]->id;
+            slots[slot].gpa = sc.batch[i]->gpa;
+            used = (slot + 1 > used) ? slot + 1 : used;
+        }
+    }
+    scan_close(&sc);
+
+    hdr.magic = COL_MAGIC;
+    hdr.version = COL_VERSION;
+    hdr.base_id = base;
+    ssize_t len = (ssize_t)used * sizeof(col_slot_t);
+    bool ok = got == 0 &&
+              io_pwrite(col_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+              io_ftruncate(col_fd, COL_DATA_OFF) == 0 &&
+              io_pwrite(col_fd, slots, len, COL_DATA_OFF) == len;
+    io_close(col_fd);
+    if (ok && io_rename(TMP_COL_FILE, COL_FILE) == 0)
+        goto done;
+    rc = ERR_DB_FILE;
+
+failed:
+    io_unlink(TMP_COL_FILE);
+done:
+    pthread_rwlock_unlock(&col_lock);
+    unlock_column(fd);
+    free(slots);
+    return rc;
+}
+
+/*
+ *  column_open
+ *      fd:  linux file descriptor of the database
+ *
+ *  Opens the hot column for reading, building it first if there is none
+ *  or the one found does not belong to this database.
+ *
+ *  returns:  fd of COL_FILE or ERR_DB_FILE
+ */
+int column_open(int fd)
+{
+    col_header_t hdr;
+
+    for (int tries = 0; tries < 2; tries++)
+    {
+        int col_fd = io_open(COL_FILE, O_RDONLY);
+        if (col_fd < 0 && errno != ENOENT)
+            return ERR_DB_FILE;
+        if (col_fd >= 0)
+        {
+            if (io_pread(col_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+                hdr.magic == COL_MAGIC && hdr.version == COL_VERSION &&
+                hdr.base_id == db_base_id(fd))
+                return col_fd;
+            io_close(col_fd);
+            column_drop();
+        }
+        if (column_build(fd) != NO_ERROR)
+            return ERR_DB_FILE;
+    }
+    return ERR_DB_FILE;
+}
+
+/*
+ *  column_read
+ *      fd:      linux file descriptor of the database
+ *      col_fd:  fd from column_open()
+ *      slot:    first slot to read
+ *      buf:     receives the slots
+ *      n:       number of slots wanted
+ *
+ *  Slots marked COL_PENDING_ID are read from the database instead.
+ *
+ *  returns:  number of slots read, less than n at the end of the file, or
+ *            ERR_DB_FILE
+ */
+int column_read(int fd, int col_fd, int slot, col_slot_t *buf, int n)
+{
+    off_t off = COL_DATA_OFF + (off_t)slot * sizeof(col_slot_t);
+    size_t want = (size_t)n * sizeof(col_slot_t);
+    size_t done = 0;
+
+    while (done < want)
+    {
+        ssize_t got = io_pread(col_fd, (char *)buf + done, want - done, off + done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return ERR_DB_FILE;
+        if (got == 0)
+            break;
+        done += got;
+    }
+
+    int cnt = done / sizeof(col_slot_t);
+    for (int i = 0; i < cnt; i++)
+    {
+        if (buf[i].id != COL_PENDING_ID)
+            continue;
+        student_t s;
+        int rc = get_student(fd, db_base_id(fd) + slot + i, &s);
+        if (rc == ERR_DB_FILE)
+            return ERR_DB_FILE;
+        buf[i].id = (rc == NO_ERROR) ? s.id : 0;
+        buf[i].gpa = (rc == NO_ERROR) ? s.gpa : 0;
+    }
+    return cnt;
+}
+
+/*
+ *  column_note
+ *      fd:   linux file descriptor of the database
+ *      id:   student id whose slot is written
+ *      rec:  its new contents, NULL before the slot is written
+ *
+ *  Called by put_slot() around every slot write.  Marks the slot of the
+ *  hot column, if there is one, as changing, then copies id and gpa into
+ *  it.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int column_note(int fd, int id, const student_t *rec)
+{
+    col_slot_t cs = {COL_PENDING_ID, 0};
+    if (rec != NULL)
+    {
+        cs.id = rec->id;
+        cs.gpa = rec->gpa;
+    }
+
+    // a build creates the temporary file before it scans and renames it
+    // after, so if neither name exists no build has seen the old slot
+    if (access(TMP_COL_FILE, F_OK) < 0 && access(COL_FILE, F_OK) < 0)
+        return NO_ERROR;
+
+    if (lock_column(fd, F_RDLCK) != NO_ERROR)
+        return ERR_DB_FILE;
+    pthread_rwlock_rdlock(&col_lock);
+
+    int rc = NO_ERROR;
+    int col_fd = io_open(COL_FILE, O_WRONLY);
+    if (col_fd < 0)
+    {
+        // the build failed, or the column was dropped
+        if (errno != ENOENT)
+            rc = ERR_DB_FILE;
+    }
+    else
+    {
+        off_t off = COL_DATA_OFF + (off_t)(id - db_base_id(fd)) * sizeof(col_slot_t);
+        if (io_pwrite(col_fd, &cs, sizeof(cs), off) != sizeof(cs))
+            rc = ERR_DB_FILE;
+        io_close(col_fd);
+    }
+
+    pthread_rwlock_unlock(&col_lock);
+    unlock_column(fd);
+    return rc;
+}
+
+/*
+ *  column_count
+ *      fd:  linux file descriptor of the database
+ *
+ *  Counts the live slots of an existing hot column, it is not built for
+ *  this.
+ *
+ *  returns:  number of live records, SRCH_NOT_FOUND if there is no column
+ *            or ERR_DB_FILE
+ */
+int column_count(int fd)
+{
+    col_slot_t *buf;
+    col_header_t hdr;
+    int count = 0, got, slot = 0;
+
+    int col_fd = io_open(COL_FILE, O_RDONLY);
+    if (col_fd < 0)
+        return (errno == ENOENT) ? SRCH_NOT_FOUND : ERR_DB_FILE;
+    if (io_pread(col_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != COL_MAGIC ||
+        hdr.version != COL_VERSION || hdr.base_id != db_base_id(fd))
+    {
+        io_close(col_fd);
+        return SRCH_NOT_FOUND;
+    }
+
+    buf = malloc(COL_CHUNK_SLOTS * sizeof(col_slot_t));
+    if (buf == NULL)
+    {
+        io_close(col_fd);
+        return ERR_DB_FILE;
+    }
+    while ((got = column_read(fd, col_fd, slot, buf, COL_CHUNK_SLOTS)) > 0)
+    {
+        for (int i = 0; i < got; i++)
+            count += buf[i].id != 0;
+        slot += got;
+    }
+    free(buf);
+    io_close(col_fd);
+    return (got < 0) ? ERR_DB_FILE : count;
+}
+
+/*
+ *  column_drop
+ *
+ *  Removes the hot column, the next -s builds a fresh one.
+ */
+void column_drop(void)
+{
+    io_unlink(COL_FILE);
+}
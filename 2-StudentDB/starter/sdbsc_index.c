@@ -0,0 +1,559 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+static pthread_mutex_t note_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *  Last name index.  The index is a sorted run of (lname, id) entries with
+ *  a sparse fence index in front of it, one fence key per page of
+ *  IDX_PAGE_ENTRIES entries (see db.h for the file layout).  A lookup
+ *  bisects the fences, then reads the run page by page from the first page
+ *  that can hold the name until the names move past it, which is
+ *  O(log n + k) for k matches.
+ *
+ *  add_student() and del_student() append their change to a delta log at
+ *  the end of the file instead of rewriting the run.  Lookups apply the
+ *  log on top of the run, and once it grows to IDX_DELTA_MAX entries the
+ *  run and the log are merged into a new run.
+ *
+ *  The index is optional: it is built on the first -n lookup and then
+ *  kept up to date.  Operations that rewrite many records at once simply
+ *  drop it (index_drop()), the next lookup builds it again.
+ *
+ *  A change is appended while its slot lock is held, so the log holds
+ *  the changes of one id in the order they reached the database.  Appends,
+ *  merges and builds all run under the index lock, lock_index() between
+ *  processes and note_lock between threads: a merge or build that renames
+ *  a new file over the index cannot lose an append made meanwhile, and a
+ *  build cannot miss a change made during its scan.
+ *
+ *  An addition is logged before its record is written and a removal
+ *  after, so a crash in between (with or without the write-ahead log)
+ *  leaves at most an entry for a record that is not there.  Lookups check
+ *  every entry against the record, such an entry is skipped.
+ */
+
+static int cmp_entry(const void *a, const void *b)
+{
+    const idx_entry_t *ea = a;
+    const idx_entry_t *eb = b;
+    int c = strncmp(ea->lname, eb->lname, IDX_KEY_LEN);
+    if (c != 0)
+        return c;
+    return (ea->id > eb->id) - (ea->id < eb->id);
+}
+
+// compares the name of an entry with the name (or prefix) searched for.
+// Keys hold the first IDX_KEY_LEN bytes of longer names.
+static int cmp_key(const char *lname, const char *key, bool prefix)
+{
+    if (prefix)
+    {
+        size_t len = strlen(key);
+        return strncmp(lname, key, (len < IDX_KEY_LEN) ? len : IDX_KEY_LEN);
+    }
+    return strncmp(lname, key, IDX_KEY_LEN);
+}
+
+/*
+ *  write_index
+ *      e:  index entries, sorted by cmp_entry()
+ *      n:  number of entries
+ *
+ *  Writes a new index file with an empty delta log and renames it over
+ *  LNAME_IDX_FILE.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int write_index(const idx_entry_t *e, int n)
+{
+    idx_header_t hdr = {0};
+    hdr.magic = IDX_MAGIC;
+    hdr.version = IDX_VERSION;
+    hdr.run_count = n;
+    hdr.fence_count = (n + IDX_PAGE_ENTRIES - 1) / IDX_PAGE_ENTRIES;
+
+    char *fences = calloc(hdr.fence_count ? hdr.fence_count : 1, IDX_KEY_LEN);
+    if (fences == NULL)
+        return ERR_DB_FILE;
+    for (int p = 0; p < hdr.fence_count; p++)
+        memcpy(fences + (size_t)p * IDX_KEY_LEN, e[p * IDX_PAGE_ENTRIES].lname, IDX_KEY_LEN);
+
+    int fd = io_open(TMP_LNAME_IDX_FILE, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (fd < 0)
+    {
+        free(fences);
+        return ERR_DB_FILE;
+    }
+
+    ssize_t fence_len = (ssize_t)hdr.fence_count * IDX_KEY_LEN;
+    ssize_t run_len = (ssize_t)n * sizeof(idx_entry_t);
+    bool ok = io_pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+              io_pwrite(fd, fences, fence_len, sizeof(hdr)) == fence_len &&
+              io_pwrite(fd, e, run_len, IDX_RUN_OFF(hdr.fence_count)) == run_len;
+    free(fences);
+    io_close(fd);
+
+    if (!ok || io_rename(TMP_LNAME_IDX_FILE, LNAME_IDX_FILE) < 0)
+    {
+        io_unlink(TMP_LNAME_IDX_FILE);
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  index_build
+ *      fd:  linux file descriptor of the database
+ *
+ *  Creates the index from scratch from the live records of the database,
+ *  unless another process built it while we waited for the lock.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int index_build(int fd)
+{
+    student_t *recs;
+    int n;
+
+    if (collect_live(fd, &recs, &n) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    idx_entry_t *e = malloc((n ? n : 1) * sizeof(idx_entry_t));
+    if (e == NULL)
+    {
+        free(recs);
+        return ERR_DB_FILE;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        name_copy(recs[i].lname, sizeof(recs[i].lname), e[i].lname, IDX_KEY_LEN);
+        e[i].id = recs[i].id;
+    }
+    free(recs);
+
+    qsort(e, n, sizeof(idx_entry_t), cmp_entry);
+    int rc = write_index(e, n);
+    free(e);
+    return rc;
+}
+
+// index_build() under the index lock
+static int index_build_locked(int fd)
+{
+    if (lock_index(fd) != NO_ERROR)
+        return ERR_DB_FILE;
+    pthread_mutex_lock(&note_lock);
+    int rc = (access(LNAME_IDX_FILE, F_OK) == 0) ? NO_ERROR : index_build(fd);
+    pthread_mutex_unlock(&note_lock);
+    unlock_index(fd);
+    return rc;
+}
+
+/*
+ *  read_delta
+ *      idx_fd:  descriptor of the index file
+ *      hdr:     its header
+ *      out:     receives a malloc()ed array with the delta log
+ *      n:       receives the number of log entries
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int read_delta(int idx_fd, const idx_header_t *hdr, idx_entry_t **out, int *n)
+{
+    struct stat st;
+    off_t start = IDX_RUN_OFF(hdr->fence_count) + (off_t)hdr->run_count * sizeof(idx_entry_t);
+
+    *out = NULL;
+    *n = 0;
+    if (io_fstat(idx_fd, &st) < 0)
+        return ERR_DB_FILE;
+    if (st.st_size <= start)
+        return NO_ERROR;
+
+    int cnt = (st.st_size - start) / sizeof(idx_entry_t);
+    idx_entry_t *e = malloc((cnt ? cnt : 1) * sizeof(idx_entry_t));
+    ssize_t len = (ssize_t)cnt * sizeof(idx_entry_t);
+    if (e == NULL || io_pread(idx_fd, e, len, start) != len)
+    {
+        free(e);
+        return ERR_DB_FILE;
+    }
+    *out = e;
+    *n = cnt;
+    return NO_ERROR;
+}
+
+// one change of the delta log, with its position in the log
+typedef struct delta_op{
+    idx_entry_t e;              //entry with a positive id
+    bool live;                  //added, or removed
+    int seq;
+} delta_op_t;
+
+static int cmp_op(const void *a, const void *b)
+{
+    const delta_op_t *oa = a;
+    const delta_op_t *ob = b;
+    int c = cmp_entry(&oa->e, &ob->e);
+    if (c != 0)
+        return c;
+    return (oa->seq > ob->seq) - (oa->seq < ob->seq);
+}
+
+/*
+ *  apply_delta
+ *      e:      entries, sorted, with room for n + nd entries
+ *      n:      number of entries in e
+ *      delta:  delta log in the order it was written
+ *      nd:     number of log entries
+ *
+ *  Replays the log over the entries.  The log is sorted by entry and log
+ *  position, and only the last change of every entry is kept: an entry
+ *  added last is in the result (a build may have seen the record before
+ *  its change was logged, so it may be in e already), one removed last is
+ *  not.  The kept changes are then merged with e in one pass, which is
+ *  O(n + nd log nd) rather than a search of e per change.
+ *
+ *  returns:  the new number of entries in e, -1 if out of memory
+ */
+static int apply_delta(idx_entry_t *e, int n, const idx_entry_t *delta, int nd)
+{
+    if (nd == 0)
+        return n;
+
+    delta_op_t *ops = malloc((size_t)nd * sizeof(delta_op_t));
+    idx_entry_t *out = malloc(((size_t)n + nd) * sizeof(idx_entry_t));
+    if (ops == NULL || out == NULL)
+    {
+        free(ops);
+        free(out);
+        return -1;
+    }
+
+    for (int i = 0; i < nd; i++)
+    {
+        ops[i].e = delta[i];
+        ops[i].live = delta[i].id > 0;
+        if (!ops[i].live)
+            ops[i].e.id = -delta[i].id;
+        ops[i].seq = i;
+    }
+    qsort(ops, nd, sizeof(delta_op_t), cmp_op);
+
+    int d = 0;
+    for (int i = 0; i < nd; i++)
+    {
+        if (i + 1 < nd && cmp_entry(&ops[i].e, &ops[i + 1].e) == 0)
+            continue;
+        ops[d++] = ops[i];
+    }
+
+    int i = 0, j = 0, m = 0;
+    while (i < n || j < d)
+    {
+        int c = (i == n) ? 1 : (j == d) ? -1 : cmp_entry(&e[i], &ops[j].e);
+        if (c < 0)
+        {
+            out[m++] = e[i++];
+            continue;
+        }
+        if (ops[j].live)
+            out[m++] = ops[j].e;
+        if (c == 0)
+            i++;
+        j++;
+    }
+
+    memcpy(e, out, (size_t)m * sizeof(idx_entry_t));
+    free(ops);
+    free(out);
+    return m;
+}
+
+/*
+ *  index_merge
+ *      idx_fd:  descriptor of the index file
+ *      hdr:     its header
+ *
+ *  Folds the delta log into a new sorted run.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int index_merge(int idx_fd, const idx_header_t *hdr)
+{
+    idx_entry_t *delta;
+    int nd;
+
+    if (read_delta(idx_fd, hdr, &delta, &nd) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    idx_entry_t *e = malloc(((size_t)hdr->run_count + nd + 1) * sizeof(idx_entry_t));
+    ssize_t len = (ssize_t)hdr->run_count * sizeof(idx_entry_t);
+    if (e == NULL || io_pread(idx_fd, e, len, IDX_RUN_OFF(hdr->fence_count)) != len)
+    {
+        free(e);
+        free(delta);
+        return ERR_DB_FILE;
+    }
+
+    int n = apply_delta(e, hdr->run_count, delta, nd);
+    int rc = (n < 0) ? ERR_DB_FILE : write_index(e, n);
+    free(e);
+    free(delta);
+    return rc;
+}
+
+/*
+ *  index_note
+ *      fd:    linux file descriptor of the database
+ *      s:     student that was added or removed
+ *      live:  true when s was added, false when it was deleted
+ *
+ *  Records the change in the delta log of the index, if there is an index.
+ *  Called with the slot lock of s held.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int index_note(int fd, const student_t *s, bool live)
+{
+    idx_header_t hdr;
+    idx_entry_t e;
+    struct stat st;
+
+    // other writers append to the same log, and a merge replaces the file
+    if (lock_index(fd) != NO_ERROR)
+        return ERR_DB_FILE;
+    pthread_mutex_lock(&note_lock);
+    int idx_fd = io_open(LNAME_IDX_FILE, O_RDWR | O_APPEND);
+    if (idx_fd < 0)
+    {
+        int missing = (errno == ENOENT);
+        pthread_mutex_unlock(&note_lock);
+        unlock_index(fd);
+        return missing ? NO_ERROR : ERR_DB_FILE;
+    }
+
+    name_copy(s->lname, sizeof(s->lname), e.lname, IDX_KEY_LEN);
+    e.id = live ? s->id : -s->id;
+
+    int rc = NO_ERROR;
+    if (io_pread(idx_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != IDX_MAGIC ||
+        io_write(idx_fd, &e, sizeof(e)) != sizeof(e) || io_fstat(idx_fd, &st) < 0)
+    {
+        rc = ERR_DB_FILE;
+    }
+    else
+    {
+        off_t run_end = IDX_RUN_OFF(hdr.fence_count) + (off_t)hdr.run_count * sizeof(idx_entry_t);
+        if ((st.st_size - run_end) / (off_t)sizeof(idx_entry_t) >= IDX_DELTA_MAX)
+            rc = index_merge(idx_fd, &hdr);
+    }
+    io_close(idx_fd);
+    pthread_mutex_unlock(&note_lock);
+    unlock_index(fd);
+    return rc;
+}
+
+/*
+ *  index_drop
+ *
+ *  Removes the index, the next lookup by last name builds a fresh one.
+ */
+void index_drop(void)
+{
+    io_unlink(LNAME_IDX_FILE);
+}
+
+/*
+ *  index_lookup
+ *      idx_fd:  descriptor of the index file
+ *      key:     last name, or prefix of it, to look for
+ *      prefix:  match names starting with key instead of equal to it
+ *      out:     receives a malloc()ed array of matching entries, sorted
+ *      n:       receives the number of matches
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int index_lookup(int idx_fd, const char *key, bool prefix, idx_entry_t **out, int *n)
+{
+    idx_header_t hdr;
+    idx_entry_t page[IDX_PAGE_ENTRIES];
+    idx_entry_t *hits = NULL, *delta = NULL;
+    char *fences = NULL;
+    int nhits = 0, cap = 0, nd = 0;
+
+    *out = NULL;
+    *n = 0;
+
+    if (io_pread(idx_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != IDX_MAGIC)
+        return ERR_DB_FILE;
+
+    ssize_t fence_len = (ssize_t)hdr.fence_count * IDX_KEY_LEN;
+    fences = malloc(fence_len ? fence_len : 1);
+    if (fences == NULL || io_pread(idx_fd, fences, fence_len, sizeof(hdr)) != fence_len)
+        goto fail;
+
+    // first page whose fence is not below the key, the matches may start
+    // at the end of the page before it
+    int lo = 0, hi = hdr.fence_count;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (cmp_key(fences + (size_t)mid * IDX_KEY_LEN, key, prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int p = (lo > 0) ? lo - 1 : 0;
+
+    bool done = false;
+    for (; !done && p < hdr.fence_count; p++)
+    {
+        int first = p * IDX_PAGE_ENTRIES;
+        int cnt = (hdr.run_count - first < IDX_PAGE_ENTRIES) ? hdr.run_count - first : IDX_PAGE_ENTRIES;
+        ssize_t len = (ssize_t)cnt * sizeof(idx_entry_t);
+        if (io_pread(idx_fd, page, len, IDX_RUN_OFF(hdr.fence_count) + (off_t)first * sizeof(idx_entry_t)) != len)
+            goto fail;
+
+        for (int i = 0; i < cnt; i++)
+        {
+            int c = cmp_key(page[i].lname, key, prefix);
+            if (c < 0)
+                continue;
+            if (c > 0)
+            {
+                done = true;
+                break;
+            }
+            if (nhits == cap)
+            {
+                cap = cap ? cap * 2 : 64;
+                idx_entry_t *grown = realloc(hits, (size_t)cap * sizeof(idx_entry_t));
+                if (grown == NULL)
+                    goto fail;
+                hits = grown;
+            }
+            hits[nhits++] = page[i];
+        }
+    }
+
+    // the delta log is small, keep the entries of it that concern the key
+    if (read_delta(idx_fd, &hdr, &delta, &nd) != NO_ERROR)
+        goto fail;
+    int keep = 0;
+    for (int i = 0; i < nd; i++)
+    {
+        if (cmp_key(delta[i].lname, key, prefix) == 0)
+            delta[keep++] = delta[i];
+    }
+    if (keep > 0)
+    {
+        idx_entry_t *grown = realloc(hits, ((size_t)nhits + keep) * sizeof(idx_entry_t));
+        if (grown == NULL)
+            goto fail;
+        hits = grown;
+        nhits = apply_delta(hits, nhits, delta, keep);
+        if (nhits < 0)
+            goto fail;
+    }
+
+    free(fences);
+    free(delta);
+    *out = hits;
+    *n = nhits;
+    return NO_ERROR;
+
+fail:
+    free(fences);
+    free(delta);
+    free(hits);
+    return ERR_DB_FILE;
+}
+
+/*
+ *  find_by_lname
+ *      fd:      linux file descriptor
+ *      lname:   last name to look for
+ *      prefix:  print every student whose last name starts with lname
+ *
+ *  Looks the name up in the last name index, building the index first if
+ *  there is none yet, and prints the matching students ordered by last
+ *  name and id in the same format as print_db().
+ *
+ *  returns:  NO_ERROR       at least one student was found
+ *            SRCH_NOT_FOUND no student has that last name
+ *            ERR_DB_FILE    database or index file I/O issue
+ *
+ *  console:  the matching students on success
+ *            M_LNAME_NOT_FND  no student has that last name
+ *            M_ERR_DB_READ    error reading the database or index
+ */
+int find_by_lname(int fd, char *lname, bool prefix)
+{
+    idx_entry_t *hits;
+    int n;
+
+    int idx_fd = io_open(LNAME_IDX_FILE, O_RDONLY);
+    if (idx_fd < 0 && errno == ENOENT && index_build_locked(fd) == NO_ERROR)
+        idx_fd = io_open(LNAME_IDX_FILE, O_RDONLY);
+    if (idx_fd < 0)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    int rc = index_lookup(idx_fd, lname, prefix, &hits, &n);
+    io_close(idx_fd);
+    if (rc != NO_ERROR)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    int first_record = 1;
+    for (int i = 0; i < n; i++)
+    {
+        student_t s;
+        rc = get_student(fd, hits[i].id, &s);
+        if (rc == ERR_DB_FILE)
+        {
+            free(hits);
+            return ERR_DB_FILE;
+        }
+        if (rc != NO_ERROR)
+            continue;
+
+        // never trust the index over the record itself, a name from the
+        // heap is compared in full
+        bool match = cmp_key(s.lname, lname, prefix) == 0;
+        if (name_spilled(s.lname, sizeof(s.lname)))
+        {
+            char full[NAME_HEAP_MAX_LEN + 1];
+            name_get(s.lname, sizeof(s.lname), full);
+            match = (prefix ? strncmp(full, lname, strlen(lname)) : strcmp(full, lname)) == 0;
+        }
+        if (match)
+            print_db_row(&s, &first_record);
+    }
+    free(hits);
+
+    if (first_record)
+    {
+        printf(M_LNAME_NOT_FND, lname);
+        return SRCH_NOT_FOUND;
+    }
+    return NO_ERROR;
+}
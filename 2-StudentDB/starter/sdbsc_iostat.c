@@ -0,0 +1,428 @@
+#define _GNU_SOURCE // RUSAGE_THREAD and fallocate()
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  I/O statistics (-v, SDBSC_STATS=1 or SDBSC_STATS=json).  Every sdbsc
+ *  source makes its file system calls through the io_* wrappers of this
+ *  file.  Switched off they only test io_on before making the call.
+ *  Switched on they time every call and count it, with the bytes it moved,
+ *  against the phase the calling thread is in.
+ *
+ *  The operations mark their phase with IO_PHASE(): open_db(), the single
+ *  and batch gets, adds and deletes, the scans, the formatting and the
+ *  output of print_db() and friends, compress, and backup and restore.
+ *  Anything else is "other".  A phase nested in another one (a scan run
+ *  by a print) is charged to the inner phase, so the wall times of the
+ *  phases add up to the time spent in them.  With -j every thread adds its
+ *  own time, so a parallel phase can take longer than the whole run.  Each
+ *  phase also gets the page faults its thread took while in it, which is
+ *  where the mmap backend and the first touch of fresh buffers show up
+ *  instead of as system calls.
+ *
+ *  The summary goes to stderr when the process exits, as a table or as
+ *  one line of JSON, so the normal output of the operation is unchanged.
+ */
+
+typedef struct io_phase_stats
+{
+    long calls;                 // times the phase was entered
+    long syscalls;
+    long long bytes_read;
+    long long bytes_written;
+    long long sys_ns;           // time inside the system calls
+    long long wall_ns;          // time in the phase, nested phases excluded
+    long faults;                // minor and major page faults
+} io_phase_stats_t;
+
+static const char *io_phase_names[IO_PHASES] = {
+    "other", "open", "get", "add", "delete", "scan", "format", "output", "compress",
+    "backup"};
+
+static bool io_on = false;
+static bool io_json = false;
+static long long io_start_ns;
+static io_phase_stats_t io_stats[IO_PHASES];
+
+// phase of the calling thread and when (and after how many faults) it
+// was entered, 0 until the thread first enters one
+static __thread int io_cur = IO_PHASE_OTHER;
+static __thread long long io_cur_ns;
+static __thread long io_cur_faults;
+
+#define IO_ADD(field, v) __atomic_fetch_add(&(field), (v), __ATOMIC_RELAXED)
+
+static long long io_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long io_faults(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_THREAD, &ru) < 0)
+        return 0;
+    return ru.ru_minflt + ru.ru_majflt;
+}
+
+// charges the time and faults since the last switch to the current phase
+// and moves the thread to next
+static void io_switch(int next)
+{
+    long long now = io_now();
+    long faults = io_faults();
+
+    if (io_cur_ns != 0)
+    {
+        IO_ADD(io_stats[io_cur].wall_ns, now - io_cur_ns);
+        IO_ADD(io_stats[io_cur].faults, faults - io_cur_faults);
+    }
+    io_cur = next;
+    io_cur_ns = now;
+    io_cur_faults = faults;
+}
+
+/*
+ *  io_enter
+ *      phase:  IO_PHASE_* the caller is about to run
+ *
+ *  Use IO_PHASE() rather than calling this, it leaves the phase again when
+ *  the enclosing block ends.
+ *
+ *  returns:  the phase to go back to
+ */
+int io_enter(int phase)
+{
+    if (!io_on)
+        return IO_PHASE_OTHER;
+    int prev = io_cur;
+    IO_ADD(io_stats[phase].calls, 1);
+    io_switch(phase);
+    return prev;
+}
+
+// cleanup handler of IO_PHASE(), returns to the phase io_enter() left
+void io_leave(int *prev)
+{
+    if (io_on)
+        io_switch(*prev);
+}
+
+// counts one system call started at t0 against the current phase
+static void io_count(long long t0, ssize_t rd, ssize_t wr)
+{
+    int err = errno;
+    io_phase_stats_t *ps = &io_stats[io_cur];
+
+    IO_ADD(ps->syscalls, 1);
+    IO_ADD(ps->sys_ns, io_now() - t0);
+    if (rd > 0)
+        IO_ADD(ps->bytes_read, rd);
+    if (wr > 0)
+        IO_ADD(ps->bytes_written, wr);
+    errno = err;
+}
+
+/*
+ *  The wrappers.  Each one makes the call it is named after and, with the
+ *  statistics on, counts it: the result of the read family as bytes read,
+ *  of the write family as bytes written, copy_file_range() as both.
+ */
+int io_open(const char *path, int flags, ...)
+{
+    mode_t mode = 0;
+
+    if (flags & O_CREAT)
+    {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    if (!io_on)
+        return open(path, flags, mode);
+    long long t0 = io_now();
+    int rc = open(path, flags, mode);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+int io_close(int fd)
+{
+    if (!io_on)
+        return close(fd);
+    long long t0 = io_now();
+    int rc = close(fd);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+ssize_t io_read(int fd, void *buf, size_t n)
+{
+    if (!io_on)
+        return read(fd, buf, n);
+    long long t0 = io_now();
+    ssize_t rc = read(fd, buf, n);
+    io_count(t0, rc, 0);
+    return rc;
+}
+
+ssize_t io_write(int fd, const void *buf, size_t n)
+{
+    if (!io_on)
+        return write(fd, buf, n);
+    long long t0 = io_now();
+    ssize_t rc = write(fd, buf, n);
+    io_count(t0, 0, rc);
+    return rc;
+}
+
+ssize_t io_pread(int fd, void *buf, size_t n, off_t off)
+{
+    if (!io_on)
+        return pread(fd, buf, n, off);
+    long long t0 = io_now();
+    ssize_t rc = pread(fd, buf, n, off);
+    io_count(t0, rc, 0);
+    return rc;
+}
+
+ssize_t io_pwrite(int fd, const void *buf, size_t n, off_t off)
+{
+    if (!io_on)
+        return pwrite(fd, buf, n, off);
+    long long t0 = io_now();
+    ssize_t rc = pwrite(fd, buf, n, off);
+    io_count(t0, 0, rc);
+    return rc;
+}
+
+ssize_t io_preadv(int fd, const struct iovec *iov, int cnt, off_t off)
+{
+    if (!io_on)
+        return preadv(fd, iov, cnt, off);
+    long long t0 = io_now();
+    ssize_t rc = preadv(fd, iov, cnt, off);
+    io_count(t0, rc, 0);
+    return rc;
+}
+
+ssize_t io_pwritev(int fd, const struct iovec *iov, int cnt, off_t off)
+{
+    if (!io_on)
+        return pwritev(fd, iov, cnt, off);
+    long long t0 = io_now();
+    ssize_t rc = pwritev(fd, iov, cnt, off);
+    io_count(t0, 0, rc);
+    return rc;
+}
+
+off_t io_lseek(int fd, off_t off, int whence)
+{
+    if (!io_on)
+        return lseek(fd, off, whence);
+    long long t0 = io_now();
+    off_t rc = lseek(fd, off, whence);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+int io_fstat(int fd, struct stat *st)
+{
+    if (!io_on)
+        return fstat(fd, st);
+    long long t0 = io_now();
+    int rc = fstat(fd, st);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+int io_fsync(int fd)
+{
+    if (!io_on)
+        return fsync(fd);
+    long long t0 = io_now();
+    int rc = fsync(fd);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+int io_fdatasync(int fd)
+{
+    if (!io_on)
+        return fdatasync(fd);
+    long long t0 = io_now();
+    int rc = fdatasync(fd);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+int io_ftruncate(int fd, off_t len)
+{
+    if (!io_on)
+        return ftruncate(fd, len);
+    long long t0 = io_now();
+    int rc = ftruncate(fd, len);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+int io_fallocate(int fd, int mode, off_t off, off_t len)
+{
+    if (!io_on)
+        return fallocate(fd, mode, off, len);
+    long long t0 = io_now();
+    int rc = fallocate(fd, mode, off, len);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+ssize_t io_copy_file_range(int in, off_t *in_off, int out, off_t *out_off, size_t n,
+                           unsigned int flags)
+{
+    if (!io_on)
+        return copy_file_range(in, in_off, out, out_off, n, flags);
+    long long t0 = io_now();
+    ssize_t rc = copy_file_range(in, in_off, out, out_off, n, flags);
+    io_count(t0, rc, rc);
+    return rc;
+}
+
+int io_fcntl(int fd, int cmd, void *arg)
+{
+    if (!io_on)
+        return fcntl(fd, cmd, arg);
+    long long t0 = io_now();
+    int rc = fcntl(fd, cmd, arg);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+int io_rename(const char *from, const char *to)
+{
+    if (!io_on)
+        return rename(from, to);
+    long long t0 = io_now();
+    int rc = rename(from, to);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+int io_unlink(const char *path)
+{
+    if (!io_on)
+        return unlink(path);
+    long long t0 = io_now();
+    int rc = unlink(path);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+void *io_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off)
+{
+    if (!io_on)
+        return mmap(addr, len, prot, flags, fd, off);
+    long long t0 = io_now();
+    void *rc = mmap(addr, len, prot, flags, fd, off);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+int io_munmap(void *addr, size_t len)
+{
+    if (!io_on)
+        return munmap(addr, len);
+    long long t0 = io_now();
+    int rc = munmap(addr, len);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+int io_msync(void *addr, size_t len, int flags)
+{
+    if (!io_on)
+        return msync(addr, len, flags);
+    long long t0 = io_now();
+    int rc = msync(addr, len, flags);
+    io_count(t0, 0, 0);
+    return rc;
+}
+
+// atexit() handler, prints the summary
+static void io_stats_report(void)
+{
+    bool first = true;
+
+    // rows still buffered by stdio are output too, and belong above the
+    // summary
+    io_switch(IO_PHASE_OUTPUT);
+    fflush(stdout);
+    io_switch(IO_PHASE_OTHER);
+    long long wall = io_now() - io_start_ns;
+    if (io_json)
+        fprintf(stderr, "{\"wall_ms\":%.3f,\"phases\":{", wall / 1e6);
+    else
+        fprintf(stderr, "%-9s %7s %9s %12s %12s %9s %9s %8s\n", "phase", "calls",
+                "syscalls", "bytes_read", "bytes_written", "sys_ms", "wall_ms", "faults");
+
+    for (int p = 0; p < IO_PHASES; p++)
+    {
+        const io_phase_stats_t *ps = &io_stats[p];
+        if (ps->calls == 0 && ps->syscalls == 0 && p != IO_PHASE_OTHER)
+            continue;
+        if (io_json)
+            fprintf(stderr, "%s\"%s\":{\"calls\":%ld,\"syscalls\":%ld,\"bytes_read\":%lld,"
+                            "\"bytes_written\":%lld,\"sys_ms\":%.3f,\"wall_ms\":%.3f,\"faults\":%ld}",
+                    first ? "" : ",", io_phase_names[p], ps->calls, ps->syscalls, ps->bytes_read,
+                    ps->bytes_written, ps->sys_ns / 1e6, ps->wall_ns / 1e6, ps->faults);
+        else
+            fprintf(stderr, "%-9s %7ld %9ld %12lld %12lld %9.3f %9.3f %8ld\n", io_phase_names[p],
+                    ps->calls, ps->syscalls, ps->bytes_read, ps->bytes_written,
+                    ps->sys_ns / 1e6, ps->wall_ns / 1e6, ps->faults);
+        first = false;
+    }
+    if (io_json)
+        fprintf(stderr, "}}\n");
+    else
+        fprintf(stderr, "total %.3f ms\n", wall / 1e6);
+}
+
+/*
+ *  io_stats_init
+ *      verbose:  -v was given
+ *
+ *  Switches the statistics on for -v or SDBSC_STATS=1 (a table) or
+ *  SDBSC_STATS=json, and arranges for the summary to be printed at exit.
+ *  Called by main() before anything else touches the database.
+ */
+void io_stats_init(bool verbose)
+{
+    const char *env = getenv(IO_STATS_ENV);
+
+    io_json = env != NULL && strcmp(env, "json") == 0;
+    if (!verbose && !io_json && (env == NULL || strcmp(env, "1") != 0))
+        return;
+    io_start_ns = io_now();
+    io_switch(IO_PHASE_OTHER);
+    io_on = true;
+    atexit(io_stats_report);
+}
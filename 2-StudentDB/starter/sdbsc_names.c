@@ -0,0 +1,551 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Long names.  fname and lname are fixed fields of 24 and 32 bytes, and
+ *  every slot stays 64 bytes.  With SDBSC_LONG_NAMES=1 a longer name is
+ *  appended to NAME_HEAP_FILE and its field holds a prefix plus a
+ *  reference into the heap (the encoding is in db.h).  Scans still read
+ *  plain 64 byte slots, and a name is only looked up in the heap when a
+ *  record that references it is printed or compared.
+ *
+ *  Dictionary.  With SDBSC_LNAME_DICT=1 a last name is stored once in
+ *  NAME_DICT_FILE and lname only holds its code.  A roster where every
+ *  student is a doe keeps "doe" once, and a query on lname turns its
+ *  condition into the set of matching codes and then compares integers.
+ *  A slot keeps its 64 bytes, the space is won by compress_db(): once
+ *  every last name is a code it packs the records to DB_PACKED_RECORD_SIZE
+ *  bytes (see db.h).
+ *  The dictionary is read into memory with a hash table on names, new
+ *  entries appended by other processes are picked up when a name or code
+ *  is not found.
+ *
+ *  The heap and the dictionary belong to the database in the same
+ *  directory.  open_db() attaches them to the descriptor, together with
+ *  the database it is the current one of the calling thread
+ *  (names_use()).  student_t carries no descriptor, so the print functions
+ *  and the query filter resolve names through the current database of
+ *  their thread.
+ *
+ *  Appends take a lock on the file, for other processes, and names_lock,
+ *  for the server threads.  A name is in the heap or dictionary before the
+ *  slot that references it is written.  In WAL mode it is also flushed
+ *  first, since the log may bring the slot back after a crash.
+ */
+
+// the name files of one open database
+typedef struct name_files
+{
+    int heap_fd;                // plus 1, 0 while not open
+    int dict_fd;                // plus 1, 0 while not open
+    int dict_count;             // dictionary entries in memory, codes 1 to count
+    int dict_cap;
+    char (*dict)[NAME_DICT_KEY_LEN];
+    int *hash;                  // codes by name, open addressing, 0 is free
+    int hash_cap;
+} name_files_t;
+
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+static name_files_t name_files[DB_MAX_HANDLES];
+static __thread int names_fd = -1;          // current database of the thread
+
+static bool env_on(const char *name)
+{
+    const char *env = getenv(name);
+    return env != NULL && strcmp(env, "1") == 0;
+}
+
+static name_files_t *files_of(int fd)
+{
+    return (fd >= 0 && fd < DB_MAX_HANDLES) ? &name_files[fd] : NULL;
+}
+
+// opens one of the name files of nf on first use, if it exists or create
+// is set.  *slot holds the fd plus 1.
+static int open_name_file(int *slot, const char *path, bool create)
+{
+    if (*slot == 0)
+    {
+        int nfd = io_open(path, O_RDWR | (create ? O_CREAT : 0), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        if (nfd < 0)
+            return ERR_DB_FILE;
+        *slot = nfd + 1;
+    }
+    return *slot - 1;
+}
+
+/*
+ *  names_open
+ *      fd:  database just opened by open_db()
+ *
+ *  Attaches the heap and dictionary next to the database, if there are
+ *  any, and makes fd the current database of the thread.
+ */
+void names_open(int fd)
+{
+    name_files_t *nf = files_of(fd);
+
+    pthread_mutex_lock(&names_lock);
+    if (nf != NULL)
+    {
+        open_name_file(&nf->heap_fd, NAME_HEAP_FILE, false);
+        open_name_file(&nf->dict_fd, NAME_DICT_FILE, false);
+    }
+    pthread_mutex_unlock(&names_lock);
+    names_use(fd);
+}
+
+// detaches the name files of a database closed by close_db()
+void names_close(int fd)
+{
+    name_files_t *nf = files_of(fd);
+
+    pthread_mutex_lock(&names_lock);
+    if (nf != NULL)
+    {
+        if (nf->heap_fd != 0)
+            io_close(nf->heap_fd - 1);
+        if (nf->dict_fd != 0)
+            io_close(nf->dict_fd - 1);
+        free(nf->dict);
+        free(nf->hash);
+        memset(nf, 0, sizeof(*nf));
+    }
+    pthread_mutex_unlock(&names_lock);
+    if (names_fd == fd)
+        names_fd = -1;
+}
+
+// makes fd the database whose name files this thread resolves names from
+void names_use(int fd)
+{
+    names_fd = fd;
+}
+
+// code of a dictionary-encoded field, 0 if it holds no code
+static uint32_t field_code(const char *field)
+{
+    uint32_t code = 0;
+
+    if (field[0] == '\0')
+        memcpy(&code, field + 1, NAME_CODE_LEN);
+    return code;
+}
+
+// heap offset of a field that references the heap, 0 if it does not
+static uint32_t field_heap_off(const char *field, size_t size)
+{
+    uint32_t off = 0;
+
+    if (field[0] != '\0' && field[NAME_REF_OFF(size)] == '\0')
+        memcpy(&off, field + size - NAME_REF_LEN, NAME_REF_LEN);
+    return off;
+}
+
+/*
+ *  name_spilled
+ *      field:  fname or lname of a record
+ *      size:   sizeof() the field
+ *
+ *  returns:  true if the name is not in the field itself but in the heap
+ *            or the dictionary
+ */
+bool name_spilled(const char *field, size_t size)
+{
+    return field_code(field) != 0 || field_heap_off(field, size) != 0;
+}
+
+/*
+ *  Heap
+ */
+
+// heap_append() under the locks: returns the offset of the new entry or 0
+static uint32_t heap_append_locked(int hfd, const char *name, size_t len)
+{
+    name_heap_header_t hdr = {0};
+    unsigned char entry[sizeof(name_entry_t) + NAME_HEAP_MAX_LEN];
+    name_entry_t *e = (name_entry_t *)entry;
+    struct stat st;
+
+    if (io_fstat(hfd, &st) < 0)
+        return 0;
+    off_t off = st.st_size;
+    if (off == 0)
+    {
+        hdr.magic = NAME_HEAP_MAGIC;
+        if (io_pwrite(hfd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            return 0;
+        off = sizeof(hdr);
+    }
+
+    ssize_t elen = sizeof(name_entry_t) + len;
+    if (off + elen > UINT32_MAX)
+        return 0;
+    e->len = (unsigned short)len;
+    memcpy(e->name, name, len);
+    if (io_pwrite(hfd, entry, elen, off) != elen)
+        return 0;
+
+    // the log may replay the slot, never let it outlive the name
+    if (env_on(WAL_ENV) && io_fdatasync(hfd) < 0)
+        return 0;
+    return (uint32_t)off;
+}
+
+// appends name to the heap of fd, returns the offset of its entry or 0
+static uint32_t heap_append(int fd, const char *name, size_t len)
+{
+    name_files_t *nf = files_of(fd);
+    uint32_t off = 0;
+
+    if (nf == NULL)
+        return 0;
+    pthread_mutex_lock(&names_lock);
+    int hfd = open_name_file(&nf->heap_fd, NAME_HEAP_FILE, true);
+    if (hfd >= 0 && fcntl_lock(hfd, F_WRLCK, 0, 0) == NO_ERROR)
+    {
+        off = heap_append_locked(hfd, name, len);
+        fcntl_lock(hfd, F_UNLCK, 0, 0);
+    }
+    pthread_mutex_unlock(&names_lock);
+    return off;
+}
+
+// copies the heap entry at off into buf, leaves buf alone if it cannot
+static void heap_read(name_files_t *nf, uint32_t off, char *buf)
+{
+    unsigned char entry[sizeof(name_entry_t) + NAME_HEAP_MAX_LEN];
+    name_entry_t *e = (name_entry_t *)entry;
+
+    pthread_mutex_lock(&names_lock);
+    int hfd = open_name_file(&nf->heap_fd, NAME_HEAP_FILE, false);
+    pthread_mutex_unlock(&names_lock);
+    if (hfd < 0)
+        return;
+
+    ssize_t got = io_pread(hfd, entry, sizeof(entry), off);
+    if (got >= (ssize_t)sizeof(name_entry_t) && e->len <= NAME_HEAP_MAX_LEN &&
+        got >= (ssize_t)(sizeof(name_entry_t) + e->len))
+    {
+        memcpy(buf, e->name, e->len);
+        buf[e->len] = '\0';
+    }
+}
+
+/*
+ *  Dictionary
+ */
+
+// FNV-1a of a dictionary key
+static uint32_t dict_hash(const char *key)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < NAME_DICT_KEY_LEN && key[i] != '\0'; i++)
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    return h;
+}
+
+static void dict_hash_insert(name_files_t *nf, int code)
+{
+    uint32_t i = dict_hash(nf->dict[code - 1]) & (nf->hash_cap - 1);
+
+    while (nf->hash[i] != 0)
+        i = (i + 1) & (nf->hash_cap - 1);
+    nf->hash[i] = code;
+}
+
+// code of key among the entries in memory, 0 if there is none
+static int dict_find(const name_files_t *nf, const char *key)
+{
+    if (nf->hash_cap == 0)
+        return 0;
+    uint32_t i = dict_hash(key) & (nf->hash_cap - 1);
+    while (nf->hash[i] != 0)
+    {
+        if (strncmp(nf->dict[nf->hash[i] - 1], key, NAME_DICT_KEY_LEN) == 0)
+            return nf->hash[i];
+        i = (i + 1) & (nf->hash_cap - 1);
+    }
+    return 0;
+}
+
+// reads the entries appended to the dictionary since the last call, the
+// caller holds names_lock.  Returns NO_ERROR or ERR_DB_FILE.
+static int dict_refresh(name_files_t *nf, int dfd)
+{
+    struct stat st;
+
+    if (io_fstat(dfd, &st) < 0)
+        return ERR_DB_FILE;
+    long n = (st.st_size > (off_t)sizeof(name_dict_header_t))
+                 ? (st.st_size - sizeof(name_dict_header_t)) / NAME_DICT_KEY_LEN
+                 : 0;
+    if (n <= nf->dict_count)
+        return NO_ERROR;
+
+    if (n > nf->dict_cap)
+    {
+        int cap = nf->dict_cap ? nf->dict_cap : 256;
+        while (cap < n)
+            cap *= 2;
+        char(*grown)[NAME_DICT_KEY_LEN] = realloc(nf->dict, (size_t)cap * NAME_DICT_KEY_LEN);
+        if (grown == NULL)
+            return ERR_DB_FILE;
+        nf->dict = grown;
+        nf->dict_cap = cap;
+    }
+    size_t want = (size_t)(n - nf->dict_count) * NAME_DICT_KEY_LEN;
+    off_t off = sizeof(name_dict_header_t) + (off_t)nf->dict_count * NAME_DICT_KEY_LEN;
+    if (io_pread(dfd, nf->dict[nf->dict_count], want, off) != (ssize_t)want)
+        return ERR_DB_FILE;
+
+    // keep the table at most half full
+    if (2 * n > nf->hash_cap)
+    {
+        int cap = nf->hash_cap ? nf->hash_cap : 512;
+        while (cap < 2 * n)
+            cap *= 2;
+        int *table = calloc(cap, sizeof(int));
+        if (table == NULL)
+            return ERR_DB_FILE;
+        free(nf->hash);
+        nf->hash = table;
+        nf->hash_cap = cap;
+        for (int c = 1; c <= nf->dict_count; c++)
+            dict_hash_insert(nf, c);
+    }
+    for (int c = nf->dict_count + 1; c <= n; c++)
+        dict_hash_insert(nf, c);
+    nf->dict_count = (int)n;
+    return NO_ERROR;
+}
+
+/*
+ *  dict_code
+ *      fd:   linux file descriptor of the database
+ *      key:  name, NAME_DICT_KEY_LEN bytes zero padded
+ *
+ *  Finds the code of the name, adding it to the dictionary if it is new.
+ *
+ *  returns:  the code or 0 on error
+ */
+static uint32_t dict_code(int fd, const char *key)
+{
+    name_dict_header_t hdr = {0};
+    name_files_t *nf = files_of(fd);
+    int code = 0;
+
+    if (nf == NULL)
+        return 0;
+    pthread_mutex_lock(&names_lock);
+    int dfd = open_name_file(&nf->dict_fd, NAME_DICT_FILE, true);
+    if (dfd >= 0)
+        code = dict_find(nf, key);
+    if (dfd >= 0 && code == 0 && fcntl_lock(dfd, F_WRLCK, 0, 0) == NO_ERROR)
+    {
+        // another process may have added it meanwhile
+        if (dict_refresh(nf, dfd) == NO_ERROR)
+            code = dict_find(nf, key);
+        if (code == 0)
+        {
+            off_t off = sizeof(hdr) + (off_t)nf->dict_count * NAME_DICT_KEY_LEN;
+            hdr.magic = NAME_DICT_MAGIC;
+            bool ok = (nf->dict_count > 0 || io_pwrite(dfd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) &&
+                      io_pwrite(dfd, key, NAME_DICT_KEY_LEN, off) == NAME_DICT_KEY_LEN &&
+                      (!env_on(WAL_ENV) || io_fdatasync(dfd) == 0) &&
+                      dict_refresh(nf, dfd) == NO_ERROR;
+            code = ok ? dict_find(nf, key) : 0;
+        }
+        fcntl_lock(dfd, F_UNLCK, 0, 0);
+    }
+    pthread_mutex_unlock(&names_lock);
+    return (uint32_t)code;
+}
+
+// copies the dictionary entry of code into buf, leaves buf alone if there
+// is none
+static void dict_read(name_files_t *nf, uint32_t code, char *buf)
+{
+    pthread_mutex_lock(&names_lock);
+    int dfd = open_name_file(&nf->dict_fd, NAME_DICT_FILE, false);
+    if (dfd >= 0 && code > (uint32_t)nf->dict_count)
+        dict_refresh(nf, dfd);
+    if (code <= (uint32_t)nf->dict_count)
+    {
+        memcpy(buf, nf->dict[code - 1], NAME_DICT_KEY_LEN);
+        buf[NAME_DICT_KEY_LEN] = '\0';
+    }
+    pthread_mutex_unlock(&names_lock);
+}
+
+/*
+ *  dict_select
+ *      keep:   called with every name of the dictionary
+ *      arg:    passed on to keep
+ *      ncodes: receives the number of codes the result covers
+ *
+ *  Evaluates a condition on names once per dictionary entry of the current
+ *  database, so it can be checked on the codes of the records.
+ *
+ *  returns:  a malloc()ed bitmap with bit c set if keep() accepted the
+ *            name of code c, or NULL if there is no dictionary
+ */
+unsigned char *dict_select(bool (*keep)(const char *name, const void *arg), const void *arg,
+                           int *ncodes)
+{
+    name_files_t *nf = files_of(names_fd);
+    unsigned char *bits = NULL;
+    char name[NAME_DICT_KEY_LEN + 1];
+
+    *ncodes = 0;
+    if (nf == NULL)
+        return NULL;
+    pthread_mutex_lock(&names_lock);
+    int dfd = open_name_file(&nf->dict_fd, NAME_DICT_FILE, false);
+    if (dfd >= 0 && dict_refresh(nf, dfd) == NO_ERROR)
+        bits = calloc(nf->dict_count / 8 + 1, 1);
+    for (int c = 1; bits != NULL && c <= nf->dict_count; c++)
+    {
+        memcpy(name, nf->dict[c - 1], NAME_DICT_KEY_LEN);
+        name[NAME_DICT_KEY_LEN] = '\0';
+        if (keep(name, arg))
+            bits[c / 8] |= 1u << (c % 8);
+    }
+    if (bits != NULL)
+        *ncodes = nf->dict_count;
+    pthread_mutex_unlock(&names_lock);
+    return bits;
+}
+
+// dictionary code of a field, 0 if it is not encoded
+int name_code(const char *field)
+{
+    return (int)field_code(field);
+}
+
+/*
+ *  name_store
+ *      fd:     linux file descriptor of the database
+ *      name:   name to store
+ *      field:  fname or lname of the record being built
+ *      size:   sizeof() the field
+ *      dict:   the field may be dictionary-encoded (lname)
+ *
+ *  Fills the field like strncpy() did, unless the name is too long for it
+ *  and long names are on: then it goes to the heap (cut at
+ *  NAME_HEAP_MAX_LEN) and the field references it.  Otherwise, with the
+ *  dictionary on, the field gets the code of the name.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE if the heap or dictionary could not
+ *            be written
+ */
+int name_store(int fd, const char *name, char *field, size_t size, bool dict)
+{
+    size_t len = strlen(name);
+
+    memset(field, 0, size);
+    if (len > size && env_on(NAME_HEAP_ENV))
+    {
+        if (len > NAME_HEAP_MAX_LEN)
+            len = NAME_HEAP_MAX_LEN;
+        uint32_t off = heap_append(fd, name, len);
+        if (off == 0)
+            return ERR_DB_FILE;
+        memcpy(field, name, NAME_REF_OFF(size));
+        memcpy(field + size - NAME_REF_LEN, &off, NAME_REF_LEN);
+        return NO_ERROR;
+    }
+
+    strncpy(field, name, size);
+    if (dict && len > 0 && size == NAME_DICT_KEY_LEN && env_on(NAME_DICT_ENV))
+    {
+        uint32_t code = dict_code(fd, field);
+        if (code == 0)
+            return ERR_DB_FILE;
+        memset(field, 0, size);
+        memcpy(field + 1, &code, NAME_CODE_LEN);
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  name_get
+ *      field:  fname or lname of a record
+ *      size:   sizeof() the field
+ *      buf:    room for NAME_HEAP_MAX_LEN + 1 bytes
+ *
+ *  Copies the full name into buf, from the heap or the dictionary of the
+ *  current database if the field references them.  If the heap cannot be
+ *  read the prefix in the field is all there is, an unknown code reads as
+ *  an empty name.
+ *
+ *  returns:  buf
+ */
+char *name_get(const char *field, size_t size, char *buf)
+{
+    name_files_t *nf = files_of(names_fd);
+    uint32_t code = field_code(field);
+    uint32_t off = field_heap_off(field, size);
+
+    if (code == 0 && off == 0)
+    {
+        memcpy(buf, field, size);
+        buf[size] = '\0';
+        return buf;
+    }
+
+    buf[0] = '\0';
+    if (off != 0)
+        strcpy(buf, field);
+    if (nf != NULL && code != 0)
+        dict_read(nf, code, buf);
+    else if (nf != NULL)
+        heap_read(nf, off, buf);
+    return buf;
+}
+
+/*
+ *  name_copy
+ *      field:  fname or lname of a record
+ *      size:   sizeof() the field
+ *      out:    receives the first n bytes of the full name, zero padded
+ *      n:      bytes of out
+ *
+ *  For keys made from names, like those of the last name index.
+ */
+void name_copy(const char *field, size_t size, char *out, size_t n)
+{
+    char buf[NAME_HEAP_MAX_LEN + 1];
+
+    if (!name_spilled(field, size) && n == size)
+    {
+        memcpy(out, field, n);
+        return;
+    }
+    strncpy(out, name_get(field, size, buf), n);
+}
+
+/*
+ *  names_drop
+ *
+ *  Removes the heap and the dictionary, -z calls it after emptying the
+ *  database.
+ */
+void names_drop(void)
+{
+    io_unlink(NAME_HEAP_FILE);
+    io_unlink(NAME_DICT_FILE);
+}
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Query filter (-q).  A query is a list of conditions joined by "and":
+ *
+ *      gpa>=350 and lname=doe and id<5000
+ *
+ *  id and gpa take = != < <= > >=, a gpa may also be written as 3.50.
+ *  fname and lname take = and !=, a value ending in * matches names
+ *  starting with it.  Names kept in the heap (see sdbsc_names.c) compare
+ *  in full, but only records whose prefix matches read the heap.  A
+ *  condition on dictionary-encoded last names is evaluated once per
+ *  dictionary entry before the scan, the records are then checked by
+ *  looking up their code in the resulting bitmap.
+ *
+ *  query_compile() turns the text into a query_t once: the comparisons on
+ *  id and on gpa fold into one range each, the != on them into short
+ *  lists, and only the name conditions are kept as they are.  The id range
+ *  is pushed down into the scan (scan_open_range()), so only the part of
+ *  the file holding those ids is read.  query_match() then checks the
+ *  integer conditions before it compares any name.
+ */
+
+typedef struct name_pred
+{
+    size_t off;                 // offsetof() the field in student_t
+    size_t size;                // sizeof() the field
+    bool negate;
+    bool prefix;
+    size_t len;                 // length of value
+    char value[NAME_HEAP_MAX_LEN + 1];
+    unsigned char *codes;       // bit c set if dictionary code c matches
+    int ncodes;                 // codes covered by the bitmap
+} name_pred_t;
+
+typedef struct query
+{
+    int id_lo, id_hi;
+    int gpa_lo, gpa_hi;
+    int id_ne[QUERY_MAX_TERMS];
+    int n_id_ne;
+    int gpa_ne[QUERY_MAX_TERMS];
+    int n_gpa_ne;
+    name_pred_t names[QUERY_MAX_TERMS];
+    int n_names;
+} query_t;
+
+// narrows [*lo, *hi] by "field op v", != goes to the ne list
+static bool fold_int(const char *op, long v, int *lo, int *hi, int *ne, int *n_ne)
+{
+    long l = *lo, h = *hi;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+    {
+        l = (v > l) ? v : l;
+        h = (v < h) ? v : h;
+    }
+    else if (strcmp(op, "<") == 0)
+        h = (v - 1 < h) ? v - 1 : h;
+    else if (strcmp(op, "<=") == 0)
+        h = (v < h) ? v : h;
+    else if (strcmp(op, ">") == 0)
+        l = (v + 1 > l) ? v + 1 : l;
+    else if (strcmp(op, ">=") == 0)
+        l = (v > l) ? v : l;
+    else if (strcmp(op, "!=") == 0)
+    {
+        if (v >= INT_MIN && v <= INT_MAX)
+            ne[(*n_ne)++] = (int)v;
+        return true;
+    }
+    else
+        return false;
+
+    // an empty range is fine, nothing matches
+    *lo = (l < INT_MIN) ? INT_MIN : (l > INT_MAX) ? INT_MAX : (int)l;
+    *hi = (h < INT_MIN) ? INT_MIN : (h > INT_MAX) ? INT_MAX : (int)h;
+    if (l > h)
+    {
+        *lo = 1;
+        *hi = 0;
+    }
+    return true;
+}
+
+/*
+ *  query_compile
+ *      expr:  the query text
+ *      q:     receives the compiled query
+ *      bad:   receives where the text stopped making sense on error
+ *
+ *  returns:  NO_ERROR or ERR_DB_OP if the text is not a valid query
+ */
+static int query_compile(const char *expr, query_t *q, const char **bad)
+{
+    const char *p = expr;
+    int terms = 0;
+
+    memset(q, 0, sizeof(*q));
+    q->id_lo = MIN_STD_ID;
+    q->id_hi = INT_MAX;
+    q->gpa_lo = INT_MIN;
+    q->gpa_hi = INT_MAX;
+
+    for (;;)
+    {
+        char field[8] = "", op[3] = "", value[NAME_HEAP_MAX_LEN + 1] = "";
+        int n;
+
+        while (isspace((unsigned char)*p))
+            p++;
+        *bad = p;
+        if (terms == QUERY_MAX_TERMS ||
+            sscanf(p, "%7[a-z]%n", field, &n) != 1)
+            return ERR_DB_OP;
+        p += n;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (sscanf(p, "%2[=!<>]%n", op, &n) != 1)
+            return ERR_DB_OP;
+        p += n;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (sscanf(p, "%255s%n", value, &n) != 1) // NAME_HEAP_MAX_LEN
+            return ERR_DB_OP;
+        p += n;
+        terms++;
+
+        if (strcmp(field, "id") == 0 || strcmp(field, "gpa") == 0)
+        {
+            bool is_id = field[0] == 'i';
+            char *end;
+            long v;
+
+            if (!is_id && strchr(value, '.') != NULL)
+            {
+                double gpa = strtod(value, &end);
+                v = (long)(gpa * 100.0 + ((gpa < 0) ? -0.5 : 0.5));
+            }
+            else
+            {
+                v = strtol(value, &end, 10);
+            }
+            if (*end != '\0' || end == value)
+                return ERR_DB_OP;
+            bool ok = is_id ? fold_int(op, v, &q->id_lo, &q->id_hi, q->id_ne, &q->n_id_ne)
+                            : fold_int(op, v, &q->gpa_lo, &q->gpa_hi, q->gpa_ne, &q->n_gpa_ne);
+            if (!ok)
+                return ERR_DB_OP;
+        }
+        else if (strcmp(field, "fname") == 0 || strcmp(field, "lname") == 0)
+        {
+            name_pred_t *np = &q->names[q->n_names++];
+            bool is_fname = field[0] == 'f';
+
+            np->off = is_fname ? offsetof(student_t, fname) : offsetof(student_t, lname);
+            np->size = is_fname ? sizeof(((student_t *)0)->fname) : sizeof(((student_t *)0)->lname);
+            if (strcmp(op, "!=") == 0)
+                np->negate = true;
+            else if (strcmp(op, "=") != 0 && strcmp(op, "==") != 0)
+                return ERR_DB_OP;
+
+            np->len = strlen(value);
+            if (np->len > 0 && value[np->len - 1] == '*')
+            {
+                np->prefix = true;
+                np->len--;
+            }
+            memcpy(np->value, value, np->len);
+        }
+        else
+        {
+            return ERR_DB_OP;
+        }
+
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0')
+            return NO_ERROR;
+        *bad = p;
+        if (strncasecmp(p, "and", 3) != 0 || !isspace((unsigned char)p[3]))
+            return ERR_DB_OP;
+        p += 3;
+    }
+}
+
+// name condition np against a full name of len bytes
+static bool name_value_match(const name_pred_t *np, const char *name, size_t len)
+{
+    if (np->prefix)
+        return len >= np->len && memcmp(name, np->value, np->len) == 0;
+    return len == np->len && memcmp(name, np->value, len) == 0;
+}
+
+// dict_select() callback
+static bool dict_name_match(const char *name, const void *arg)
+{
+    return name_value_match(arg, name, strlen(name));
+}
+
+// name condition np against the field of a record
+static bool name_match(const name_pred_t *np, const char *field)
+{
+    char full[NAME_HEAP_MAX_LEN + 1];
+    const char *name = field;
+    size_t len = strnlen(field, np->size);
+
+    // codes added after the bitmap was made take the long way
+    int code = (np->codes != NULL) ? name_code(field) : 0;
+    if (code != 0 && code <= np->ncodes)
+        return (np->codes[code / 8] >> (code % 8)) & 1;
+
+    if (name_spilled(field, np->size))
+    {
+        // the prefix in the slot rules most records out without the heap
+        len = strlen(field);
+        if (strncmp(field, np->value, (len < np->len) ? len : np->len) != 0)
+            return false;
+        name = name_get(field, np->size, full);
+        len = strlen(name);
+    }
+    return name_value_match(np, name, len);
+}
+
+/*
+ *  query_match
+ *      s:    live record of the scan
+ *      arg:  the compiled query
+ *
+ *  The id range was pushed down into the scan, so the cheapest checks
+ *  left are the gpa range and the != lists, the names come last.
+ *
+ *  returns:  true if s satisfies every condition
+ */
+static bool query_match(const student_t *s, const void *arg)
+{
+    const query_t *q = arg;
+
+    if (s->gpa < q->gpa_lo || s->gpa > q->gpa_hi)
+        return false;
+    for (int i = 0; i < q->n_gpa_ne; i++)
+        if (s->gpa == q->gpa_ne[i])
+            return false;
+    for (int i = 0; i < q->n_id_ne; i++)
+        if (s->id == q->id_ne[i])
+            return false;
+
+    for (int i = 0; i < q->n_names; i++)
+    {
+        const name_pred_t *np = &q->names[i];
+        bool eq = name_match(np, (const char *)s + np->off);
+        if (eq == np->negate)
+            return false;
+    }
+    return true;
+}
+
+/*
+ *  query_db
+ *      fd:    linux file descriptor
+ *      expr:  query text, see the top of this file
+ *
+ *  Prints the students that satisfy the query in the print_db() format.
+ *
+ *  returns:  NO_ERROR, ERR_DB_OP if the query cannot be parsed or
+ *            ERR_DB_FILE
+ *
+ *  console:  the matching rows or M_QUERY_NO_MATCH, M_ERR_QUERY or
+ *            M_ERR_DB_READ on error
+ */
+int query_db(int fd, const char *expr)
+{
+    const char *bad;
+    db_scan_t sc;
+    query_t q;
+
+    if (query_compile(expr, &q, &bad) != NO_ERROR)
+    {
+        printf(M_ERR_QUERY, bad);
+        return ERR_DB_OP;
+    }
+
+    for (int i = 0; i < q.n_names; i++)
+        if (q.names[i].off == offsetof(student_t, lname))
+            q.names[i].codes = dict_select(dict_name_match, &q.names[i], &q.names[i].ncodes);
+
+    int rows = 0;
+    if (q.id_lo <= q.id_hi && scan_open_range(&sc, fd, 0, q.id_lo, q.id_hi) != NO_ERROR)
+        rows = -1;
+    else if (q.id_lo <= q.id_hi)
+    {
+        rows = print_scan(&sc, query_match, &q);
+        scan_close(&sc);
+    }
+    for (int i = 0; i < q.n_names; i++)
+        free(q.names[i].codes);
+
+    if (rows < 0)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    if (rows == 0)
+        printf(M_QUERY_NO_MATCH);
+    return NO_ERROR;
+}
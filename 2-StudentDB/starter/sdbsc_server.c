@@ -0,0 +1,608 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Server mode.  start_server() keeps the database open on one fd and
+ *  accepts connections on a unix domain socket.  Its thread poll()s every
+ *  idle connection, and a connection with input is queued for a fixed pool
+ *  of worker threads.  A worker answers the requests that arrived, then
+ *  hands the connection back to poll(), so workers serve requests rather
+ *  than connections and any number of clients up to SDB_MAX_CONNS share
+ *  them.  A client past that limit gets M_ERR_SRV_BUSY and is closed.  A
+ *  request is one line of text:
+ *
+ *      a id first_name last_name gpa    adds a student
+ *      f id                             finds and prints a student
+ *      d id                             deletes a student
+ *      c                                counts the records
+ *      exit                             closes the connection
+ *      stop-server                      stops the server
+ *
+ *  and the reply is the text the matching command line option would print,
+ *  followed by SDB_EOF_CHAR.
+ *
+ *  All workers share the database fd.  Records are moved with pread() and
+ *  pwrite() (see share_db()), so the only thing to coordinate is access to
+ *  the same id: ids are split in stripes of SDB_STRIPE_IDS, each guarded by
+ *  a reader/writer lock.  Lookups take it shared, add and delete exclusive
+ *  so the duplicate check and the write cannot be split by another add.
+ *  The workers share one open file description, so their OFD locks do not
+ *  exclude each other, the stripes do that.  Add and delete also take the
+ *  slot lock of the id like the command line does (lock_slots()), which
+ *  keeps out other processes and moves fd to a file that compress_db()
+ *  renamed over the database meanwhile.
+ */
+
+#define SDB_STRIPES (MAX_STD_ID / SDB_STRIPE_IDS + 1)
+
+typedef struct conn
+{
+    int sock;                   // -1 for a free entry
+    bool busy;                  // queued for or served by a worker
+    int used;                   // bytes of a partial request in buf
+    char *buf;
+} conn_t;
+
+typedef struct server
+{
+    int db_fd;
+    int svr_socket;
+    char *sock_path;
+    int wake[2];                // pipe, wakes up the poll() loop
+    pthread_mutex_t lock;       // guards everything below
+    pthread_cond_t ready;       // signaled when a connection is queued
+    conn_t conns[SDB_MAX_CONNS];
+    int queue[SDB_MAX_CONNS];   // connections with input waiting for a worker
+    int head;
+    int queued;
+    bool stopping;
+} server_t;
+
+static server_t server;
+static pthread_rwlock_t stripes[SDB_STRIPES];
+static volatile sig_atomic_t stop_signal = 0;
+
+static void on_stop_signal(int sig)
+{
+    (void)sig;
+    stop_signal = 1;
+}
+
+static pthread_rwlock_t *stripe_of(int id)
+{
+    return &stripes[id / SDB_STRIPE_IDS];
+}
+
+// wakes up the poll() loop to look at the connections again
+static void wake_poll(void)
+{
+    char c = 0;
+    while (write(server.wake[1], &c, 1) < 0 && errno == EINTR)
+        ;
+}
+
+/*
+ *  request_stop
+ *
+ *  Marks the server as stopping and wakes everybody up: the poll() loop
+ *  through its pipe and idle workers through the condition.  Workers
+ *  finish the requests they are answering.
+ */
+static void request_stop(void)
+{
+    pthread_mutex_lock(&server.lock);
+    if (!server.stopping)
+    {
+        server.stopping = true;
+        pthread_cond_broadcast(&server.ready);
+        wake_poll();
+    }
+    pthread_mutex_unlock(&server.lock);
+}
+
+/*
+ *  send_reply
+ *      cli_socket:  connection to the client
+ *      buff:        reply text
+ *      len:         length of the reply text
+ *
+ *  Sends the reply followed by SDB_EOF_CHAR.
+ *
+ *  returns:  NO_ERROR or ERR_DB_OP if the client went away
+ */
+static int send_reply(int cli_socket, char *buff, int len)
+{
+    buff[len++] = SDB_EOF_CHAR;
+    for (int sent = 0; sent < len;)
+    {
+        ssize_t n = send(cli_socket, buff + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return ERR_DB_OP;
+        }
+        sent += n;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  exec_request
+ *      line:  one request, without the newline
+ *      rsp:   buffer of SDB_COMM_BUFF_SZ bytes for the reply
+ *      len:   receives the length of the reply
+ *
+ *  Runs one request against the shared database.
+ *
+ *  returns:  NO_ERROR to keep serving the client, SRCH_NOT_FOUND on exit
+ *            and ERR_DB_OP on stop-server
+ */
+static int exec_request(char *line, char *rsp, int *len)
+{
+    char fname[NAME_HEAP_MAX_LEN + 1];
+    char lname[NAME_HEAP_MAX_LEN + 1];
+    char cmd[16], extra;
+    const char *msg;
+    student_t student;
+    int id, gpa, rc;
+    int fd = server.db_fd;
+    int max = SDB_COMM_BUFF_SZ - 1; // room for SDB_EOF_CHAR
+
+    *len = 0;
+    if (sscanf(line, "%15s", cmd) != 1)
+        return NO_ERROR;
+    names_use(fd);
+
+    if (strcmp(cmd, "exit") == 0)
+        return SRCH_NOT_FOUND;
+    if (strcmp(cmd, "stop-server") == 0)
+    {
+        *len = snprintf(rsp, max, M_SRV_STOP_REQ);
+        return ERR_DB_OP;
+    }
+
+    if (strcmp(cmd, "a") == 0 &&
+        sscanf(line, "%*s %d %255s %255s %d %c", &id, fname, lname, &gpa, &extra) == 4)
+    {
+        if (validate_range(id, gpa) != NO_ERROR)
+        {
+            *len = snprintf(rsp, max, M_ERR_STD_RNG);
+            return NO_ERROR;
+        }
+        // the slot lock insert_student() takes keeps out other processes,
+        // the workers share one OFD and are kept out by the stripe
+        pthread_rwlock_wrlock(stripe_of(id));
+        insert_student(fd, id, fname, lname, gpa, &msg);
+        pthread_rwlock_unlock(stripe_of(id));
+        *len = snprintf(rsp, max, msg, id);
+    }
+    else if (strcmp(cmd, "f") == 0 && sscanf(line, "%*s %d %c", &id, &extra) == 1)
+    {
+        if (id < MIN_STD_ID || id > MAX_STD_ID)
+        {
+            *len = snprintf(rsp, max, M_STD_NOT_FND_MSG, id);
+            return NO_ERROR;
+        }
+        pthread_rwlock_rdlock(stripe_of(id));
+        rc = get_student(fd, id, &student);
+        pthread_rwlock_unlock(stripe_of(id));
+
+        if (rc == SRCH_NOT_FOUND)
+            *len = snprintf(rsp, max, M_STD_NOT_FND_MSG, id);
+        else if (rc != NO_ERROR)
+            *len = snprintf(rsp, max, M_ERR_DB_READ);
+        else
+        {
+            *len = snprintf(rsp, max, STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+            *len += format_row(rsp + *len, max - *len, &student);
+        }
+    }
+    else if (strcmp(cmd, "d") == 0 && sscanf(line, "%*s %d %c", &id, &extra) == 1)
+    {
+        if (id < MIN_STD_ID || id > MAX_STD_ID)
+        {
+            *len = snprintf(rsp, max, M_STD_NOT_FND_MSG, id);
+            return NO_ERROR;
+        }
+        pthread_rwlock_wrlock(stripe_of(id));
+        remove_student(fd, id, &msg);
+        pthread_rwlock_unlock(stripe_of(id));
+        *len = snprintf(rsp, max, msg, id);
+    }
+    else if (strcmp(cmd, "c") == 0 && sscanf(line, "%*s %c", &extra) != 1)
+    {
+        // the count is kept in the header (or summed from the slots), no
+        // stripe lock needed, a count taken during writes is a snapshot
+        int count = db_count(fd);
+        if (count < 0)
+            *len = snprintf(rsp, max, M_ERR_DB_READ);
+        else if (count == 0)
+            *len = snprintf(rsp, max, M_DB_EMPTY);
+        else
+            *len = snprintf(rsp, max, M_DB_RECORD_CNT, count);
+    }
+    else
+    {
+        *len = snprintf(rsp, max, M_ERR_SRV_CMD, line);
+    }
+
+    if (*len >= max)
+        *len = max - 1;
+    return NO_ERROR;
+}
+
+/*
+ *  serve_conn
+ *      c:    connection with input waiting
+ *      rsp:  buffer of SDB_COMM_BUFF_SZ bytes for the replies
+ *
+ *  Reads what the client sent and answers every complete request in it.
+ *  Requests may arrive several to a recv() or split over several, they are
+ *  cut at the newlines and a partial one is kept in c for the next turn.
+ *
+ *  returns:  NO_ERROR to keep the connection, SRCH_NOT_FOUND to close it
+ *            (the client went away or sent exit) and ERR_DB_OP if the
+ *            client asked the server to stop
+ */
+static int serve_conn(conn_t *c, char *rsp)
+{
+    ssize_t n = recv(c->sock, c->buf + c->used, SDB_COMM_BUFF_SZ - 1 - c->used, MSG_DONTWAIT);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return NO_ERROR;
+    if (n <= 0)
+        return SRCH_NOT_FOUND;
+    c->used += n;
+
+    int rc = NO_ERROR;
+    char *line = c->buf, *nl;
+    while (rc == NO_ERROR && (nl = memchr(line, '\n', c->buf + c->used - line)) != NULL)
+    {
+        int len;
+        *nl = '\0';
+        if (nl > line && nl[-1] == '\r')
+            nl[-1] = '\0';
+
+        rc = exec_request(line, rsp, &len);
+        if (rc != SRCH_NOT_FOUND && send_reply(c->sock, rsp, len) != NO_ERROR)
+            rc = SRCH_NOT_FOUND;
+        line = nl + 1;
+    }
+
+    // keep the partial request, a line that fills the whole buffer is
+    // thrown away
+    c->used = c->buf + c->used - line;
+    if (c->used == SDB_COMM_BUFF_SZ - 1)
+        c->used = 0;
+    memmove(c->buf, line, c->used);
+    return rc;
+}
+
+// closes the connection and frees its entry, called with server.lock held
+static void drop_conn(conn_t *c)
+{
+    close(c->sock);
+    c->sock = -1;
+    c->busy = false;
+    c->used = 0;
+}
+
+/*
+ *  worker
+ *      arg:  unused
+ *
+ *  Takes connections with input off the queue, answers their requests and
+ *  hands them back to the poll() loop, until the server stops.
+ */
+static void *worker(void *arg)
+{
+    char *rsp_buff = malloc(SDB_COMM_BUFF_SZ);
+
+    (void)arg;
+    while (rsp_buff != NULL)
+    {
+        pthread_mutex_lock(&server.lock);
+        while (server.queued == 0 && !server.stopping)
+            pthread_cond_wait(&server.ready, &server.lock);
+        if (server.stopping)
+        {
+            pthread_mutex_unlock(&server.lock);
+            break;
+        }
+        conn_t *c = &server.conns[server.queue[server.head]];
+        server.head = (server.head + 1) % SDB_MAX_CONNS;
+        server.queued--;
+        pthread_mutex_unlock(&server.lock);
+
+        int rc = serve_conn(c, rsp_buff);
+
+        pthread_mutex_lock(&server.lock);
+        if (rc != NO_ERROR)
+            drop_conn(c);
+        else
+            c->busy = false;
+        wake_poll();
+        pthread_mutex_unlock(&server.lock);
+
+        if (rc == ERR_DB_OP)
+            request_stop();
+    }
+    free(rsp_buff);
+    return NULL;
+}
+
+/*
+ *  accept_conn
+ *      svr_socket:  the listening socket
+ *
+ *  Accepts a connection into a free entry of server.conns.  With all of
+ *  them taken the client is told so and closed.
+ */
+static void accept_conn(int svr_socket)
+{
+    int cli_socket = accept(svr_socket, NULL, NULL);
+    if (cli_socket < 0)
+        return;
+
+    pthread_mutex_lock(&server.lock);
+    for (int i = 0; i < SDB_MAX_CONNS; i++)
+    {
+        conn_t *c = &server.conns[i];
+        if (c->sock >= 0)
+            continue;
+        if (c->buf == NULL && (c->buf = malloc(SDB_COMM_BUFF_SZ)) == NULL)
+            break;
+        c->sock = cli_socket;
+        c->used = 0;
+        pthread_mutex_unlock(&server.lock);
+        return;
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    char busy[sizeof(M_ERR_SRV_BUSY) + 1];
+    int len = snprintf(busy, sizeof(busy) - 1, M_ERR_SRV_BUSY);
+    send_reply(cli_socket, busy, len);
+    close(cli_socket);
+}
+
+/*
+ *  poll_conns
+ *      svr_socket:  the listening socket
+ *
+ *  Loop of the thread of start_server(): waits for new connections and for
+ *  requests on the idle ones and queues those for the workers, until the
+ *  server stops or gets SIGINT or SIGTERM.
+ */
+static void poll_conns(int svr_socket)
+{
+    struct pollfd fds[SDB_MAX_CONNS + 2];
+    int which[SDB_MAX_CONNS + 2];
+
+    while (!stop_signal)
+    {
+        int nfds = 0;
+        fds[nfds++] = (struct pollfd){.fd = svr_socket, .events = POLLIN};
+        fds[nfds++] = (struct pollfd){.fd = server.wake[0], .events = POLLIN};
+
+        pthread_mutex_lock(&server.lock);
+        if (server.stopping)
+        {
+            pthread_mutex_unlock(&server.lock);
+            break;
+        }
+        for (int i = 0; i < SDB_MAX_CONNS; i++)
+        {
+            if (server.conns[i].sock < 0 || server.conns[i].busy)
+                continue;
+            which[nfds] = i;
+            fds[nfds++] = (struct pollfd){.fd = server.conns[i].sock, .events = POLLIN};
+        }
+        pthread_mutex_unlock(&server.lock);
+
+        if (poll(fds, nfds, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents)
+        {
+            char drain[64];
+            while (read(server.wake[0], drain, sizeof(drain)) == sizeof(drain))
+                ;
+        }
+        if (fds[0].revents)
+            accept_conn(svr_socket);
+
+        // input, or a hang up which the worker finds out about, is queued
+        pthread_mutex_lock(&server.lock);
+        for (int k = 2; k < nfds; k++)
+        {
+            if (fds[k].revents == 0)
+                continue;
+            server.conns[which[k]].busy = true;
+            server.queue[(server.head + server.queued) % SDB_MAX_CONNS] = which[k];
+            server.queued++;
+            pthread_cond_signal(&server.ready);
+        }
+        pthread_mutex_unlock(&server.lock);
+    }
+}
+
+/*
+ *  boot_server
+ *      sock_path:  path of the unix domain socket
+ *
+ *  Creates the listening socket.  A socket file left behind by a server
+ *  that is gone is removed, one that still accepts connections is not.
+ *
+ *  returns:  the listening socket, or ERR_DB_OP
+ *
+ *  console:  M_SRV_RUNNING or M_ERR_SRV_START on error
+ */
+static int boot_server(char *sock_path)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr.sun_path))
+    {
+        printf(M_ERR_SRV_START, sock_path);
+        return ERR_DB_OP;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    int svr_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (svr_socket < 0)
+    {
+        printf(M_ERR_SRV_START, sock_path);
+        return ERR_DB_OP;
+    }
+
+    if (connect(svr_socket, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        close(svr_socket);
+        printf(M_SRV_RUNNING, sock_path);
+        return ERR_DB_OP;
+    }
+    close(svr_socket);
+    unlink(sock_path);
+
+    svr_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (svr_socket < 0 ||
+        bind(svr_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(svr_socket, 20) < 0)
+    {
+        if (svr_socket >= 0)
+            close(svr_socket);
+        printf(M_ERR_SRV_START, sock_path);
+        return ERR_DB_OP;
+    }
+    return svr_socket;
+}
+
+// number of worker threads, SDBSC_THREADS or one per online cpu
+static int worker_count(void)
+{
+    const char *env = getenv(SDB_THREADS_ENV);
+    long n = (env != NULL) ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+        n = 1;
+    if (n > SDB_MAX_THREADS)
+        n = SDB_MAX_THREADS;
+    return (int)n;
+}
+
+/*
+ *  start_server
+ *      fd:         linux file descriptor of the open database
+ *      sock_path:  path of the unix domain socket to listen on
+ *
+ *  Serves requests until a client sends stop-server or the process gets
+ *  SIGINT or SIGTERM.  The socket file is removed when the server stops.
+ *
+ *  returns:  NO_ERROR when stopped, ERR_DB_FILE or ERR_DB_OP if the server
+ *            could not be started
+ *
+ *  console:  M_SRV_STARTED and M_SRV_STOPPED, M_ERR_SRV_START on error
+ */
+int start_server(int fd, char *sock_path)
+{
+    pthread_t threads[SDB_MAX_THREADS];
+    struct sigaction sa;
+    sigset_t stop_set, old_set;
+    int nthreads = worker_count();
+    int started = 0;
+
+    if (share_db(fd) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    int svr_socket = boot_server(sock_path);
+    if (svr_socket < 0)
+        return ERR_DB_OP;
+
+    memset(&server, 0, sizeof(server));
+    server.db_fd = fd;
+    server.svr_socket = svr_socket;
+    server.sock_path = sock_path;
+    if (pipe2(server.wake, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        close(svr_socket);
+        unlink(sock_path);
+        printf(M_ERR_SRV_START, sock_path);
+        return ERR_DB_OP;
+    }
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+    for (int i = 0; i < SDB_MAX_CONNS; i++)
+        server.conns[i].sock = -1;
+    for (int i = 0; i < SDB_STRIPES; i++)
+        pthread_rwlock_init(&stripes[i], NULL);
+
+    // the workers inherit a mask that blocks SIGINT/SIGTERM, so the signal
+    // is delivered to this thread and interrupts poll()
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigemptyset(&stop_set);
+    sigaddset(&stop_set, SIGINT);
+    sigaddset(&stop_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_set, &old_set);
+    for (; started < nthreads; started++)
+    {
+        if (pthread_create(&threads[started], NULL, worker, NULL) != 0)
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    if (started == 0)
+    {
+        close(svr_socket);
+        unlink(sock_path);
+        printf(M_ERR_SRV_START, sock_path);
+        return ERR_DB_OP;
+    }
+    printf(M_SRV_STARTED, sock_path, started);
+    fflush(stdout);
+
+    poll_conns(svr_socket);
+
+    request_stop();
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < SDB_MAX_CONNS; i++)
+    {
+        if (server.conns[i].sock >= 0)
+            close(server.conns[i].sock);
+        free(server.conns[i].buf);
+    }
+    close(server.wake[0]);
+    close(server.wake[1]);
+    close(svr_socket);
+    unlink(sock_path);
+    for (int i = 0; i < SDB_STRIPES; i++)
+        pthread_rwlock_destroy(&stripes[i]);
+
+    printf(M_SRV_STOPPED);
+    return NO_ERROR;
+}
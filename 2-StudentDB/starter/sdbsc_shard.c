@@ -0,0 +1,616 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Sharded database.  DB_SHARD_DIR holds one subdirectory per range of
+ *  DB_SHARD_IDS ids, and each of them is a complete version 1 database:
+ *  its own DB_FILE, write-ahead log and last name index.  The header of a
+ *  shard records the first id of its range (base_id, see db.h), so the
+ *  single file code addresses the slots of a shard like any other file.
+ *  Shards are created by the first add into their range, and none of them
+ *  grows past the DB_SHARD_IDS * 64 bytes a plain database may have.
+ *
+ *  An operation on one id changes into the directory of its shard, so the
+ *  locks, the log and compress_db() find the files they expect.  Count and
+ *  print open up to SHARD_BATCH shards at once and work through them on
+ *  several threads, printing in id order.  Compaction needs the directory
+ *  of its shard and runs one shard after the other, it never holds more
+ *  than one shard's records in memory.
+ */
+
+// shard_task() work shared by the threads of one batch
+typedef struct shard_run
+{
+    const int *fds;             // open shards of the batch
+    const int *nums;            // their shard numbers
+    int n;
+    int first_part;             // part number of fds[0] for the task
+    scan_part_t task;
+    void *arg;
+    pthread_mutex_t lock;
+    int next;                   // next shard to hand out
+    int rc;
+} shard_run_t;
+
+static bool shard_dir_exists(void)
+{
+    struct stat st;
+    return stat(DB_SHARD_DIR, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// directory of shard k
+static void shard_path(char *buf, size_t len, int k)
+{
+    snprintf(buf, len, "%s/" DB_SHARD_NAME, DB_SHARD_DIR, k);
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ *  list_shards
+ *      shards:  receives the numbers of the existing shards, room for
+ *               DB_MAX_SHARDS
+ *
+ *  returns:  the number of shards, ascending in shards, or ERR_DB_FILE
+ */
+static int list_shards(int *shards)
+{
+    DIR *dir = opendir(DB_SHARD_DIR);
+    struct dirent *de;
+    int n = 0;
+
+    if (dir == NULL)
+        return ERR_DB_FILE;
+    while ((de = readdir(dir)) != NULL && n < DB_MAX_SHARDS)
+    {
+        char *end;
+        if (!isdigit((unsigned char)de->d_name[0]))
+            continue;
+        long k = strtol(de->d_name, &end, 10);
+        if (*end == '\0' && k >= 0 && k < DB_MAX_SHARDS)
+            shards[n++] = (int)k;
+    }
+    closedir(dir);
+    qsort(shards, n, sizeof(int), cmp_int);
+    return n;
+}
+
+// closes the shard (if fd >= 0) and changes back to where shard_enter()
+// was called
+static void shard_leave(int fd, int home)
+{
+    if (fd >= 0)
+        close_db(fd);
+    if (fchdir(home) < 0)
+        perror("fchdir");
+    io_close(home);
+}
+
+/*
+ *  shard_enter
+ *      k:       shard number
+ *      create:  create the shard if it does not exist yet
+ *      with_log:  open it with the write-ahead log, see open_db()
+ *      home:    receives a descriptor of the directory we came from, for
+ *               shard_leave()
+ *
+ *  Changes into the directory of shard k and opens its database.  A new
+ *  shard gets a version 1 header with its base id, whatever SDBSC_FORMAT
+ *  says.
+ *
+ *  returns:  fd of the shard, SRCH_NOT_FOUND if it does not exist and
+ *            create is false, or ERR_DB_FILE
+ *
+ *  console:  M_ERR_DB_OPEN or M_ERR_DB_CREATE on error
+ */
+static int shard_enter(int k, bool create, bool with_log, int *home)
+{
+    char path[64];
+    struct stat st;
+
+    shard_path(path, sizeof(path), k);
+    if (create && mkdir(path, S_IRWXU | S_IRWXG) < 0 && errno != EEXIST)
+    {
+        printf(M_ERR_DB_CREATE);
+        return ERR_DB_FILE;
+    }
+
+    *home = io_open(".", O_RDONLY | O_DIRECTORY);
+    if (*home < 0)
+    {
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+    bool missing = chdir(path) < 0 || (stat(DB_FILE, &st) < 0 && !create);
+    if (missing)
+    {
+        shard_leave(-1, *home);
+        return SRCH_NOT_FOUND;
+    }
+    bool fresh = stat(DB_FILE, &st) < 0 || st.st_size == 0;
+
+    int fd = open_db(DB_FILE, false, with_log);
+    if (fd >= 0 && fresh && init_db_header(fd, k * DB_SHARD_IDS) != NO_ERROR)
+    {
+        printf(M_ERR_DB_CREATE);
+        close_db(fd);
+        fd = ERR_DB_FILE;
+    }
+    if (fd < 0)
+    {
+        shard_leave(-1, *home);
+        return ERR_DB_FILE;
+    }
+    return fd;
+}
+
+// the thread body of run_shards()
+static void *shard_worker(void *arg)
+{
+    shard_run_t *sr = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&sr->lock);
+        int i = sr->next++;
+        pthread_mutex_unlock(&sr->lock);
+        if (i >= sr->n)
+            break;
+
+        int lo = sr->nums[i] * DB_SHARD_IDS;
+        if (sr->task(sr->fds[i], lo, lo + DB_SHARD_IDS - 1, sr->first_part + i, sr->arg) != NO_ERROR)
+        {
+            pthread_mutex_lock(&sr->lock);
+            sr->rc = ERR_DB_FILE;
+            pthread_mutex_unlock(&sr->lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  run_shards
+ *      task:  called once per shard with its fd, its id range and its
+ *             position among all shards as the part number
+ *      arg:   passed on to task
+ *
+ *  Runs task over every shard, SHARD_BATCH open shards at a time.  The
+ *  shards of a batch are handed out in order to the threads of -j N (one
+ *  per online cpu without it), the calling thread working as one of them.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE if a shard could not be opened or a
+ *            task failed
+ */
+static int run_shards(scan_part_t task, void *arg)
+{
+    int *shards = malloc(DB_MAX_SHARDS * sizeof(int));
+    int fds[SHARD_BATCH], nums[SHARD_BATCH];
+    pthread_t threads[DB_MAX_SCAN_THREADS];
+    int rc = NO_ERROR, part = 0;
+
+    int nthreads = get_scan_threads();
+    if (nthreads == 1)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > DB_MAX_SCAN_THREADS)
+        nthreads = DB_MAX_SCAN_THREADS;
+
+    int nshards = (shards == NULL) ? ERR_DB_FILE : list_shards(shards);
+    if (nshards < 0)
+    {
+        free(shards);
+        return ERR_DB_FILE;
+    }
+
+    for (int b = 0; rc == NO_ERROR && b < nshards; b += SHARD_BATCH)
+    {
+        int n = 0;
+        for (int i = b; i < nshards && i < b + SHARD_BATCH; i++)
+        {
+            int home;
+            // the scans only read, and the log is one per process: the
+            // shards of a batch are open together, so they leave it alone
+            int fd = shard_enter(shards[i], false, false, &home);
+            if (fd == SRCH_NOT_FOUND)
+                continue;
+            if (fd < 0)
+            {
+                rc = ERR_DB_FILE;
+                break;
+            }
+            if (fchdir(home) < 0)
+                rc = ERR_DB_FILE;
+            io_close(home);
+            fds[n] = fd;
+            nums[n++] = shards[i];
+        }
+
+        shard_run_t sr = {fds, nums, n, part, task, arg, PTHREAD_MUTEX_INITIALIZER, 0, NO_ERROR};
+        int started = 0;
+        if (rc == NO_ERROR)
+        {
+            int want = (nthreads < n) ? nthreads : n;
+            while (started < want - 1 &&
+                   pthread_create(&threads[started], NULL, shard_worker, &sr) == 0)
+                started++;
+            shard_worker(&sr);
+            for (int t = 0; t < started; t++)
+                pthread_join(threads[t], NULL);
+            rc = sr.rc;
+        }
+        pthread_mutex_destroy(&sr.lock);
+
+        for (int i = 0; i < n; i++)
+            close_db(fds[i]);
+        part += n;
+    }
+
+    free(shards);
+    return rc;
+}
+
+// run_shards() task of the count: adds the header count of the shard
+static int count_shard(int fd, int lo, int hi, int part, void *arg)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    long long *total = arg;
+    (void)lo;
+    (void)hi;
+    (void)part;
+
+    int count = db_count(fd);
+    if (count < 0)
+        return ERR_DB_FILE;
+    pthread_mutex_lock(&lock);
+    *total += count;
+    pthread_mutex_unlock(&lock);
+    return NO_ERROR;
+}
+
+// run_shards() task of a sorted print: feeds the shard to the sorter,
+// one shard at a time, while its name files are open
+static int sort_shard(int fd, int lo, int hi, int part, void *arg)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    (void)lo;
+    (void)hi;
+    (void)part;
+
+    pthread_mutex_lock(&lock);
+    int rc = sort_scan(arg, fd);
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+/*
+ *  shard_find
+ *      ids:  ids to look up
+ *      n:    number of ids
+ *
+ *  The -f of a sharded database.  Output and return value match
+ *  find_students(): the students found in id order, then a line for every
+ *  id that was not.  Rows are printed while their shard is open, its name
+ *  heap may hold their names.
+ *
+ *  returns:  NO_ERROR, SRCH_NOT_FOUND if some ids were not found or
+ *            ERR_DB_FILE
+ */
+static int shard_find(int *ids, int n)
+{
+    int *missing = malloc((n ? n : 1) * sizeof(int));
+    int nmissing = 0, rc = NO_ERROR, first_record = 1;
+    int cur = -1, fd = SRCH_NOT_FOUND, home = -1;
+    student_t student;
+
+    if (missing == NULL)
+    {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    // sorted, the ids of a shard come together and it is entered once
+    qsort(ids, n, sizeof(int), cmp_int);
+    for (int i = 0; i < n && rc == NO_ERROR; i++)
+    {
+        if (i > 0 && ids[i] == ids[i - 1])
+            continue;
+        int k = ids[i] / DB_SHARD_IDS;
+        if (ids[i] < MIN_STD_ID || ids[i] > DB_SHARD_MAX_ID)
+            k = -1;
+        if (k != cur && k >= 0)
+        {
+            if (fd >= 0)
+                shard_leave(fd, home);
+            fd = shard_enter(k, false, true, &home);
+            cur = k;
+            if (fd == ERR_DB_FILE)
+                rc = ERR_DB_FILE;
+        }
+
+        int got = (k >= 0 && fd >= 0) ? get_student(fd, ids[i], &student) : SRCH_NOT_FOUND;
+        if (got == NO_ERROR)
+            print_db_row(&student, &first_record);
+        else if (got == SRCH_NOT_FOUND)
+            missing[nmissing++] = ids[i];
+        else
+            rc = ERR_DB_FILE;
+    }
+    if (fd >= 0)
+        shard_leave(fd, home);
+
+    if (rc == NO_ERROR)
+    {
+        for (int i = 0; i < nmissing; i++)
+            printf(M_STD_NOT_FND_MSG, missing[i]);
+        if (nmissing > 0)
+            rc = SRCH_NOT_FOUND;
+    }
+    else
+    {
+        printf(M_ERR_DB_READ);
+    }
+    free(missing);
+    return rc;
+}
+
+/*
+ *  shard_drop
+ *
+ *  Removes the sharded database, every shard with its log and index
+ *  files.  Nothing happens if there is none.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int shard_drop(void)
+{
+    static const char *files[] = {DB_FILE, TMP_DB_FILE, WAL_FILE, LNAME_IDX_FILE,
+                                  TMP_LNAME_IDX_FILE, COL_FILE, TMP_COL_FILE,
+                                  NAME_HEAP_FILE, NAME_DICT_FILE};
+    int *shards = malloc(DB_MAX_SHARDS * sizeof(int));
+    char path[128];
+    int rc = NO_ERROR;
+
+    if (!shard_dir_exists())
+    {
+        free(shards);
+        return NO_ERROR;
+    }
+    int n = (shards == NULL) ? ERR_DB_FILE : list_shards(shards);
+    for (int i = 0; i < n; i++)
+    {
+        shard_path(path, sizeof(path), shards[i]);
+        size_t len = strlen(path);
+        for (size_t f = 0; f < sizeof(files) / sizeof(files[0]); f++)
+        {
+            snprintf(path + len, sizeof(path) - len, "/%s", files[f]);
+            if (io_unlink(path) < 0 && errno != ENOENT)
+                rc = ERR_DB_FILE;
+        }
+        path[len] = '\0';
+        if (rmdir(path) < 0)
+            rc = ERR_DB_FILE;
+    }
+    if (n < 0 || rmdir(DB_SHARD_DIR) < 0)
+        rc = ERR_DB_FILE;
+    free(shards);
+    return rc;
+}
+
+/*
+ *  shard_db_selected
+ *      opt:  the operation from the command line
+ *
+ *  returns:  true if opt works on a sharded database: one exists, or -z
+ *            is asked for SDBSC_FORMAT=sharded.  -z with another format
+ *            goes back to a single file.
+ */
+bool shard_db_selected(char opt)
+{
+    const char *fmt = getenv(DB_FORMAT_ENV);
+
+    if (opt == 'z' && fmt != NULL)
+        return strcmp(fmt, "sharded") == 0;
+    return shard_dir_exists();
+}
+
+/*
+ *  shard_command
+ *      argc, argv:  command line from main()
+ *      opt:         the operation
+ *
+ *  main() for a sharded database: a, d and f go to the shard of their id,
+ *  c and p run over all shards in parallel, x compacts one shard at a
+ *  time and z starts over with no shards.  i reads those commands from
+ *  stdin (see sdbsc_cmd.c) and runs each one through here.  Messages and
+ *  checks are the ones of the single file operations, except that ids
+ *  reach DB_SHARD_MAX_ID.
+ *
+ *  returns:  the exit code for the shell
+ */
+int shard_command(int argc, char *argv[], char opt)
+{
+    student_t student;
+    int home, fd, id, gpa, rc = NO_ERROR;
+
+    switch (opt)
+    {
+    case 'a':
+        if (argc != 6)
+        {
+            usage(argv[0]);
+            return EXIT_FAIL_ARGS;
+        }
+        id = atoi(argv[2]);
+        gpa = atoi(argv[5]);
+        if (id < MIN_STD_ID || id > DB_SHARD_MAX_ID || gpa < MIN_STD_GPA || gpa > MAX_STD_GPA)
+        {
+            printf(M_ERR_STD_RNG);
+            return EXIT_FAIL_ARGS;
+        }
+        fd = shard_enter(id / DB_SHARD_IDS, true, true, &home);
+        if (fd < 0)
+            return EXIT_FAIL_DB;
+        rc = add_student(fd, id, argv[3], argv[4], gpa);
+        shard_leave(fd, home);
+        return (rc < 0) ? EXIT_FAIL_DB : EXIT_OK;
+
+    case 'd':
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            return EXIT_FAIL_ARGS;
+        }
+        id = atoi(argv[2]);
+        fd = (id < MIN_STD_ID || id > DB_SHARD_MAX_ID) ? SRCH_NOT_FOUND
+                                                        : shard_enter(id / DB_SHARD_IDS, false, true, &home);
+        if (fd == SRCH_NOT_FOUND)
+        {
+            printf(M_STD_NOT_FND_MSG, id);
+            return EXIT_FAIL_DB;
+        }
+        if (fd < 0)
+            return EXIT_FAIL_DB;
+        rc = del_student(fd, id);
+        shard_leave(fd, home);
+        return (rc < 0) ? EXIT_FAIL_DB : EXIT_OK;
+
+    case 'f':
+        if (argc < 3)
+        {
+            usage(argv[0]);
+            return EXIT_FAIL_ARGS;
+        }
+        if (argc == 3 && strcmp(argv[2], "-") != 0)
+        {
+            // a single id prints like -f on a single file
+            id = atoi(argv[2]);
+            fd = (id < MIN_STD_ID || id > DB_SHARD_MAX_ID) ? SRCH_NOT_FOUND
+                                                            : shard_enter(id / DB_SHARD_IDS, false, true, &home);
+            rc = (fd >= 0) ? get_student(fd, id, &student) : fd;
+            if (rc == NO_ERROR)
+                print_student(&student);
+            else if (rc == SRCH_NOT_FOUND)
+                printf(M_STD_NOT_FND_MSG, id);
+            else
+                printf(M_ERR_DB_READ);
+            if (fd >= 0)
+                shard_leave(fd, home);
+        }
+        else
+        {
+            int *ids = NULL;
+            int n = read_ids(argc, argv, &ids);
+            if (n < 0)
+                return EXIT_FAIL_DB;
+            rc = shard_find(ids, n);
+            free(ids);
+        }
+        return (rc != NO_ERROR) ? EXIT_FAIL_DB : EXIT_OK;
+
+    case 'c':
+    {
+        long long total = 0;
+        if (run_shards(count_shard, &total) != NO_ERROR)
+        {
+            printf(M_ERR_DB_READ);
+            return EXIT_FAIL_DB;
+        }
+        if (total == 0)
+            printf(M_DB_EMPTY);
+        else
+            printf(M_DB_RECORD_CNT, (int)total);
+        return EXIT_OK;
+    }
+
+    case 'p':
+    {
+        par_print_t pp = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+        if (print_sorted())
+        {
+            // the sorter spills to disk, whatever the number of shards
+            sorter_t *st = sort_begin();
+            rc = (st == NULL) ? ERR_DB_FILE : run_shards(sort_shard, st);
+            pp.rows = (st == NULL) ? ERR_DB_FILE : sort_end(st, rc == NO_ERROR);
+            rc = (pp.rows < 0) ? ERR_DB_FILE : NO_ERROR;
+        }
+        else
+            rc = run_shards(print_part, &pp);
+        fflush(stdout);
+        if (rc != NO_ERROR)
+        {
+            printf(M_ERR_DB_READ);
+            return EXIT_FAIL_DB;
+        }
+        if (pp.rows == 0)
+            printf(M_DB_EMPTY);
+        return EXIT_OK;
+    }
+
+    case 'x':
+    {
+        if (argc != 2)
+        {
+            usage(argv[0]);
+            return EXIT_FAIL_ARGS;
+        }
+        int *shards = malloc(DB_MAX_SHARDS * sizeof(int));
+        int n = (shards == NULL) ? ERR_DB_FILE : list_shards(shards);
+        rc = (n < 0) ? ERR_DB_FILE : NO_ERROR;
+        for (int i = 0; i < n && rc == NO_ERROR; i++)
+        {
+            fd = shard_enter(shards[i], false, true, &home);
+            if (fd == SRCH_NOT_FOUND)
+                continue;
+            if (fd >= 0)
+                fd = compact_db(fd);
+            rc = (fd < 0) ? ERR_DB_FILE : NO_ERROR;
+            shard_leave(fd, home);
+        }
+        free(shards);
+        if (rc != NO_ERROR)
+            return EXIT_FAIL_DB;
+        printf(M_DB_COMPRESSED_OK);
+        return EXIT_OK;
+    }
+
+    case 'z':
+        if (shard_drop() != NO_ERROR || mkdir(DB_SHARD_DIR, S_IRWXU | S_IRWXG) < 0)
+        {
+            printf(M_ERR_DB_CREATE);
+            return EXIT_FAIL_DB;
+        }
+        printf(M_DB_ZERO_OK);
+        return EXIT_OK;
+
+    case 'i':
+        // every command comes back here as the option it stands for
+        if (argc != 2)
+        {
+            usage(argv[0]);
+            return EXIT_FAIL_ARGS;
+        }
+        return (run_commands(-1, stdin) != NO_ERROR) ? EXIT_FAIL_DB : EXIT_OK;
+
+    default:
+        printf(M_ERR_SHARD_OPT, opt);
+        return EXIT_FAIL_ARGS;
+    }
+}
@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Sorted print (-p --sort id|gpa|lname|fname [--desc] [--limit K]).
+ *  Ties are broken by id, --desc only turns the key around.  The rows are
+ *  those of print_db(), in another order.
+ *
+ *  A sorter is fed the live records one at a time (sort_add()), from a
+ *  scan of one database or of every shard in turn, and prints them when
+ *  sort_end() is called.  Each record is kept as a sort_entry_t: id, gpa,
+ *  the full name it is sorted by and its row, formatted while its database
+ *  is open.  Names kept in the heap or the dictionary of a shard are
+ *  therefore resolved before the shard is closed, and printing needs no
+ *  database at all.
+ *
+ *  With --limit K, if K entries fit in the memory budget, only the best K
+ *  are kept in a bounded heap whose root is the worst of them, a record
+ *  that does not beat the root is dropped at once.  Otherwise the entries
+ *  go into an arena of the budget (SORT_MEM_BYTES, SDBSC_SORT_MEM).  A full
+ *  arena is sorted and written to a spill file as a run, and sort_end()
+ *  merges the runs through a heap with one entry per run.  Once there are
+ *  SORT_MAX_RUNS runs they are merged into one first, so the memory and
+ *  the open files stay bounded however large the database is.  Spill files
+ *  are unlinked as soon as they are created.
+ */
+
+typedef struct sort_entry
+{
+    int id;
+    int gpa;
+    unsigned short key_len;     // name sorted by, 0 for id and gpa
+    unsigned short row_len;
+    char data[];                // key, then the row, not terminated
+} sort_entry_t;
+
+#define SORT_ENTRY_MAX  (sizeof(sort_entry_t) + NAME_HEAP_MAX_LEN + DB_PRINT_ROW_MAX)
+
+struct sorter
+{
+    char *arena;                // entries packed, mem bytes
+    size_t mem;
+    size_t used;
+    sort_entry_t **ents;        // the entries of the arena, or the top-K heap
+    int n;
+    int cap;
+    FILE *runs[SORT_MAX_RUNS];  // sorted runs spilled so far
+    int nruns;
+    bool topk;
+    int rows;                   // printed so far
+};
+
+static struct
+{
+    int key;
+    bool desc;
+    long limit;                 // 0 for all
+} order = {SORT_NONE, false, 0};
+
+static size_t sort_mem(void)
+{
+    const char *env = getenv(SORT_MEM_ENV);
+    long mem = (env != NULL) ? atol(env) : 0;
+
+    if (mem < (long)(2 * SORT_ENTRY_MAX))
+        return SORT_MEM_BYTES;
+    return (size_t)mem;
+}
+
+/*
+ *  set_print_order
+ *      key:    id, gpa, lname or fname from --sort, or NULL
+ *      desc:   --desc was given
+ *      limit:  K from --limit, or NULL
+ *
+ *  Makes print_db() (and -p on a sharded database) print in that order.
+ *  --desc or --limit without --sort sort by id.
+ *
+ *  returns:  NO_ERROR or ERR_DB_OP if key or limit are not valid
+ */
+int set_print_order(const char *key, bool desc, const char *limit)
+{
+    static const char *keys[] = {"id", "gpa", "lname", "fname"};
+
+    if (key == NULL && !desc && limit == NULL)
+        return NO_ERROR;
+    order.key = SORT_ID;
+    for (int k = 0; key != NULL && k < 4; k++)
+        if (strcmp(key, keys[k]) == 0)
+            order.key = SORT_ID + k;
+    if (key != NULL && strcmp(key, keys[order.key - SORT_ID]) != 0)
+        return ERR_DB_OP;
+
+    order.desc = desc;
+    if (limit != NULL)
+    {
+        char *end;
+        order.limit = strtol(limit, &end, 10);
+        if (*end != '\0' || end == limit || order.limit < 1)
+            return ERR_DB_OP;
+    }
+    return NO_ERROR;
+}
+
+// whether print_db() has to sort, see set_print_order()
+bool print_sorted(void)
+{
+    return order.key != SORT_NONE;
+}
+
+// order of two entries: negative if a prints first
+static int cmp_entry(const sort_entry_t *a, const sort_entry_t *b)
+{
+    int c = 0;
+
+    if (order.key == SORT_GPA)
+        c = (a->gpa > b->gpa) - (a->gpa < b->gpa);
+    else if (order.key != SORT_ID)
+    {
+        int len = (a->key_len < b->key_len) ? a->key_len : b->key_len;
+        c = memcmp(a->data, b->data, len);
+        if (c == 0)
+            c = (a->key_len > b->key_len) - (a->key_len < b->key_len);
+    }
+    if (order.desc)
+        c = -c;
+    if (c == 0 || order.key == SORT_ID)
+        c = (a->id > b->id) - (a->id < b->id);
+    if (order.desc && order.key == SORT_ID)
+        c = -c;
+    return c;
+}
+
+static int cmp_entry_ptr(const void *a, const void *b)
+{
+    return cmp_entry(*(sort_entry_t *const *)a, *(sort_entry_t *const *)b);
+}
+
+// fills e from s, returns its size
+static size_t make_entry(sort_entry_t *e, const student_t *s)
+{
+    char name[NAME_HEAP_MAX_LEN + 1];
+
+    e->id = s->id;
+    e->gpa = s->gpa;
+    e->key_len = 0;
+    if (order.key == SORT_LNAME || order.key == SORT_FNAME)
+    {
+        if (order.key == SORT_LNAME)
+            name_get(s->lname, sizeof(s->lname), name);
+        else
+            name_get(s->fname, sizeof(s->fname), name);
+        e->key_len = strlen(name);
+        memcpy(e->data, name, e->key_len);
+    }
+    e->row_len = format_row(e->data + e->key_len, DB_PRINT_ROW_MAX, s);
+    return sizeof(*e) + e->key_len + e->row_len;
+}
+
+/*
+ *  Bounded heap of the top-K mode: a max-heap in the print order, the root
+ *  is the entry that would be dropped next.
+ */
+static void heap_down(sort_entry_t **h, int n, int i)
+{
+    for (;;)
+    {
+        int big = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && cmp_entry(h[l], h[big]) > 0)
+            big = l;
+        if (r < n && cmp_entry(h[r], h[big]) > 0)
+            big = r;
+        if (big == i)
+            return;
+        sort_entry_t *t = h[i];
+        h[i] = h[big];
+        h[big] = t;
+        i = big;
+    }
+}
+
+static void heap_up(sort_entry_t **h, int i)
+{
+    while (i > 0 && cmp_entry(h[i], h[(i - 1) / 2]) > 0)
+    {
+        sort_entry_t *t = h[i];
+        h[i] = h[(i - 1) / 2];
+        h[(i - 1) / 2] = t;
+        i = (i - 1) / 2;
+    }
+}
+
+static int topk_add(sorter_t *st, const sort_entry_t *e, size_t size)
+{
+    if (st->n == order.limit && cmp_entry(e, st->ents[0]) >= 0)
+        return NO_ERROR;
+
+    sort_entry_t *copy = malloc(size);
+    if (copy == NULL)
+        return ERR_DB_FILE;
+    memcpy(copy, e, size);
+    if (st->n < order.limit)
+    {
+        st->ents[st->n] = copy;
+        heap_up(st->ents, st->n++);
+    }
+    else
+    {
+        free(st->ents[0]);
+        st->ents[0] = copy;
+        heap_down(st->ents, st->n, 0);
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  Runs.  A spill file holds sort entries back to back, in order.
+ */
+static FILE *run_create(void)
+{
+    char path[] = TMP_SORT_FILE;
+    int fd = mkstemp(path);
+
+    if (fd < 0)
+        return NULL;
+    io_unlink(path);
+    FILE *f = fdopen(fd, "w+");
+    if (f == NULL)
+        io_close(fd);
+    return f;
+}
+
+static bool run_write(FILE *f, const sort_entry_t *e)
+{
+    return fwrite(e, sizeof(*e) + e->key_len + e->row_len, 1, f) == 1;
+}
+
+// reads the next entry of a run into e (SORT_ENTRY_MAX bytes), returns 1,
+// 0 at the end of the run or ERR_DB_FILE
+static int run_read(FILE *f, sort_entry_t *e)
+{
+    if (fread(e, sizeof(*e), 1, f) != 1)
+        return ferror(f) ? ERR_DB_FILE : 0;
+    size_t len = (size_t)e->key_len + e->row_len;
+    if (len > SORT_ENTRY_MAX - sizeof(*e) || fread(e->data, 1, len, f) != len)
+        return ERR_DB_FILE;
+    return 1;
+}
+
+// prints e, with the table header before the first row
+static void emit_row(sorter_t *st, const sort_entry_t *e)
+{
+    if (st->rows++ == 0)
+        printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+    fwrite(e->data + e->key_len, 1, e->row_len, stdout);
+}
+
+// whether --limit still lets rows out
+static bool want_rows(const sorter_t *st)
+{
+    return order.limit == 0 || st->rows < order.limit;
+}
+
+/*
+ *  merge_runs
+ *      st:   the sorter, its runs are merged and closed
+ *      out:  run to write the merged entries to, or NULL to print them
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int merge_runs(sorter_t *st, FILE *out)
+{
+    sort_entry_t *cur[SORT_MAX_RUNS];
+    int heap[SORT_MAX_RUNS], nheap = 0, rc = NO_ERROR;
+    int n = st->nruns;
+
+    for (int r = 0; r < n; r++)
+    {
+        cur[r] = malloc(SORT_ENTRY_MAX);
+        if (cur[r] == NULL || fflush(st->runs[r]) != 0 || fseek(st->runs[r], 0, SEEK_SET) != 0)
+            rc = ERR_DB_FILE;
+    }
+
+    // min-heap of the runs by their current entry
+    for (int r = 0; rc == NO_ERROR && r < n; r++)
+    {
+        int got = run_read(st->runs[r], cur[r]);
+        if (got < 0)
+            rc = ERR_DB_FILE;
+        if (got <= 0)
+            continue;
+        int i = nheap++;
+        heap[i] = r;
+        while (i > 0 && cmp_entry(cur[heap[i]], cur[heap[(i - 1) / 2]]) < 0)
+        {
+            int t = heap[i];
+            heap[i] = heap[(i - 1) / 2];
+            heap[(i - 1) / 2] = t;
+            i = (i - 1) / 2;
+        }
+    }
+
+    while (rc == NO_ERROR && nheap > 0 && (out != NULL || want_rows(st)))
+    {
+        int r = heap[0];
+        if (out != NULL && !run_write(out, cur[r]))
+            rc = ERR_DB_FILE;
+        else if (out == NULL)
+            emit_row(st, cur[r]);
+
+        int got = run_read(st->runs[r], cur[r]);
+        if (got < 0)
+            rc = ERR_DB_FILE;
+        if (got <= 0)
+            heap[0] = heap[--nheap];
+        for (int i = 0;;)
+        {
+            int small = i, l = 2 * i + 1, rr = l + 1;
+            if (l < nheap && cmp_entry(cur[heap[l]], cur[heap[small]]) < 0)
+                small = l;
+            if (rr < nheap && cmp_entry(cur[heap[rr]], cur[heap[small]]) < 0)
+                small = rr;
+            if (small == i)
+                break;
+            int t = heap[i];
+            heap[i] = heap[small];
+            heap[small] = t;
+            i = small;
+        }
+    }
+
+    for (int r = 0; r < n; r++)
+    {
+        free(cur[r]);
+        fclose(st->runs[r]);
+    }
+    st->nruns = 0;
+    return rc;
+}
+
+// sorts the arena and writes it out as a run, merging the runs first if
+// there is no room for another one
+static int spill(sorter_t *st)
+{
+    if (st->n == 0)
+        return NO_ERROR;
+    if (st->nruns == SORT_MAX_RUNS)
+    {
+        FILE *merged = run_create();
+        if (merged == NULL || merge_runs(st, merged) != NO_ERROR)
+        {
+            if (merged != NULL)
+                fclose(merged);
+            return ERR_DB_FILE;
+        }
+        st->runs[st->nruns++] = merged;
+    }
+
+    FILE *run = run_create();
+    if (run == NULL)
+        return ERR_DB_FILE;
+    st->runs[st->nruns++] = run;
+    qsort(st->ents, st->n, sizeof(st->ents[0]), cmp_entry_ptr);
+    for (int i = 0; i < st->n; i++)
+        if (!run_write(run, st->ents[i]))
+            return ERR_DB_FILE;
+    st->n = 0;
+    st->used = 0;
+    return NO_ERROR;
+}
+
+/*
+ *  sort_begin
+ *
+ *  returns:  a sorter for the order set with set_print_order(), or NULL
+ *            if there is no memory for it
+ */
+sorter_t *sort_begin(void)
+{
+    sorter_t *st = calloc(1, sizeof(*st));
+    size_t mem = sort_mem();
+
+    if (st == NULL)
+        return NULL;
+    st->mem = mem;
+    st->topk = order.limit > 0 && (size_t)order.limit <= mem / SORT_ENTRY_MAX;
+    st->cap = st->topk ? (int)order.limit : 1024;
+    st->ents = malloc(st->cap * sizeof(st->ents[0]));
+    st->arena = st->topk ? NULL : malloc(mem);
+    if (st->ents == NULL || (!st->topk && st->arena == NULL))
+    {
+        free(st->ents);
+        free(st->arena);
+        free(st);
+        return NULL;
+    }
+    return st;
+}
+
+/*
+ *  sort_add
+ *      st:  sorter from sort_begin()
+ *      s:   live record, its database is the current one of the thread
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int sort_add(sorter_t *st, const student_t *s)
+{
+    _Alignas(sort_entry_t) char buf[SORT_ENTRY_MAX];
+    sort_entry_t *e = (sort_entry_t *)buf;
+    size_t size = make_entry(e, s);
+
+    if (st->topk)
+        return topk_add(st, e, size);
+
+    // entries stay aligned like the structure
+    size = (size + _Alignof(sort_entry_t) - 1) & ~(_Alignof(sort_entry_t) - 1);
+    if (st->used + size > st->mem && spill(st) != NO_ERROR)
+        return ERR_DB_FILE;
+    if (st->n == st->cap)
+    {
+        sort_entry_t **grown = realloc(st->ents, 2 * st->cap * sizeof(st->ents[0]));
+        if (grown == NULL)
+            return ERR_DB_FILE;
+        st->ents = grown;
+        st->cap *= 2;
+    }
+    st->ents[st->n] = (sort_entry_t *)(st->arena + st->used);
+    memcpy(st->ents[st->n++], e, size);
+    st->used += size;
+    return NO_ERROR;
+}
+
+/*
+ *  sort_scan
+ *      st:  sorter from sort_begin()
+ *      fd:  linux file descriptor of the database to add
+ *
+ *  Adds every live record of the database.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int sort_scan(sorter_t *st, int fd)
+{
+    db_scan_t sc;
+    int got, rc = NO_ERROR;
+
+    names_use(fd);
+    if (scan_open(&sc, fd, 0) != NO_ERROR)
+        return ERR_DB_FILE;
+    while (rc == NO_ERROR && (got = scan_next(&sc)) > 0)
+        for (int i = 0; rc == NO_ERROR && i < got; i++)
+            rc = sort_add(st, sc.batch[i]);
+    scan_close(&sc);
+    return (got < 0) ? ERR_DB_FILE : rc;
+}
+
+/*
+ *  sort_end
+ *      st:     sorter from sort_begin(), freed
+ *      print:  false if feeding it failed, nothing is printed then
+ *
+ *  Prints what was added, in order, up to --limit rows.
+ *
+ *  returns:  number of rows printed or ERR_DB_FILE
+ */
+int sort_end(sorter_t *st, bool print)
+{
+    int rc = print ? NO_ERROR : ERR_DB_FILE;
+
+    if (rc == NO_ERROR && st->nruns > 0)
+    {
+        rc = spill(st);
+        if (rc == NO_ERROR)
+            rc = merge_runs(st, NULL);
+    }
+    else if (rc == NO_ERROR)
+    {
+        qsort(st->ents, st->n, sizeof(st->ents[0]), cmp_entry_ptr);
+        for (int i = 0; i < st->n && want_rows(st); i++)
+            emit_row(st, st->ents[i]);
+    }
+
+    for (int r = 0; r < st->nruns; r++)
+        fclose(st->runs[r]);
+    if (st->topk)
+        for (int i = 0; i < st->n; i++)
+            free(st->ents[i]);
+    int rows = st->rows;
+    free(st->ents);
+    free(st->arena);
+    free(st);
+    return (rc == NO_ERROR) ? rows : ERR_DB_FILE;
+}
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SDB_HAVE_X86_SIMD 1
+#endif
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  GPA statistics (-s).  One scan over the database feeds two things:
+ *
+ *   - a kernel that runs over every slot of a chunk, empty ones included,
+ *     and sums the live count, the GPA total, minimum and maximum.  It
+ *     comes in an AVX2 flavor (8 slots per step), an SSE2 flavor (4 slots
+ *     per step) and a scalar one.  The best one the cpu supports is picked
+ *     at run time, SDBSC_SIMD=scalar|sse2|avx2 forces one.  Over the hot
+ *     column, where a slot is just the id and gpa, the vector kernels load
+ *     the slots with two plain loads and split ids from gpas with shuffles;
+ *     over student_t slots, 16 ints apart, they gather the lanes.
+ *   - a histogram of the GPAs of the live records, one bin per GPA point.
+ *     Percentiles are read off the histogram, so they are exact.
+ *
+ *  The scan reads the hot column (see sdbsc_column.c) rather than the
+ *  database, 8 bytes per slot instead of 64, and builds it on first use.
+ *  The kernels run over its col_slot_t the same way as over student_t.
+ */
+
+typedef struct gpa_acc
+{
+    long long sum;
+    int count;
+    int min;
+    int max;
+} gpa_acc_t;
+
+// rows holds n slots stride ints apart, the id first and the gpa gpa_at
+// ints after it
+typedef void (*gpa_kernel_t)(const int *rows, int stride, int gpa_at, int n, gpa_acc_t *acc);
+
+#define COL_STRIDE  (int)(sizeof(col_slot_t) / sizeof(int))
+#define COL_GPA_AT  (int)(offsetof(col_slot_t, gpa) / sizeof(int))
+
+static void gpa_kernel_scalar(const int *rows, int stride, int gpa_at, int n, gpa_acc_t *acc)
+{
+    for (int i = 0; i < n; i++, rows += stride)
+    {
+        if (rows[0] == 0)
+            continue;
+        int gpa = rows[gpa_at];
+        acc->count++;
+        acc->sum += gpa;
+        if (gpa < acc->min)
+            acc->min = gpa;
+        if (gpa > acc->max)
+            acc->max = gpa;
+    }
+}
+
+#ifdef SDB_HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void gpa_kernel_sse2(const int *rows, int stride, int gpa_at, int n, gpa_acc_t *acc)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vcount = zero, vsum = zero;
+    __m128i vmin = _mm_set1_epi32(INT_MAX), vmax = _mm_set1_epi32(INT_MIN);
+    int lane[4], i = 0;
+    bool pairs = stride == COL_STRIDE && gpa_at == COL_GPA_AT;
+
+    // lane sums stay below 2^31 for the 16K slots of a 1MB chunk
+    for (; i + 4 <= n; i += 4, rows += 4 * stride)
+    {
+        __m128i ids, gpas;
+        if (pairs)
+        {
+            // id0 g0 id1 g1 | id2 g2 id3 g3 -> id0 id1 g0 g1 | id2 id3 g2 g3
+            __m128i a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)rows), _MM_SHUFFLE(3, 1, 2, 0));
+            __m128i b = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)rows + 1), _MM_SHUFFLE(3, 1, 2, 0));
+            ids = _mm_unpacklo_epi64(a, b);
+            gpas = _mm_unpackhi_epi64(a, b);
+        }
+        else
+        {
+            const int *g = rows + gpa_at;
+            ids = _mm_setr_epi32(rows[0], rows[stride], rows[2 * stride], rows[3 * stride]);
+            gpas = _mm_setr_epi32(g[0], g[stride], g[2 * stride], g[3 * stride]);
+        }
+        __m128i dead = _mm_cmpeq_epi32(ids, zero);
+
+        vcount = _mm_add_epi32(vcount, _mm_andnot_si128(dead, _mm_set1_epi32(1)));
+        vsum = _mm_add_epi32(vsum, _mm_andnot_si128(dead, gpas));
+
+        // no pminsd/pmaxsd before SSE4.1, select through the compare masks
+        __m128i lo = _mm_or_si128(_mm_andnot_si128(dead, gpas), _mm_and_si128(dead, vmin));
+        __m128i lt = _mm_cmplt_epi32(lo, vmin);
+        vmin = _mm_or_si128(_mm_and_si128(lt, lo), _mm_andnot_si128(lt, vmin));
+        __m128i hi = _mm_or_si128(_mm_andnot_si128(dead, gpas), _mm_and_si128(dead, vmax));
+        __m128i gt = _mm_cmpgt_epi32(hi, vmax);
+        vmax = _mm_or_si128(_mm_and_si128(gt, hi), _mm_andnot_si128(gt, vmax));
+    }
+
+    _mm_storeu_si128((__m128i *)lane, vcount);
+    acc->count += lane[0] + lane[1] + lane[2] + lane[3];
+    _mm_storeu_si128((__m128i *)lane, vsum);
+    acc->sum += (long long)lane[0] + lane[1] + lane[2] + lane[3];
+    _mm_storeu_si128((__m128i *)lane, vmin);
+    for (int k = 0; k < 4; k++)
+        acc->min = (lane[k] < acc->min) ? lane[k] : acc->min;
+    _mm_storeu_si128((__m128i *)lane, vmax);
+    for (int k = 0; k < 4; k++)
+        acc->max = (lane[k] > acc->max) ? lane[k] : acc->max;
+
+    gpa_kernel_scalar(rows, stride, gpa_at, n - i, acc);
+}
+
+__attribute__((target("avx2")))
+static void gpa_kernel_avx2(const int *rows, int stride, int gpa_at, int n, gpa_acc_t *acc)
+{
+    const __m256i idx = _mm256_setr_epi32(0, stride, 2 * stride, 3 * stride,
+                                          4 * stride, 5 * stride, 6 * stride, 7 * stride);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i vcount = zero, vsum = zero;
+    __m256i vmin = _mm256_set1_epi32(INT_MAX), vmax = _mm256_set1_epi32(INT_MIN);
+    const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    int lane[8], i = 0;
+    bool pairs = stride == COL_STRIDE && gpa_at == COL_GPA_AT;
+
+    for (; i + 8 <= n; i += 8, rows += 8 * stride)
+    {
+        __m256i ids, gpas;
+        if (pairs)
+        {
+            // ids of four slots in the low half of a and b, gpas in the high
+            __m256i a = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)rows), split);
+            __m256i b = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)rows + 1), split);
+            ids = _mm256_permute2x128_si256(a, b, 0x20);
+            gpas = _mm256_permute2x128_si256(a, b, 0x31);
+        }
+        else
+        {
+            ids = _mm256_i32gather_epi32(rows, idx, 4);
+            gpas = _mm256_i32gather_epi32(rows + gpa_at, idx, 4);
+        }
+        __m256i dead = _mm256_cmpeq_epi32(ids, zero);
+
+        // a live lane is 0 in dead, subtracting ~dead (-1) counts it
+        vcount = _mm256_sub_epi32(vcount, _mm256_andnot_si256(dead, _mm256_set1_epi32(-1)));
+        vsum = _mm256_add_epi32(vsum, _mm256_andnot_si256(dead, gpas));
+        vmin = _mm256_min_epi32(vmin, _mm256_blendv_epi8(gpas, _mm256_set1_epi32(INT_MAX), dead));
+        vmax = _mm256_max_epi32(vmax, _mm256_blendv_epi8(gpas, _mm256_set1_epi32(INT_MIN), dead));
+    }
+
+    _mm256_storeu_si256((__m256i *)lane, vcount);
+    for (int k = 0; k < 8; k++)
+        acc->count += lane[k];
+    _mm256_storeu_si256((__m256i *)lane, vsum);
+    for (int k = 0; k < 8; k++)
+        acc->sum += lane[k];
+    _mm256_storeu_si256((__m256i *)lane, vmin);
+    for (int k = 0; k < 8; k++)
+        acc->min = (lane[k] < acc->min) ? lane[k] : acc->min;
+    _mm256_storeu_si256((__m256i *)lane, vmax);
+    for (int k = 0; k < 8; k++)
+        acc->max = (lane[k] > acc->max) ? lane[k] : acc->max;
+
+    gpa_kernel_scalar(rows, stride, gpa_at, n - i, acc);
+}
+#endif
+
+// picks the kernel, SDBSC_SIMD overrides the cpu detection
+static gpa_kernel_t pick_kernel(void)
+{
+    const char *want = getenv(DB_SIMD_ENV);
+
+    if (want != NULL && strcmp(want, "scalar") == 0)
+        return gpa_kernel_scalar;
+#ifdef SDB_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if ((want == NULL || strcmp(want, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+        return gpa_kernel_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return gpa_kernel_sse2;
+#endif
+    return gpa_kernel_scalar;
+}
+
+typedef struct stats_part
+{
+    gpa_acc_t acc;
+    long long hist[MAX_STD_GPA + 1];
+} stats_part_t;
+
+// the hot column of stats_db() and the parts its slots are added to
+typedef struct stats_col
+{
+    int col_fd;
+    stats_part_t *parts;
+} stats_col_t;
+
+// adds the students of one scan chunk to st
+static void stats_chunk(gpa_kernel_t kernel, db_scan_t *sc, int got, stats_part_t *st)
+{
+    kernel((const int *)sc->recs, sizeof(student_t) / sizeof(int),
+           offsetof(student_t, gpa) / sizeof(int), sc->nrecs, &st->acc);
+    for (int i = 0; i < got; i++)
+    {
+        int gpa = sc->batch[i]->gpa;
+        st->hist[(gpa < MIN_STD_GPA) ? MIN_STD_GPA : (gpa > MAX_STD_GPA) ? MAX_STD_GPA : gpa]++;
+    }
+}
+
+// parallel_scan() task of stats_db(), every part has its own stats_part_t
+static int stats_part(int fd, int lo, int hi, int part, void *arg)
+{
+    stats_part_t *st = (stats_part_t *)arg + part;
+    gpa_kernel_t kernel = pick_kernel();
+    db_scan_t sc;
+    int got;
+
+    if (scan_open_range(&sc, fd, 0, lo, hi) != NO_ERROR)
+        return ERR_DB_FILE;
+    while ((got = scan_next(&sc)) > 0)
+        stats_chunk(kernel, &sc, got, st);
+    scan_close(&sc);
+    return (got < 0) ? ERR_DB_FILE : NO_ERROR;
+}
+
+// parallel_scan() task of stats_db() over the hot column instead of the
+// database, the ids lo to hi are read from their column slots
+static int stats_col_part(int fd, int lo, int hi, int part, void *arg)
+{
+    stats_col_t *col = arg;
+    stats_part_t *st = col->parts + part;
+    col_slot_t *buf = malloc(COL_CHUNK_SLOTS * sizeof(col_slot_t));
+    gpa_kernel_t kernel = pick_kernel();
+    int base = db_base_id(fd);
+    int got = 0;
+
+    if (buf == NULL)
+        return ERR_DB_FILE;
+    for (int slot = lo - base; slot <= hi - base; slot += got)
+    {
+        int want = (hi - base - slot + 1 < COL_CHUNK_SLOTS) ? hi - base - slot + 1 : COL_CHUNK_SLOTS;
+        got = column_read(fd, col->col_fd, slot, buf, want);
+        if (got <= 0)
+            break;
+        kernel((const int *)buf, COL_STRIDE, COL_GPA_AT, got, &st->acc);
+        for (int i = 0; i < got; i++)
+        {
+            int gpa = buf[i].gpa;
+            if (buf[i].id != 0)
+                st->hist[(gpa < MIN_STD_GPA) ? MIN_STD_GPA : (gpa > MAX_STD_GPA) ? MAX_STD_GPA : gpa]++;
+        }
+    }
+    free(buf);
+    return (got < 0) ? ERR_DB_FILE : NO_ERROR;
+}
+
+/*
+ *  stats_db
+ *      fd:     linux file descriptor
+ *      pcts:   percentiles to report, each between 1 and 100
+ *      npcts:  number of entries in pcts
+ *
+ *  Computes the count, mean, minimum and maximum GPA, the requested
+ *  percentiles (nearest rank) and a histogram of the GPAs in bins of
+ *  STATS_HIST_BIN points, in one scan of the hot column, or of the
+ *  database if the column cannot be built.  With -j the parts of a
+ *  parallel_scan() keep their own totals, added up at the end.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ *
+ *  console:  the statistics, M_DB_EMPTY if there are no students or
+ *            M_ERR_DB_READ on error
+ */
+int stats_db(int fd, const int *pcts, int npcts)
+{
+    int threads = get_scan_threads();
+    int nparts = (threads > 1) ? threads * DB_SCAN_PARTS : 1;
+    stats_part_t *parts = calloc(nparts, sizeof(stats_part_t));
+    int rc = ERR_DB_FILE;
+    db_scan_t sc;
+
+    for (int i = 0; parts != NULL && i < nparts; i++)
+    {
+        parts[i].acc.min = INT_MAX;
+        parts[i].acc.max = INT_MIN;
+    }
+    stats_col_t col = {column_open(fd), parts};
+    if (parts != NULL && col.col_fd >= 0)
+    {
+        int base = db_base_id(fd);
+        rc = (threads > 1) ? parallel_scan(fd, threads, nparts, stats_col_part, &col)
+                           : stats_col_part(fd, base, base + MAX_STD_ID, 0, &col);
+    }
+    else if (parts != NULL && threads > 1)
+    {
+        rc = parallel_scan(fd, threads, nparts, stats_part, parts);
+    }
+    else if (parts != NULL && scan_open(&sc, fd, 0) == NO_ERROR)
+    {
+        gpa_kernel_t kernel = pick_kernel();
+        int got;
+        while ((got = scan_next(&sc)) > 0)
+            stats_chunk(kernel, &sc, got, parts);
+        scan_close(&sc);
+        rc = (got < 0) ? ERR_DB_FILE : NO_ERROR;
+    }
+    if (col.col_fd >= 0)
+        io_close(col.col_fd);
+    if (rc != NO_ERROR)
+    {
+        free(parts);
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    // reduce the parts into the first one
+    gpa_acc_t acc = parts[0].acc;
+    long long *hist = parts[0].hist;
+    for (int i = 1; i < nparts; i++)
+    {
+        acc.count += parts[i].acc.count;
+        acc.sum += parts[i].acc.sum;
+        acc.min = (parts[i].acc.min < acc.min) ? parts[i].acc.min : acc.min;
+        acc.max = (parts[i].acc.max > acc.max) ? parts[i].acc.max : acc.max;
+        for (int gpa = MIN_STD_GPA; gpa <= MAX_STD_GPA; gpa++)
+            hist[gpa] += parts[i].hist[gpa];
+    }
+    if (acc.count == 0)
+    {
+        free(parts);
+        printf(M_DB_EMPTY);
+        return NO_ERROR;
+    }
+
+    printf(M_STATS_COUNT, acc.count);
+    printf(M_STATS_GPA, "mean", (double)acc.sum / acc.count / 100.0);
+    printf(M_STATS_GPA, "min", acc.min / 100.0);
+    printf(M_STATS_GPA, "max", acc.max / 100.0);
+
+    for (int p = 0; p < npcts; p++)
+    {
+        // nearest rank: the smallest GPA with at least pct% of the students
+        // at or below it
+        long long rank = ((long long)pcts[p] * acc.count + 99) / 100;
+        long long seen = 0;
+        int gpa = MIN_STD_GPA;
+        for (; gpa < MAX_STD_GPA; gpa++)
+        {
+            seen += hist[gpa];
+            if (seen >= rank)
+                break;
+        }
+        printf(M_STATS_PCT, pcts[p], gpa / 100.0);
+    }
+
+    printf(M_STATS_HIST_HDR);
+    for (int lo = MIN_STD_GPA; lo <= MAX_STD_GPA; lo += STATS_HIST_BIN)
+    {
+        // the last bin also takes the perfect 5.00
+        int hi = lo + STATS_HIST_BIN - 1;
+        if (hi + 1 == MAX_STD_GPA)
+            hi = MAX_STD_GPA;
+        long long n = 0;
+        for (int gpa = lo; gpa <= hi; gpa++)
+            n += hist[gpa];
+        printf(M_STATS_HIST_ROW, lo / 100.0, hi / 100.0, n);
+        if (hi == MAX_STD_GPA)
+            break;
+    }
+    free(parts);
+    return NO_ERROR;
+}
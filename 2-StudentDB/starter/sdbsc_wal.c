@@ -0,0 +1,554 @@
+#define _GNU_SOURCE // F_OFD_SETLK
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+
+/*
+ *  Write-ahead log.  With SDBSC_WAL=1 every change put_slot() makes is
+ *  first appended to WAL_FILE and made durable, then written to its slot
+ *  as usual (without any flush).  A crash can then tear or lose slot
+ *  writes but never an acknowledged change: open_db() replays the log.
+ *
+ *  Flushing is shared (group commit).  A writer appends its record to the
+ *  pending batch and, if no flush is running, becomes the leader: it
+ *  writes the whole batch with one write() and one fdatasync().  Writers
+ *  arriving meanwhile queue up behind it and go out with the next flush,
+ *  so under load one fdatasync() covers many operations.  In the server
+ *  every worker thread takes part, a single command pays one flush.
+ *
+ *  Once the log grows past WAL_CKPT_BYTES it is checkpointed: the database
+ *  file is flushed and the log truncated.  Operations that rewrite the
+ *  whole database checkpoint before and after.
+ *
+ *  Without SDBSC_WAL a log found by open_db() is replayed, flushed into
+ *  the database and removed, so a later run in WAL mode never replays
+ *  changes older than the ones made without the log.
+ *
+ *  Several processes can share the log.  Each one holds a read lock on
+ *  WAL_LOCK_USERS of the log for as long as it has the log open, so a
+ *  process that gets the write lock there knows it is the only user.
+ *  Only then is the log replayed (or removed), and only under the
+ *  whole-file lock of the database, so no change is in flight meanwhile.
+ *  A process without SDBSC_WAL that finds the log in use logs its changes
+ *  too, from open_db() on or, if the log appears later, from its next
+ *  change on: a replay after a crash must never undo a change the log
+ *  has not seen.  The window from a log record to its slot write is
+ *  covered by a read lock on WAL_LOCK_APPLY, a checkpoint takes the write
+ *  lock there before it empties the log.  The size that triggers a
+ *  checkpoint is the size of the file, whoever appended to it.
+ */
+
+#define WAL_LOCK_USERS  0   // held shared by every process using the log
+#define WAL_LOCK_APPLY  1   // held shared from log record to slot write
+
+typedef struct wal_state
+{
+    bool on;                        // logging enabled for this process
+    bool replaying;                 // put_slot() calls come from the replay
+    int fd;                         // the log, opened O_APPEND
+    off_t size;                     // durable bytes in the log
+    pthread_mutex_t lock;           // guards everything below
+    pthread_cond_t done;            // signaled after every flush
+    pthread_rwlock_t apply;         // held shared from log to slot write
+    int applying;                   // threads holding apply, see wal_enter()
+    wal_rec_t *pending;             // batch for the next flush
+    wal_rec_t *spare;               // batch being flushed
+    int npending;
+    bool flushing;
+    unsigned long long next_lsn;
+    unsigned long long durable_lsn;
+    int rc;                         // a failed flush fails every later one
+} wal_state_t;
+
+static wal_state_t wal = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .apply = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+// one-byte lock of the log, F_UNLCK to release it
+static int wal_lock(int fd, short type, off_t what)
+{
+    return fcntl_lock(fd, type, what, 1);
+}
+
+// like wal_lock() but fails instead of waiting, false if the lock is held
+static bool wal_trylock(int fd, short type, off_t what)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = what;
+    fl.l_len = 1;
+    return io_fcntl(fd, F_OFD_SETLK, &fl) == 0;
+}
+
+// whether fd is still the file named WAL_FILE, a last user may remove it
+static bool wal_current(int fd)
+{
+    struct stat open_st, name_st;
+
+    return io_fstat(fd, &open_st) == 0 && stat(WAL_FILE, &name_st) == 0 &&
+           open_st.st_dev == name_st.st_dev && open_st.st_ino == name_st.st_ino;
+}
+
+/*
+ *  wal_attach
+ *      create:  create the log if there is none
+ *
+ *  Opens the log for appending and registers as one of its users.
+ *
+ *  returns:  the log, -1 if there is none and create is false, or
+ *            ERR_DB_FILE
+ */
+static int wal_attach(bool create)
+{
+    for (;;)
+    {
+        int fd = io_open(WAL_FILE, create ? (O_RDWR | O_CREAT | O_APPEND) : (O_RDWR | O_APPEND), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+        if (fd < 0)
+            return (errno == ENOENT && !create) ? -1 : ERR_DB_FILE;
+        if (wal_lock(fd, F_RDLCK, WAL_LOCK_USERS) != NO_ERROR)
+        {
+            io_close(fd);
+            return ERR_DB_FILE;
+        }
+        if (wal_current(fd))
+            return fd;
+        // the last user removed it while we waited
+        io_close(fd);
+    }
+}
+
+// end of the log, including what other processes appended
+static off_t wal_file_size(int fd)
+{
+    struct stat st;
+    return (io_fstat(fd, &st) == 0) ? st.st_size : 0;
+}
+
+/*
+ *  wal_start
+ *      log_fd:  the log, from wal_attach()
+ *
+ *  Turns logging on for this process.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int wal_start(int log_fd)
+{
+    wal.pending = malloc(WAL_GROUP_MAX * sizeof(wal_rec_t));
+    wal.spare = malloc(WAL_GROUP_MAX * sizeof(wal_rec_t));
+    if (wal.pending == NULL || wal.spare == NULL)
+    {
+        free(wal.pending);
+        free(wal.spare);
+        wal.pending = wal.spare = NULL;
+        io_close(log_fd);
+        return ERR_DB_FILE;
+    }
+    wal.fd = log_fd;
+    wal.size = wal_file_size(log_fd);
+    wal.durable_lsn = wal.next_lsn;
+    wal.rc = NO_ERROR;
+    wal.on = true;
+    return NO_ERROR;
+}
+
+// FNV-1a over everything the checksum covers
+static unsigned int wal_sum(const wal_rec_t *r)
+{
+    const unsigned char *p = (const unsigned char *)&r->lsn;
+    size_t len = sizeof(*r) - offsetof(wal_rec_t, lsn);
+    unsigned int h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+// write() all of buf, retrying short writes
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = io_write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return ERR_DB_FILE;
+        p += n;
+        len -= n;
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  wal_replay
+ *      db_fd:   linux file descriptor of the database
+ *      log_fd:  the log
+ *      valid:   receives the length of the intact part of the log
+ *
+ *  Applies every intact record of the log to the database, in log order.
+ *  Replaying a record twice does no harm, it holds the full slot.  The
+ *  replay stops at the first torn or foreign record.
+ *
+ *  returns:  number of records applied or ERR_DB_FILE
+ */
+static int wal_replay(int db_fd, int log_fd, off_t *valid)
+{
+    wal_rec_t *buf = malloc(WAL_GROUP_MAX * sizeof(wal_rec_t));
+    int applied = 0, rc = NO_ERROR;
+    off_t pos = 0;
+    bool intact = true;
+
+    *valid = 0;
+    if (buf == NULL)
+        return ERR_DB_FILE;
+
+    wal.replaying = true;
+    while (intact && rc == NO_ERROR)
+    {
+        ssize_t got = io_pread(log_fd, buf, WAL_GROUP_MAX * sizeof(wal_rec_t), pos);
+        if (got < 0)
+            rc = ERR_DB_FILE;
+        if (got <= 0)
+            break;
+
+        int n = got / sizeof(wal_rec_t);
+        for (int i = 0; i < n && rc == NO_ERROR; i++)
+        {
+            const wal_rec_t *r = &buf[i];
+            if (r->magic != WAL_MAGIC || r->sum != wal_sum(r) ||
+                r->id < MIN_STD_ID || r->id > DB_SHARD_MAX_ID)
+            {
+                intact = false;
+                break;
+            }
+            if (put_slot(db_fd, r->id, &r->rec) != NO_ERROR)
+                rc = ERR_DB_FILE;
+            applied++;
+            wal.next_lsn = r->lsn;
+            pos += sizeof(wal_rec_t);
+        }
+        if (n == 0 || got % sizeof(wal_rec_t) != 0)
+            intact = false;
+    }
+    wal.replaying = false;
+    free(buf);
+
+    *valid = pos;
+    return (rc == NO_ERROR) ? applied : rc;
+}
+
+/*
+ *  wal_recover
+ *      db_fd:   linux file descriptor of the database
+ *      log_fd:  the log, write-locked at WAL_LOCK_USERS
+ *      valid:   receives the length of the intact part of the log
+ *
+ *  Replays the log for its only user, under the whole-file lock so no
+ *  other process is between a change and its log record.
+ *
+ *  returns:  number of records applied or ERR_DB_FILE
+ */
+static int wal_recover(int db_fd, int log_fd, off_t *valid)
+{
+    int replayed = wal_replay(db_fd, log_fd, valid);
+    if (replayed > 0)
+        index_drop(); // the index may not have seen these changes
+    if (replayed > 0 && sync_db(db_fd) != NO_ERROR)
+        return ERR_DB_FILE;
+    return replayed;
+}
+
+/*
+ *  wal_open
+ *      db_fd:  linux file descriptor of the database, just opened
+ *
+ *  Called by open_db().  Replays a log left behind by an earlier run if no
+ *  other process uses it, then keeps the log open for appending when
+ *  SDBSC_WAL=1 or another process is logging, or removes it otherwise.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int wal_open(int db_fd)
+{
+    const char *env = getenv(WAL_ENV);
+    bool on = env != NULL && strcmp(env, "1") == 0;
+    off_t valid = 0;
+
+    int log_fd = wal_attach(on);
+    if (log_fd == -1)
+        return NO_ERROR;
+    if (log_fd < 0)
+        return ERR_DB_FILE;
+
+    // the whole-file lock first: a writer that finds the log mid-change
+    // holds its slot lock and waits for WAL_LOCK_USERS
+    if (lock_db(db_fd, F_WRLCK) != NO_ERROR)
+    {
+        io_close(log_fd);
+        return ERR_DB_FILE;
+    }
+    int rc = NO_ERROR;
+    if (wal_trylock(log_fd, F_WRLCK, WAL_LOCK_USERS))
+    {
+        if (wal_recover(db_fd, log_fd, &valid) < 0)
+            rc = ERR_DB_FILE;
+        else if (!on)
+            io_unlink(WAL_FILE);
+        // drop a torn tail so new records follow the last intact one
+        else if (io_ftruncate(log_fd, valid) < 0 ||
+                 wal_lock(log_fd, F_RDLCK, WAL_LOCK_USERS) != NO_ERROR)
+            rc = ERR_DB_FILE;
+        if (rc != NO_ERROR || !on)
+        {
+            unlock_db(db_fd);
+            io_close(log_fd);
+            return rc;
+        }
+    }
+    unlock_db(db_fd);
+
+    // replayed, or in use by another process which we then join
+    if (wal_start(log_fd) != NO_ERROR)
+        return ERR_DB_FILE;
+    if (wal.size >= WAL_CKPT_BYTES)
+        return wal_checkpoint(db_fd);
+    return NO_ERROR;
+}
+
+/*
+ *  wal_join
+ *
+ *  Called for a change in a process without the log.  Turns logging on if
+ *  a process started logging since open_db(): the change must reach the
+ *  log, or a replay could undo it, and a checkpoint must empty the log.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int wal_join(void)
+{
+    int rc = NO_ERROR;
+
+    pthread_mutex_lock(&wal.lock);
+    if (!wal.on)
+    {
+        int log_fd = wal_attach(false);
+        if (log_fd < -1 || (log_fd >= 0 && wal_start(log_fd) != NO_ERROR))
+            rc = ERR_DB_FILE;
+    }
+    pthread_mutex_unlock(&wal.lock);
+    return rc;
+}
+
+// enters the window from log record to slot write, see wal_checkpoint()
+static int wal_enter(void)
+{
+    int rc = NO_ERROR;
+
+    pthread_rwlock_rdlock(&wal.apply);
+    pthread_mutex_lock(&wal.lock);
+    if (wal.applying == 0)
+        rc = wal_lock(wal.fd, F_RDLCK, WAL_LOCK_APPLY);
+    if (rc == NO_ERROR)
+        wal.applying++;
+    pthread_mutex_unlock(&wal.lock);
+    if (rc != NO_ERROR)
+        pthread_rwlock_unlock(&wal.apply);
+    return rc;
+}
+
+static void wal_leave(void)
+{
+    pthread_mutex_lock(&wal.lock);
+    if (--wal.applying == 0)
+        wal_lock(wal.fd, F_UNLCK, WAL_LOCK_APPLY);
+    pthread_mutex_unlock(&wal.lock);
+    pthread_rwlock_unlock(&wal.apply);
+}
+
+/*
+ *  wal_log
+ *      id:   slot about to be written
+ *      rec:  its new contents
+ *
+ *  Appends the change to the log and returns once it is durable, flushing
+ *  it together with whatever other threads logged meanwhile.  On success
+ *  the caller must write the slot and then call wal_applied().  Does
+ *  nothing when the log is off.  Called under the lock of the slot.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int wal_log(int id, const student_t *rec)
+{
+    if (wal.replaying)
+        return NO_ERROR;
+    if (!wal.on && wal_join() != NO_ERROR)
+        return ERR_DB_FILE;
+    if (!wal.on)
+        return NO_ERROR;
+
+    if (wal_enter() != NO_ERROR)
+        return ERR_DB_FILE;
+    pthread_mutex_lock(&wal.lock);
+    while (wal.npending == WAL_GROUP_MAX && wal.rc == NO_ERROR)
+        pthread_cond_wait(&wal.done, &wal.lock);
+
+    wal_rec_t *r = &wal.pending[wal.npending++];
+    memset(r, 0, sizeof(*r));
+    r->magic = WAL_MAGIC;
+    r->lsn = ++wal.next_lsn;
+    r->id = id;
+    r->rec = *rec;
+    r->sum = wal_sum(r);
+    unsigned long long lsn = r->lsn;
+
+    while (wal.durable_lsn < lsn && wal.rc == NO_ERROR)
+    {
+        if (wal.flushing)
+        {
+            pthread_cond_wait(&wal.done, &wal.lock);
+            continue;
+        }
+
+        // lead the next flush: take the whole pending batch
+        wal_rec_t *batch = wal.pending;
+        int n = wal.npending;
+        unsigned long long last = batch[n - 1].lsn;
+        wal.pending = wal.spare;
+        wal.spare = batch;
+        wal.npending = 0;
+        wal.flushing = true;
+        pthread_mutex_unlock(&wal.lock);
+
+        int rc = write_all(wal.fd, batch, n * sizeof(wal_rec_t));
+        if (rc == NO_ERROR && io_fdatasync(wal.fd) < 0)
+            rc = ERR_DB_FILE;
+        // O_APPEND left the offset at the end, past what others appended
+        off_t end = io_lseek(wal.fd, 0, SEEK_CUR);
+
+        pthread_mutex_lock(&wal.lock);
+        wal.flushing = false;
+        if (rc == NO_ERROR)
+        {
+            wal.durable_lsn = last;
+            wal.size = end;
+        }
+        else
+        {
+            wal.rc = rc;
+        }
+        pthread_cond_broadcast(&wal.done);
+    }
+    int rc = wal.rc;
+    pthread_mutex_unlock(&wal.lock);
+
+    if (rc != NO_ERROR)
+        wal_leave();
+    return rc;
+}
+
+/*
+ *  wal_applied
+ *      db_fd:  linux file descriptor of the database
+ *
+ *  Ends what wal_log() started once the slot is written, and checkpoints
+ *  when the log has grown past WAL_CKPT_BYTES.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE if the checkpoint failed
+ */
+int wal_applied(int db_fd)
+{
+    if (!wal.on || wal.replaying)
+        return NO_ERROR;
+
+    wal_leave();
+    if (wal.size >= WAL_CKPT_BYTES)
+        return wal_checkpoint(db_fd);
+    return NO_ERROR;
+}
+
+/*
+ *  wal_enabled
+ *
+ *  returns:  true when this process logs its changes, which are then
+ *            durable once the command making them returns
+ */
+bool wal_enabled(void)
+{
+    return wal.on;
+}
+
+/*
+ *  wal_checkpoint
+ *      db_fd:  linux file descriptor of the database
+ *
+ *  Waits until no change, in this process or another one, is between its
+ *  log record and its slot write, flushes the database file and empties
+ *  the log.  The flush covers the slot writes of the other processes too,
+ *  they go through the same page cache.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+int wal_checkpoint(int db_fd)
+{
+    // a process without the log still empties one that others use
+    if (!wal.on && wal_join() != NO_ERROR)
+        return ERR_DB_FILE;
+    if (!wal.on)
+        return NO_ERROR;
+
+    int rc = NO_ERROR;
+    pthread_rwlock_wrlock(&wal.apply);
+    if (wal_lock(wal.fd, F_WRLCK, WAL_LOCK_APPLY) != NO_ERROR)
+        rc = ERR_DB_FILE;
+    // another process may have emptied it already
+    else if (wal_file_size(wal.fd) > 0 &&
+             (sync_db(db_fd) != NO_ERROR || io_ftruncate(wal.fd, 0) < 0))
+        rc = ERR_DB_FILE;
+    if (rc == NO_ERROR)
+        wal.size = 0;
+    wal_lock(wal.fd, F_UNLCK, WAL_LOCK_APPLY);
+    pthread_rwlock_unlock(&wal.apply);
+    return rc;
+}
+
+/*
+ *  wal_close
+ *      db_fd:  linux file descriptor of the database
+ *
+ *  Called by close_db().  Checkpoints a log that has grown past
+ *  WAL_CKPT_BYTES and closes it, which ends this process as one of its
+ *  users.  A smaller log is kept, the next open_db() replays it.
+ */
+void wal_close(int db_fd)
+{
+    if (!wal.on)
+        return;
+
+    if (wal.size >= WAL_CKPT_BYTES)
+        wal_checkpoint(db_fd);
+    io_close(wal.fd);
+    free(wal.pending);
+    free(wal.spare);
+    wal.fd = -1;
+    wal.pending = wal.spare = NULL;
+    wal.on = false;
+}
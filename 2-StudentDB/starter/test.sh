@@ -192,4 +192,711 @@ setup_file() {
         echo "Failed Output:  $output"
         return 1
     }
-}
\ No newline at end of file
+}
+
+@test "mmap backend sees records written by the fd backend" {
+    run ./sdbsc -z
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -a 7 ada lovelace 400
+    [ "$status" -eq 0 ]
+
+    run env SDBSC_BACKEND=mmap ./sdbsc -f 7
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "7 ada lovelace 4.00" ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+}
+
+@test "mmap backend add, duplicate and delete" {
+    run env SDBSC_BACKEND=mmap SDBSC_MSYNC=1 ./sdbsc -a 100000 last slot 123
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 100000 added to database." ]
+
+    run env SDBSC_BACKEND=mmap ./sdbsc -a 7 dup student 300
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Cant add student with ID=7, already exists in db." ]
+
+    run env SDBSC_BACKEND=mmap ./sdbsc -d 7
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 7 was deleted from database." ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+}
+
+@test "Bulk load students from stdin" {
+    run ./sdbsc -z
+    [ "$status" -eq 0 ]
+
+    run bash -c 'printf "id,fname,lname,gpa\n5,ann,lee,350\n2,bob,ray,210\n5,dup,row,100\n" | ./sdbsc -b'
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Cant add student with ID=5, already exists in db." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    [[ "${lines[1]}" == "Loaded 2 student record(s) in "* ]]
+
+    run ./sdbsc -p
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 2 bob ray 2.10 5 ann lee 3.50" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+}
+
+@test "Migrate to the header format keeps records and count" {
+    run ./sdbsc -z
+    run ./sdbsc -a 10 amy pond 333
+    run ./sdbsc -a 11 rory williams 222
+    run ./sdbsc -d 10
+
+    run ./sdbsc -m
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database converted to format version 1." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -a 12 clara oswald 444
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 2 student record(s)." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -p
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 11 rory williams 2.22 12 clara oswald 4.44" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+}
+
+@test "Zeroing a header format database keeps the header" {
+    run ./sdbsc -z
+    [ "$status" -eq 0 ]
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "6416384" ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains no student records." ]
+}
+
+@test "Lookups keep working after compress" {
+    run env SDBSC_FORMAT=legacy ./sdbsc -z
+    run ./sdbsc -a 20 rose tyler 310
+    run ./sdbsc -a 21 martha jones 390
+    run ./sdbsc -a 500 donna noble 250
+    run ./sdbsc -d 20
+
+    run ./sdbsc -x
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database successfully compressed!" ]
+
+    # 64 byte header, the directory of 2 ids, then the 2 records
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "256" ]
+
+    run ./sdbsc -f 500
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "${lines[1]}" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "500 donna noble 2.50" ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -f 20
+    [ "$status" -eq 1 ]
+
+    run ./sdbsc -d 21
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Student 21 was deleted from database." ]
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+
+    run ./sdbsc -a 7 jack harkness 199
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -p
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 7 jack harkness 1.99 500 donna noble 2.50" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    # adding a new id expanded the file back to the headerless slot layout
+    run stat --format="%s" ./student.db
+    [ "${lines[0]}" = "32064" ]
+}
+
+@test "Punch releases blocks of deleted records in place" {
+    run env SDBSC_FORMAT=legacy ./sdbsc -z
+    run bash -c 'for i in $(seq 64 127) 200; do echo "$i first last 300"; done | ./sdbsc -b'
+    [ "$status" -eq 0 ]
+    for i in $(seq 64 127); do
+        ./sdbsc -d $i > /dev/null
+    done
+
+    run ./sdbsc -x --punch
+    [ "$status" -eq 0 ]
+    [[ "${lines[0]}" == "Released 1 empty block(s), "* ]] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -f 200
+    [ "$status" -eq 0 ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+}
+
+@test "Punch next to a writer keeps every added record" {
+    run env SDBSC_FORMAT=legacy ./sdbsc -z
+    # allocated zeros over the whole id space, the adds land in blocks the
+    # punch is about to release
+    dd if=/dev/zero of=student.db bs=64 count=100001 2>/dev/null
+    run bash -c 'for i in $(seq 1 60); do ./sdbsc -a $((i * 1597)) p x 300; done & for i in $(seq 1 30); do ./sdbsc -x --punch > /dev/null; done; wait'
+    [ "$status" -eq 0 ]
+    added=$(echo "$output" | grep -c "added to database")
+    [ "$added" -eq 60 ]
+
+    run ./sdbsc -c
+    [ "$output" = "Database contains 60 student record(s)." ]
+}
+
+@test "Find students by last name" {
+    run ./sdbsc -z
+    run bash -c 'printf "1 john doe 345\n3 jane doe 390\n5 big dude 205\n7 amy dodd 300\n" | ./sdbsc -b'
+
+    run ./sdbsc -n doe
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 1 john doe 3.45 3 jane doe 3.90" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    # the index built by the lookup above follows adds and deletes
+    run ./sdbsc -a 9 joe doe 250
+    run ./sdbsc -d 1
+    run ./sdbsc -n do --prefix
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 7 amy dodd 3.00 3 jane doe 3.90 9 joe doe 2.50" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -n smith
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "No student with last name smith was found in database." ]
+}
+
+@test "Server mode answers requests from the client" {
+    run ./sdbsc -z
+    ./sdbsc -S > /dev/null 3>&- &
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        [ -S sdbsc.sock ] && break
+        sleep 0.1
+    done
+
+    run bash -c 'printf "a 1 john doe 345\na 1 john doe 345\nf 1\nd 2\nc\n" | ./sdbsc -C'
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "Student 1 added to database. Cant add student with ID=1, already exists in db. ID FIRST_NAME LAST_NAME GPA 1 john doe 3.45 Student 2 was not found in database. Database contains 1 student record(s)." ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run bash -c 'echo stop-server | ./sdbsc -C'
+    [ "${lines[0]}" = "Client requested server to stop, stopping..." ]
+    wait
+
+    run ./sdbsc -f 1
+    [ "$status" -eq 0 ]
+    [ ! -e sdbsc.sock ]
+}
+
+@test "Server with one worker answers a client while another stays connected" {
+    run ./sdbsc -z
+    SDBSC_THREADS=1 ./sdbsc -S > /dev/null 3>&- &
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        [ -S sdbsc.sock ] && break
+        sleep 0.1
+    done
+
+    # the first client keeps its connection open without sending more
+    (echo "a 1 john doe 345"; sleep 2) | ./sdbsc -C > /dev/null 3>&- &
+    sleep 0.3
+    run timeout 1 bash -c 'echo "a 2 jane doe 390" | ./sdbsc -C'
+    [ "$status" -eq 0 ]
+    [ "$output" = "Student 2 added to database." ]
+
+    run bash -c 'echo stop-server | ./sdbsc -C'
+    wait
+    run ./sdbsc -c
+    [ "$output" = "Database contains 2 student record(s)." ]
+}
+
+@test "Print streams databases larger than one scan chunk" {
+    run ./sdbsc -z
+    run bash -c 'seq 1 5 100000 | awk "{ print \$1, \"f\" \$1, \"l\" \$1, 300 }" | ./sdbsc -b'
+    [ "$status" -eq 0 ]
+
+    run bash -c './sdbsc -p | wc -l'
+    [ "$output" -eq 20001 ]
+    run bash -c './sdbsc -p | tail -1'
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "99996 f99996 l99996 3.00" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+}
+
+@test "GPA statistics agree across kernels" {
+    run ./sdbsc -z
+    run bash -c 'printf "1 a b 100\n2 c d 200\n3 e f 300\n4 g h 400\n9 i j 500\n" | ./sdbsc -b'
+    run ./sdbsc -d 2
+
+    for kernel in scalar sse2 avx2; do
+        run env SDBSC_SIMD=$kernel ./sdbsc -s 50 100
+        [ "$status" -eq 0 ]
+        [ "${lines[0]}" = "Students:  4" ]
+        [ "${lines[1]}" = "GPA mean   3.25" ]
+        [ "${lines[2]}" = "GPA min    1.00" ]
+        [ "${lines[3]}" = "GPA max    5.00" ]
+        [ "${lines[4]}" = "GPA p50    3.00" ]
+        [ "${lines[5]}" = "GPA p100   5.00" ]
+        [ "${lines[16]}" = "  4.50-5.00 1" ] || {
+            echo "Failed Output:  $output"
+            return 1
+        }
+    done
+}
+
+@test "Query filters records by id, gpa and name" {
+    run ./sdbsc -z
+    run bash -c 'printf "1 john doe 345\n3 jane doe 390\n63 jim doe 285\n4000 amy dodd 400\n6000 ann doe 380\n" | ./sdbsc -b'
+
+    run ./sdbsc -q "gpa>=350 and lname=doe and id<5000"
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 3 jane doe 3.90" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -q "lname=do* and gpa > 3.8"
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 3 jane doe 3.90 4000 amy dodd 4.00" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -q "id>100 and id<200"
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "No student matched the query." ]
+
+    run ./sdbsc -q "gpa>=350 or id=1"
+    [ "$status" -eq 2 ]
+}
+
+@test "Range read prints only the ids in the range" {
+    run ./sdbsc -z
+    run bash -c 'printf "1 john doe 345\n3 jane doe 390\n63 jim doe 285\n64 janet doe 310\n99999 big dude 205\n" | ./sdbsc -b'
+
+    run ./sdbsc -r 2 64
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 3 jane doe 3.90 63 jim doe 2.85 64 janet doe 3.10" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -x
+    run ./sdbsc -r 64 99999
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 64 janet doe 3.10 99999 big dude 2.05" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -r 100 200
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "No student with an id from 100 to 200 was found in database." ]
+
+    run ./sdbsc -r 10 5
+    [ "$status" -eq 2 ]
+}
+
+@test "Find many students in one call" {
+    run ./sdbsc -z
+    run bash -c 'printf "1 john doe 345\n3 jane doe 390\n63 jim doe 285\n64 janet doe 310\n99999 big dude 205\n" | ./sdbsc -b'
+
+    run ./sdbsc -f 64 3 99999 3 5
+    [ "$status" -eq 1 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 3 jane doe 3.90 64 janet doe 3.10 99999 big dude 2.05 Student 5 was not found in database." ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -x
+    run bash -c 'printf "63\n1\n" | ./sdbsc -f -'
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 1 john doe 3.45 63 jim doe 2.85" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+}
+
+@test "Parallel scans match the single threaded ones" {
+    run ./sdbsc -z
+    run bash -c 'seq 1 7 100000 | awk "{ print \$1, \"f\" \$1, \"l\" \$1, \$1 % 501 }" | ./sdbsc -b'
+
+    for op in -p -c -s; do
+        expected=$(./sdbsc $op)
+        run ./sdbsc $op -j 4
+        [ "$status" -eq 0 ]
+        [ "$output" = "$expected" ] || {
+            echo "Failed Output for $op:  $output"
+            return 1
+        }
+    done
+
+    run ./sdbsc -p -j 0
+    [ "$status" -eq 2 ]
+}
+
+@test "Write-ahead log replays changes lost from the database file" {
+    run ./sdbsc -z
+    SDBSC_WAL=1 ./sdbsc -a 1 john doe 345
+    SDBSC_WAL=1 ./sdbsc -a 2 jane doe 390
+    [ "$(stat -c %s student.db.wal)" -eq 176 ]
+
+    # lose the write of student 2 and tear the tail of the log
+    dd if=/dev/zero of=student.db bs=64 seek=2 count=1 conv=notrunc 2>/dev/null
+    printf 'torn' >> student.db.wal
+
+    run ./sdbsc -f 2
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 2 jane doe 3.90" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+    # without SDBSC_WAL the log is folded into the database and removed
+    [ ! -e student.db.wal ]
+}
+
+@test "Processes without SDBSC_WAL log into a log that is in use" {
+    run ./sdbsc -z
+    SDBSC_WAL=1 ./sdbsc -S > /dev/null 3>&- &
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        [ -S sdbsc.sock ] && break
+        sleep 0.1
+    done
+    run bash -c 'printf "a 1 john doe 345\n" | ./sdbsc -C'
+
+    # the server still uses the log, it is neither replayed nor removed
+    run ./sdbsc -a 2 jane doe 390
+    [ "$status" -eq 0 ]
+    [ "$(stat -c %s student.db.wal)" -eq 176 ]
+
+    run bash -c 'echo stop-server | ./sdbsc -C'
+    wait
+
+    # losing both writes, the replay brings back the one made without the log
+    dd if=/dev/zero of=student.db bs=64 seek=1 count=2 conv=notrunc 2>/dev/null
+    run ./sdbsc -c
+    [ "$output" = "Database contains 2 student record(s)." ]
+    [ ! -e student.db.wal ]
+}
+
+@test "Concurrent adds of the same id store it once" {
+    run ./sdbsc -z
+    run bash -c 'for p in 1 2 3 4; do (for i in $(seq 1 50); do ./sdbsc -a $i p$p x 300; done) & done; wait'
+    added=$(echo "$output" | grep -c "added to database")
+    [ "$added" -eq 50 ] || {
+        echo "Added $added times"
+        return 1
+    }
+
+    run ./sdbsc -c
+    [ "$output" = "Database contains 50 student record(s)." ]
+}
+
+@test "Sharded database routes ids past the single file limit" {
+    run env SDBSC_FORMAT=sharded ./sdbsc -z
+    [ "$status" -eq 0 ]
+    ./sdbsc -a 1234567 john doe 345
+    ./sdbsc -a 5 jane doe 390
+    ./sdbsc -a 250000 jim smith 280
+    [ -d student.shards/0012 ]
+
+    run ./sdbsc -f 1234567
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 1234567 john doe 3.45" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -d 250000
+    [ "$status" -eq 0 ]
+    run ./sdbsc -x
+    [ "$status" -eq 0 ]
+
+    run ./sdbsc -p -j 2
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 5 jane doe 3.90 1234567 john doe 3.45" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+    run ./sdbsc -c
+    [ "$output" = "Database contains 2 student record(s)." ]
+
+    run ./sdbsc -s
+    [ "$status" -eq 2 ]
+
+    # back to a single file
+    run env SDBSC_FORMAT=legacy ./sdbsc -z
+    [ ! -e student.shards ]
+}
+
+@test "Hot column keeps up with adds and deletes" {
+    run ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 3 jane doe 390
+    run ./sdbsc -s
+    [ "$status" -eq 0 ]
+    # header plus the slots 0 to 3, 8 bytes each
+    [ "$(stat -c %s student.db.col)" -eq 4128 ]
+
+    ./sdbsc -a 2 jim smith 200
+    ./sdbsc -d 3
+    run ./sdbsc -s 50
+    with_column="$output"
+    [ "${lines[0]}" = "Students:  2" ]
+    [ "${lines[1]}" = "GPA mean   2.73" ]
+
+    rm student.db.col
+    run ./sdbsc -s 50
+    [ "$output" = "$with_column" ]
+
+    run ./sdbsc -z
+    [ ! -e student.db.col ]
+}
+
+@test "Hot column slot marked mid-change is read from the database" {
+    run env SDBSC_FORMAT=legacy ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 3 jane doe 390
+    run ./sdbsc -s
+    [ "$status" -eq 0 ]
+
+    # a delete of 3 that crashed after its slot write: the slot is empty,
+    # the column slot still carries the mark put_slot() sets before it
+    dd if=/dev/zero of=student.db bs=64 seek=3 count=1 conv=notrunc status=none
+    printf '\377\377\377\377\000\000\000\000' |
+        dd of=student.db.col bs=8 seek=515 conv=notrunc status=none
+    run ./sdbsc -c
+    [ "$output" = "Database contains 1 student record(s)." ]
+    run ./sdbsc -s
+    [ "${lines[0]}" = "Students:  1" ]
+}
+
+@test "Long names spill into the name heap" {
+    run ./sdbsc -z
+    SDBSC_LONG_NAMES=1 ./sdbsc -a 1 Maximiliana-Alexandrina-Josephine doe 345
+    SDBSC_LONG_NAMES=1 ./sdbsc -a 2 jane Featherstonehaugh-Cholmondeley-Marjoribanks 390
+    ./sdbsc -a 3 Maximiliana-Alexandrina-Josephine smith 200
+    # slots stay 64 bytes, only the names that do not fit are in the heap
+    [ "$(stat -c %s student.db.names)" -eq 144 ]
+
+    run ./sdbsc -p
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 1 Maximiliana-Alexandrina-Josephine doe 3.45 2 jane Featherstonehaugh-Cholmondeley-Marjoribanks 3.90 3 Maximiliana-Alexandrina- smith 2.00" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -q "lname=Featherstonehaugh-Cholmondeley-Marjoribanks"
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 2 jane Featherstonehaugh-Cholmondeley-Marjoribanks 3.90" ]
+
+    run ./sdbsc -n Featherstonehaugh-Cholmondeley-Marjoribanks
+    [ "${lines[1]:0:6}" = "2     " ]
+
+    run ./sdbsc -z
+    [ ! -e student.db.names ]
+}
+
+@test "Last names are stored once in the dictionary" {
+    run ./sdbsc -z
+    SDBSC_LNAME_DICT=1 ./sdbsc -a 1 john doe 345
+    SDBSC_LNAME_DICT=1 ./sdbsc -a 2 jane doe 390
+    SDBSC_LNAME_DICT=1 ./sdbsc -a 3 bob smith 300
+    SDBSC_LNAME_DICT=1 ./sdbsc -a 4 ann doer 310
+    # a 64 byte header and 32 bytes per distinct name
+    [ "$(stat -c %s student.db.dict)" -eq 160 ]
+
+    run ./sdbsc -p
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 1 john doe 3.45 2 jane doe 3.90 3 bob smith 3.00 4 ann doer 3.10" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -q "lname=doe"
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 1 john doe 3.45 2 jane doe 3.90" ]
+
+    run ./sdbsc -q "lname!=doe*"
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 3 bob smith 3.00" ]
+
+    run ./sdbsc -n doe
+    [ "${#lines[@]}" -eq 3 ]
+
+    # compacted, the records keep only the code: header and directory
+    # rounded up to 128 bytes, then 4 records of 36 bytes
+    run ./sdbsc -x
+    [ "$(stat -c %s student.db)" -eq 272 ]
+    run ./sdbsc -q "lname=doe"
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 1 john doe 3.45 2 jane doe 3.90" ]
+    ./sdbsc -d 2
+    run ./sdbsc -f 1 2 4
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 1 john doe 3.45 4 ann doer 3.10 Student 2 was not found in database." ]
+
+    # a name outside the dictionary needs a full slot again
+    ./sdbsc -a 2 jane plain 390
+    run ./sdbsc -f 2
+    [ "${lines[1]}" = "2      jane                     plain                            3.90" ]
+
+    run ./sdbsc -z
+    [ ! -e student.db.dict ]
+}
+
+@test "Verbose mode reports system calls per phase" {
+    run ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+
+    run ./sdbsc -f 1 -v
+    [ "$status" -eq 0 ]
+    [ "${lines[1]:0:6}" = "1     " ]
+    [[ "$output" == *"phase"*"syscalls"* ]]
+    [[ "$output" == *"get "* ]]
+
+    # the summary goes to stderr, one line of JSON
+    SDBSC_STATS=json ./sdbsc -c 2> stats.json > /dev/null
+    grep -q '^{"wall_ms":.*"open":{"calls":1,"syscalls":' stats.json
+    rm -f stats.json
+}
+
+@test "Command mode runs stdin lines against one open database" {
+    run ./sdbsc -z
+
+    run ./sdbsc -i <<'CMDS'
+a 1 john doe 345
+a 2 jane roe 390
+
+# comments and empty lines are skipped
+a 1 dup dup 100
+f 2
+d 1
+c
+x
+CMDS
+    [ "$status" -eq 1 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "Student 1 added to database. Student 2 added to database. Cant add student with ID=1, already exists in db. ID FIRST_NAME LAST_NAME GPA 2 jane roe 3.90 Student 1 was deleted from database. Database contains 1 student record(s). Unknown command: x" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -i <<'CMDS'
+p
+CMDS
+    [ "$status" -eq 0 ]
+    [ "${lines[1]:0:6}" = "2     " ]
+}
+
+@test "Sorted print with top-K and spill files" {
+    run ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 2 jane roe 390
+    ./sdbsc -a 3 bob adams 300
+    ./sdbsc -a 4 ann doe 390
+
+    run ./sdbsc -p --sort gpa --desc --limit 2
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 2 jane roe 3.90 4 ann doe 3.90" ] || {
+        echo "Failed Output: $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -p --sort lname
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 3 bob adams 3.00 1 john doe 3.45 4 ann doe 3.90 2 jane roe 3.90" ]
+
+    # a tiny budget spills the 300 rows into a dozen runs
+    seq 5 304 | awk '{ print $1, "f" $1, "l" ($1 * 7 % 13), $1 * 37 % 401 }' | ./sdbsc -b > /dev/null
+    SDBSC_SORT_MEM=1 ./sdbsc -p --sort lname > sorted.txt
+    SDBSC_SORT_MEM=2000 ./sdbsc -p --sort lname > spilled.txt
+    [ "$(wc -l < spilled.txt)" -eq 305 ]
+    cmp sorted.txt spilled.txt
+    rm -f sorted.txt spilled.txt
+    [ -z "$(ls -A | grep '^.tmp_student.db.sort')" ]
+
+    run ./sdbsc -p --sort grade
+    [ "$status" -eq 2 ]
+}
+
+@test "Backup copies allocated blocks and restores them" {
+    run ./sdbsc -z
+    ./sdbsc -a 1 john doe 345
+    ./sdbsc -a 50000 jane roe 390
+    rm -rf backup.d
+
+    run ./sdbsc -B backup.d
+    [ "$status" -eq 0 ]
+    [ "${lines[0]:0:12}" = "Full backup " ]
+    cmp student.db backup.d/student.db
+    # the holes stay holes
+    [ "$(stat -c %b backup.d/student.db)" -le "$(stat -c %b student.db)" ]
+
+    # the blocks of ids 50000 and 99999, and the header region, which is
+    # mostly a hole in a headerless file
+    ./sdbsc -a 99999 bob adams 300
+    ./sdbsc -d 50000
+    run ./sdbsc -B backup.d --incremental
+    [ "$status" -eq 0 ]
+    [ "$output" = "Incremental backup written to backup.d, 10240 of 6400000 bytes copied." ] || {
+        echo "Failed Output: $output"
+        return 1
+    }
+    cmp student.db backup.d/student.db
+
+    ./sdbsc -p > before.txt
+    run ./sdbsc -z
+    run ./sdbsc -R backup.d
+    [ "$status" -eq 0 ]
+    ./sdbsc -p > after.txt
+    cmp before.txt after.txt
+    rm -rf backup.d before.txt after.txt
+
+    run ./sdbsc -R backup.d
+    [ "$status" -eq 1 ]
+}